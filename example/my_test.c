@@ -47,6 +47,15 @@ void func2(char** ptr)
 	free(*ptr);
 }
 
+/* Runs on a snapshot of the live blocks, so it's safe even while other threads allocate */
+int print_memblock(const _memcheck_block_info_t* block, void* ctx)
+{
+	(void)ctx;
+	printf("- Memblock :: %p, f=%s, l=%" _MEMCHECK_TOU_PRIuZ ", s=%" _MEMCHECK_TOU_PRIuZ "\n",
+		block->ptr, block->file, block->line, block->size);
+	return 0; /* Nonzero would stop the iteration */
+}
+
 
 int main(void)
 {
@@ -106,14 +115,7 @@ int main(void)
 		dontcare = malloc(4444);
 
 		printf("\n[#] Listing current memblocks manually:\n");
-		_memcheck_tou_llist_t* lst = *memcheck_get_memblocks();
-		while (lst) {
-			void*             ptr  = lst->dat1;
-			_memcheck_meta_t* meta = (_memcheck_meta_t*)(lst->dat2);
-			printf("- Memblock :: %p, f=%s, l=%" _MEMCHECK_TOU_PRIuZ ", s=%" _MEMCHECK_TOU_PRIuZ "\n",
-				ptr, meta->file, meta->line, meta->size);
-			lst = lst->prev;
-		}
+		memcheck_foreach_block(print_memblock, NULL);
 #endif
 
 		/* Display statistics */
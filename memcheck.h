@@ -43,21 +43,31 @@
 	
 	You may define -DMEMCHECK_IGNORE to prevent all functionality; memcheck functions in your
 	  code may remain since they will still be defined but as no-op versions of themselves.
+	  To leave out only some files, define MEMCHECK_TU_DISABLE before including memcheck.h in
+	  them: malloc()/calloc()/realloc()/free() stay raw calls there while the rest of the program
+	  is tracked (blocks should then not be passed between tracked and untracked files).
 
 	Also available:
-	  - MEMCHECK_NO_OUTPUT - disable all "debug" output. this overrides memcheck_set_status_fp() (memcheck_stats() will still work as normal when called)
+	  - MEMCHECK_NO_OUTPUT - disable all "debug" output. this overrides memcheck_set_status_fp() (memcheck_stats() will still work as normal when called); output=all in MEMCHECK_OPTIONS turns it back on
 	  - MEMCHECK_PURGE_ON_CLEANUP - when memcheck_cleanup() is called also try to free the remaining memory blocks (if any)
 	  - MEMCHECK_ENABLE_THREADSAFETY - enables global mutex and locking when accessing global memcheck resources (TODO: consider making opt-out instead of opt-in?) (! If you're enabling this either make sure memcheck is the first library you include, or make sure to define _POSIX_C_SOURCE=200809L before including any other (standard) library)
 	  - MEMCHECK_NO_CRITICAL_OUTPUT - normally, realloc() and free() call attempts on non-tracked memory address will output warning message even if debug output is disabled; this option prevents it
+	  - MEMCHECK_FREE_PERMANENT_ON_CLEANUP - when memcheck_cleanup() is called also free the blocks marked as permanent (implied by MEMCHECK_PURGE_ON_CLEANUP)
+	  - MEMCHECK_ENABLE_SHM - compiles in memcheck_shm_open(), which publishes live statistics in a POSIX shared-memory segment for external viewers such as tools/memcheck-top (POSIX only; may need -lrt)
+	  - MEMCHECK_ENABLE_HEAVY_HITTERS - keeps fixed-size space-saving summaries of the call sites with the most allocations and bytes and caps the exact per-site tables at MEMCHECK_MAX_SITES (see memcheck_get_heavy_hitters())
+	  - MEMCHECK_ENABLE_TIMELINE - samples live bytes and blocks per call site at intervals into a ring of time buckets and flags steadily growing sites (see memcheck_report_growth())
+	  - MEMCHECK_ENABLE_TRACE - compiles in memcheck_trace_start(), which streams allocation activity and heap counters as a Chrome trace (for Perfetto / chrome://tracing)
+	  - MEMCHECK_OPTIONS (environment variable, not a macro) - overrides the output, log file, sampling and quarantine defaults at runtime, e.g. MEMCHECK_OPTIONS="output=errors,sample=100,quarantine=4M" (see memcheck_set_options())
 	  - MEMCHECK_FIRE_AND_FORGET - L33t "cleanup for me" option (employs either __attribute__((constructor)) or linker sections(msvc)) (Somewhat experimental)
 
+	C++ code may include memcheck.hpp instead, which adds memcheck::allocator<T> for standard
+	  containers and a few RAII helpers on top of this header.
+
 	Look at example/ to see one way to use it, or look at the function declarations
 	  further down to see all available features.
 
 	TODO:
-	  - instead of removing freed/realloc'd addresses from storage, move them to "already-freed" to detect double-free or use-after-free
 	  - refactor to get rid of recursive locking
-	  - add something like memcheck_*alloc_alright() to tell memcheck to still keep track of that allocation, but not yell if it's not freed at the end(and/or even dealloc them automatically?) (ex. for some long-standing allocations which don't make sense if they are not valid for the entire duration of the program) ?
 	  - Improve output formats
 */
 
@@ -71,14 +81,60 @@
 	#pragma message "Memcheck :: _POSIX_C_SOURCE will be defined to 200809L for pthreads recursive mutex feature"
 	#define _POSIX_C_SOURCE 200809L
 #endif
+#if !defined(_WIN32) && defined(MEMCHECK_ENABLE_SHM) && _POSIX_C_SOURCE < 200809L
+	#pragma message "Memcheck :: _POSIX_C_SOURCE will be defined to 200809L for shared memory feature"
+	#define _POSIX_C_SOURCE 200809L
+#endif
+#if !defined(_WIN32) && defined(MEMCHECK_ENABLE_TRACE) && _POSIX_C_SOURCE < 200809L
+	#pragma message "Memcheck :: _POSIX_C_SOURCE will be defined to 200809L for the monotonic clock of traces"
+	#define _POSIX_C_SOURCE 200809L
+#endif
 
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <signal.h>
+#ifdef _WIN32
+	#include <process.h> /* _getpid() */
+#else
+	#include <unistd.h>  /* getpid() */
+#endif
 
+/* Bytes the allocator really handed out for a block; the requested size where that is unknown */
+#if defined(_WIN32)
+	#include <malloc.h>
+	#define _MEMCHECK_USABLE_SIZE(ptr, size) _msize(ptr)
+#elif defined(__APPLE__)
+	#include <malloc/malloc.h>
+	#define _MEMCHECK_USABLE_SIZE(ptr, size) malloc_size(ptr)
+#elif defined(__GLIBC__) || defined(__ANDROID__)
+	#include <malloc.h>
+	#define _MEMCHECK_USABLE_SIZE(ptr, size) malloc_usable_size(ptr)
+#elif defined(__FreeBSD__)
+	#include <malloc_np.h>
+	#define _MEMCHECK_USABLE_SIZE(ptr, size) malloc_usable_size(ptr)
+#else
+	#define _MEMCHECK_USABLE_SIZE(ptr, size) (size)
+#endif
 
+
+#if defined(MEMCHECK_ENABLE_SHM) && !defined(_WIN32)
+	#define _MEMCHECK_SHM_SUPPORTED
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+#endif
+#if defined(MEMCHECK_ENABLE_TRACE) && defined(_WIN32)
+	#ifndef WIN32_LEAN_AND_MEAN
+	#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#endif
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 #ifdef _WIN32
 	#ifndef WIN32_LEAN_AND_MEAN
@@ -161,6 +217,345 @@ typedef struct _memcheck_tou_llist_s
 /********** END TOU PRINT MACROS **********/
 
 
+/* Global counters as returned by memcheck_get_stats() */
+typedef struct {
+	size_t n_mallocs;
+	size_t n_callocs;
+	size_t n_reallocs;
+	size_t n_total_allocs;
+	size_t n_frees;
+	size_t total_alloc_size;
+	size_t total_free_size;
+	size_t n_permanent;      /* Live blocks in the permanent set (not expected to be freed) */
+	size_t permanent_size;   /* Byte total of those blocks */
+	size_t n_live;           /* Tracked blocks that were not freed yet (permanent ones included) */
+	size_t live_size;        /* Byte total of those blocks */
+	size_t peak_size;        /* Highest live_size seen */
+	size_t live_usable;      /* Bytes the allocator handed out for the live blocks (see memcheck_get_overhead()) */
+} _memcheck_stats_t;
+
+/* Per-call-site counters as returned by memcheck_get_site_stats(). A call site is the file/line
+   of the malloc()/calloc()/realloc() that last (re)allocated a block. */
+typedef struct {
+	const char* file;
+	size_t      line;
+	size_t      n_allocs;   /* malloc()/calloc() calls at this site */
+	size_t      n_reallocs; /* realloc() calls at this site */
+	size_t      n_frees;    /* Frees of blocks attributed to this site */
+	size_t      alloc_size; /* Bytes acquired at this site (a realloc() acquires its whole new size) */
+	size_t      free_size;  /* Bytes released by blocks of this site (a realloc() releases the old size at the old site) */
+	size_t      n_live;     /* Blocks attributed to this site that are still alive */
+	size_t      live_size;  /* Byte total of those blocks */
+	size_t      peak_size;  /* Highest live_size seen */
+	size_t      live_usable; /* Bytes the allocator handed out for them (live_usable - live_size is slack) */
+} _memcheck_site_stats_t;
+
+/* Resize history of the blocks first allocated at a call site, as returned by memcheck_get_realloc_stats().
+   Only realloc()'s of live, non-empty blocks to a non-zero size count as resizes. */
+typedef struct {
+	const char* file;
+	size_t      line;
+	size_t      n_chains;      /* Blocks from this site that were resized at least once */
+	size_t      n_resizes;     /* realloc()'s of those blocks (wherever they were called from) */
+	size_t      max_chain;     /* Most resizes seen on one block */
+	size_t      n_moved;       /* Resizes that returned a different pointer */
+	size_t      n_in_place;    /* Resizes that kept the pointer */
+	size_t      n_growths;     /* Resizes to a bigger size */
+	size_t      n_small_steps; /* Growths by less than MEMCHECK_REALLOC_SMALL_STEP percent of the old size */
+	size_t      bytes_grown;   /* Sum of the size increases */
+	size_t      bytes_copied;  /* Estimated as what a moved block held (old size, or new size when shrinking) */
+	double      mean_growth;   /* Average new/old size ratio of the growths (filled in when queried) */
+} _memcheck_realloc_stats_t;
+
+/* Heavy-hitter call site as returned by memcheck_get_heavy_hitters(). The true weight of the site
+   lies in [weight - error, weight]. */
+typedef struct {
+	const char* file;
+	size_t      line;
+	size_t      weight; /* Allocations or bytes counted for this site (an upper bound) */
+	size_t      error;  /* Most the weight may overestimate by */
+} _memcheck_hh_entry_t;
+
+/* One time bucket of the heap timeline (see memcheck_get_timeline()) */
+typedef struct {
+	time_t time;      /* When the sample was taken */
+	size_t n_live;    /* Live blocks (of the whole program or one site) */
+	size_t live_size; /* Byte total of those blocks */
+} _memcheck_timeline_sample_t;
+
+/* What happens when an allocation would exceed a budget (see memcheck_set_site_budget()); any combination */
+#define MEMCHECK_BUDGET_LOG      0x1 /* Print a line to stderr */
+#define MEMCHECK_BUDGET_CALLBACK 0x2 /* Call the function set with memcheck_set_budget_callback() */
+#define MEMCHECK_BUDGET_FAIL     0x4 /* Return NULL instead of allocating (realloc() leaves the block as it was) */
+
+/* Passed to the budget callback */
+typedef struct {
+	const char* file;      /* Call site of the allocation */
+	size_t      line;
+	const char* tag;       /* Name of the tag whose budget would be exceeded, NULL for a site budget */
+	size_t      live_size; /* Live bytes of the site or tag, without the block being reallocated */
+	size_t      request;   /* Bytes the allocation asks for */
+	size_t      budget;
+	int         action;    /* MEMCHECK_BUDGET_* of the budget */
+} _memcheck_budget_event_t;
+
+/* Budget callback; runs after memcheck has released its lock, on the allocating thread, before the allocation returns */
+typedef void (*_memcheck_budget_fn_t)(const _memcheck_budget_event_t* event, void* ctx);
+
+/* Limits of memcheck_compare_sites(); growths are in percent, negative ones are not checked */
+typedef struct {
+	double max_allocs_growth; /* Of n_allocs (default 10) */
+	double max_bytes_growth;  /* Of alloc_size (default -1) */
+	double max_peak_growth;   /* Of peak_size (default -1) */
+	double max_live_growth;   /* Of live_size (default -1) */
+	int    new_leaks;         /* 1: a site with live blocks that had none in the baseline is a regression (default 1) */
+	size_t min_allocs;        /* Growths of sites with fewer allocations than this in both reports are not checked (default 0) */
+	int    verbose;           /* 1: also list changes within the limits (default 0) */
+} _memcheck_compare_opts_t;
+
+/* Rankings for memcheck_get_heavy_hitters() */
+#define MEMCHECK_HH_COUNT 0 /* malloc()/calloc()/realloc() calls */
+#define MEMCHECK_HH_BYTES 1 /* Bytes requested by them */
+
+/* Memory held by live blocks and by memcheck itself, as returned by memcheck_get_overhead() */
+typedef struct {
+	size_t n_live;         /* Tracked live blocks (permanent ones included) */
+	size_t live_size;      /* Bytes requested for them */
+	size_t live_usable;    /* Bytes the allocator handed out for them (malloc_usable_size() or the platform's
+	                          equivalent; the requested size where there is none) */
+	size_t slack;          /* live_usable - live_size, lost to the allocator's rounding */
+	size_t meta_per_block; /* Bytes memcheck allocates per tracked block (metadata and list node, rounding included) */
+	size_t meta_size;      /* n_live * meta_per_block */
+	size_t table_size;     /* Call-site, tag and thread tables */
+} _memcheck_overhead_t;
+
+/* Resident memory of the process split by what holds it, as returned by memcheck_sample_rss(). The parts add up
+   to about rss; those that can't be told apart on the platform stay 0 and end up in `other`. */
+typedef struct {
+	time_t time;        /* When the sample was taken */
+	size_t rss;         /* Resident set size of the process (0 where it can't be read) */
+	size_t tracked;     /* Bytes requested by the live tracked blocks */
+	size_t slack;       /* Allocator rounding (and chunk headers, where known) of those blocks */
+	size_t overhead;    /* Memcheck's own metadata and tables */
+	size_t untracked;   /* Heap bytes in use that memcheck doesn't know about: allocations from code it doesn't see,
+	                       sampled-out blocks, libraries */
+	size_t fragmented;  /* Free bytes between used chunks, which the allocator can't give back to the system */
+	size_t retained;    /* Free bytes at the top of the heap that the allocator keeps (malloc_trim() would release them) */
+	size_t other;       /* The rest of rss: code, stacks, mappings outside the heap */
+	int    has_heap;    /* 1 if the allocator reported its numbers (untracked, fragmented and retained are valid) */
+} _memcheck_rss_sample_t;
+
+/* Live blocks of one size class, as returned by memcheck_get_size_class() */
+#define MEMCHECK_SIZE_CLASSES 32 /* Class i holds requested sizes up to 2^i (above the previous class); the last one everything larger */
+typedef struct {
+	size_t max_size;    /* Largest requested size in the class (0 for the last, unbounded class) */
+	size_t n_live;
+	size_t live_size;
+	size_t live_usable;
+} _memcheck_size_class_t;
+
+/* One live block as passed to the memcheck_foreach_block() callback */
+typedef struct {
+	void*       ptr;
+	size_t      size;
+	size_t      usable;     /* See _memcheck_overhead_t */
+	const char* file;       /* Call site of the last malloc()/calloc()/realloc() */
+	size_t      line;
+	size_t      tag;
+	size_t      thread;     /* Id of the allocating thread (0 if unknown, MEMCHECK_EXITED_THREADS once it exited) */
+	int         permanent;  /* 1 if the block was marked permanent */
+	int         inherited;  /* 1 if the block was allocated by the parent process (see memcheck_after_fork()) */
+	size_t      generation; /* memcheck_get_generation() value of the block's last change */
+} _memcheck_block_info_t;
+
+/* Callback of memcheck_foreach_block(); returning nonzero stops the iteration */
+typedef int (*_memcheck_block_fn_t)(const _memcheck_block_info_t* block, void* ctx);
+
+/* Blocks freed by memcheck_purge_where(); zero-initialized fields match everything, the set ones must all match */
+typedef struct {
+	const char* file;             /* Call site's file name (compared by name), NULL -> any file */
+	size_t      line;             /* 0 -> any line of `file` */
+	const char* tag;              /* Active tag when the block was allocated, NULL -> any, "" -> untagged blocks only */
+	size_t      since_generation; /* Blocks whose generation (see memcheck_get_generation()) is above this one */
+	size_t      until_generation; /* ... and at most this one, 0 -> no upper bound */
+} _memcheck_purge_filter_t;
+
+/* Output of memcheck_purge_where() */
+#define MEMCHECK_PURGE_QUIET   0 /* Nothing */
+#define MEMCHECK_PURGE_SUMMARY 1 /* One line per site, written after the lock is released */
+#define MEMCHECK_PURGE_BLOCKS  2 /* One line per block, also written after the lock is released and flushed once at the end */
+
+/* Sections for the report writers (memcheck_report_json() takes any combination, memcheck_report_csv() exactly one) */
+#define MEMCHECK_REPORT_STATS   0x01
+#define MEMCHECK_REPORT_THREADS 0x02
+#define MEMCHECK_REPORT_TAGS    0x04
+#define MEMCHECK_REPORT_SITES   0x08
+#define MEMCHECK_REPORT_BLOCKS  0x10
+#define MEMCHECK_REPORT_ALL     0x1f
+
+/* Weights for memcheck_report_folded() */
+#define MEMCHECK_FOLDED_LIVE_BYTES  0
+#define MEMCHECK_FOLDED_ALLOC_BYTES 1
+#define MEMCHECK_FOLDED_ALLOC_COUNT 2
+
+/* Id of the record that holds the counters (and the live blocks) of threads that have exited */
+#define MEMCHECK_EXITED_THREADS ((size_t)-1)
+
+/* Per-thread counters as returned by memcheck_get_thread_stats() */
+typedef struct {
+	size_t id;             /* Memcheck-assigned thread id (1, 2, ... in order of first tracked call; 0 = all threads) */
+	size_t n_allocs;       /* malloc()/calloc() calls made on this thread */
+	size_t n_reallocs;     /* realloc() calls made on this thread */
+	size_t n_frees;        /* free() calls made on this thread */
+	size_t n_live;         /* Blocks allocated by this thread that are still alive */
+	size_t live_size;      /* Byte total of those blocks */
+	size_t n_cross_frees;  /* Frees done by this thread on blocks that another thread allocated */
+	size_t n_remote_frees; /* Blocks allocated by this thread that were freed (or realloc'd) by another thread */
+	double alloc_rate;     /* Allocations per second since the thread's first tracked call */
+	double free_rate;      /* Frees per second since the thread's first tracked call */
+} _memcheck_thread_stats_t;
+
+/* Per-tag counters as returned by memcheck_get_tag_stats() */
+typedef struct {
+	size_t      id;         /* Interned tag id (0 = untagged allocations) */
+	const char* name;       /* Tag name (owned by memcheck, valid until memcheck_cleanup()) */
+	size_t      n_allocs;   /* Allocations made while this tag was on top of the tag stack */
+	size_t      n_reallocs; /* realloc()'s of blocks carrying this tag */
+	size_t      n_frees;    /* Frees of blocks carrying this tag */
+	size_t      n_live;     /* Blocks carrying this tag that are still alive */
+	size_t      live_size;  /* Byte total of those blocks */
+	size_t      peak_size;  /* Highest live_size seen */
+} _memcheck_tag_stats_t;
+
+/* Result of memcheck_leak_check() */
+typedef struct {
+	size_t n_definitely_lost;    /* Unfreed blocks no pointer was found to */
+	size_t definitely_lost_size;
+	size_t n_indirectly_lost;    /* Unfreed blocks only pointed to from lost blocks */
+	size_t indirectly_lost_size;
+	size_t n_reachable;          /* Unfreed blocks still reachable from the roots (including permanent blocks) */
+	size_t reachable_size;
+} _memcheck_leak_summary_t;
+
+#ifndef MEMCHECK_SCAN_THREADS
+#define MEMCHECK_SCAN_THREADS 4 /* Worker threads used by memcheck_leak_check() to scan the heap (pthreads + MEMCHECK_ENABLE_THREADSAFETY only) */
+#endif
+
+#ifndef MEMCHECK_SITE_BUCKETS
+#define MEMCHECK_SITE_BUCKETS 1024 /* Hash buckets of the call-site table */
+#endif
+
+#ifndef MEMCHECK_MAX_SITES
+#ifdef MEMCHECK_ENABLE_HEAVY_HITTERS
+#define MEMCHECK_MAX_SITES MEMCHECK_SITE_BUCKETS /* Call sites given exact stats (0 = no limit); calls at later sites only feed the heavy hitters */
+#else
+#define MEMCHECK_MAX_SITES 0 /* Call sites given exact stats (0 = no limit) */
+#endif
+#endif
+
+#ifndef MEMCHECK_FILTER_BUCKETS
+#define MEMCHECK_FILTER_BUCKETS 1024 /* Hash buckets of the cached call-site filter decisions */
+#endif
+
+#ifndef MEMCHECK_TAG_STACK_DEPTH
+#define MEMCHECK_TAG_STACK_DEPTH 32 /* Max nesting of memcheck_push_tag() per thread; deeper pushes are ignored */
+#endif
+
+#ifndef MEMCHECK_REPORT_BATCH
+#define MEMCHECK_REPORT_BATCH 1024 /* Live blocks copied per acquisition of the lock by reports with MEMCHECK_REPORT_BLOCKS */
+#endif
+
+#ifndef MEMCHECK_STATS_TOP_LEAKS
+#define MEMCHECK_STATS_TOP_LEAKS 20 /* Largest unfreed blocks (and call sites holding the most) listed by memcheck_stats() */
+#endif
+
+#ifndef MEMCHECK_REALLOC_SMALL_STEP
+#define MEMCHECK_REALLOC_SMALL_STEP 25 /* Growths by less than this percentage of the old size count as small steps */
+#endif
+
+#ifndef MEMCHECK_REALLOC_MIN_STEPS
+#define MEMCHECK_REALLOC_MIN_STEPS 16 /* Small steps a site needs (and at least half of its resizes) to be listed by memcheck_report_realloc() */
+#endif
+
+#ifndef MEMCHECK_HH_SLOTS
+#define MEMCHECK_HH_SLOTS 64 /* Sites monitored per heavy-hitter ranking; any site with more than 1/MEMCHECK_HH_SLOTS of the total is among them */
+#endif
+
+#ifndef MEMCHECK_TIMELINE_INTERVAL
+#define MEMCHECK_TIMELINE_INTERVAL 10 /* Seconds between timeline samples (taken by the first tracked call after that) */
+#endif
+
+#ifndef MEMCHECK_TIMELINE_BUCKETS
+#define MEMCHECK_TIMELINE_BUCKETS 32 /* Samples kept in the timeline ring (per call site and for the whole program) */
+#endif
+
+#ifndef MEMCHECK_TIMELINE_TREND
+#define MEMCHECK_TIMELINE_TREND 6 /* Consecutive samples of growing live bytes that make memcheck_report_growth() flag a site */
+#endif
+
+#ifndef MEMCHECK_RSS_SAMPLES
+#define MEMCHECK_RSS_SAMPLES 32 /* Process memory samples kept for memcheck_report_rss() */
+#endif
+
+#ifndef MEMCHECK_TRACE_LARGE
+#define MEMCHECK_TRACE_LARGE 65536 /* Allocations and frees of at least this many bytes become instant events in traces */
+#endif
+
+#ifndef MEMCHECK_TRACE_RATE
+#define MEMCHECK_TRACE_RATE 1000 /* Instant events per second written to a trace; the rest are dropped (and counted) */
+#endif
+
+#ifndef MEMCHECK_TRACE_COUNTER_INTERVAL
+#define MEMCHECK_TRACE_COUNTER_INTERVAL 10000 /* Microseconds between the counter events of a trace */
+#endif
+
+#ifndef MEMCHECK_SHM_TAGS
+#define MEMCHECK_SHM_TAGS 16 /* Tags (with the most live bytes) published in the shared-memory segment */
+#endif
+
+#ifndef MEMCHECK_SHM_SITES
+#define MEMCHECK_SHM_SITES 16 /* Call sites (with the most live bytes) published in the shared-memory segment */
+#endif
+
+#ifndef MEMCHECK_SHM_REFRESH
+#define MEMCHECK_SHM_REFRESH 1024 /* Tracked calls between refreshes of the tag/site summaries in the segment */
+#endif
+
+/* Layout of the shared-memory segment (see memcheck_shm_open()). Readers and writer must agree on MEMCHECK_SHM_* */
+#define MEMCHECK_SHM_MAGIC   0x4d434b53 /* "MCKS" */
+#define MEMCHECK_SHM_VERSION 2
+
+typedef struct {
+	char   name[32];   /* Truncated to its tail if longer */
+	size_t n_live;
+	size_t live_size;
+	size_t peak_size;
+} _memcheck_shm_tag_t;
+
+typedef struct {
+	char   file[96];   /* Truncated to its tail if longer */
+	size_t line;
+	size_t n_allocs;
+	size_t n_live;
+	size_t live_size;
+} _memcheck_shm_site_t;
+
+typedef struct {
+	size_t               magic;        /* MEMCHECK_SHM_MAGIC */
+	size_t               version;      /* MEMCHECK_SHM_VERSION */
+	size_t               size;         /* sizeof(_memcheck_shm_t) in the writer */
+	size_t               pid;
+	volatile size_t      seq;          /* Odd while the writer is updating the segment */
+	size_t               n_updates;    /* Number of tracked calls published */
+	size_t               summary_time; /* time() of the last tag/site summary refresh */
+	_memcheck_stats_t    stats;        /* Updated on every tracked call */
+	size_t               n_tags;       /* Used entries of tags[], most live bytes first */
+	_memcheck_shm_tag_t  tags[MEMCHECK_SHM_TAGS];
+	size_t               n_sites;      /* Used entries of sites[] (sites with live blocks), most live bytes first */
+	_memcheck_shm_site_t sites[MEMCHECK_SHM_SITES];
+} _memcheck_shm_t;
+
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -179,7 +574,9 @@ void  memcheck_set_status_fp(FILE* fp);  /* Set which FILE* to be used for immed
                                             will be redirected to /dev/null. This will cause memcheck itself to manage that FILE*.
                                             If you want to manage the FILE* yourself, open it using fopen() and pass it in here */
 FILE* memcheck_get_status_fp(void);      /* Returns the currently used status_fp inside memcheck. (Defaults to stdout) */
-void  memcheck_set_tracking(int yn);     /* Whether to perform call tracking (dynamically turn memcheck on and off) (1 = yes, 0 = no) */
+void  memcheck_set_tracking(int yn);     /* Whether to perform call tracking (dynamically turn memcheck on and off) (1 = yes, 0 = no).
+                                            While tracking is off, the allocation functions only do one atomic load (no lock)
+                                             before forwarding to the real ones. */
 int   memcheck_is_tracking(void);        /* Retrieves current setting for controlling call tracking (1 = yes, 0 = no) */
 void  memcheck_cleanup(void);            /* Destroys the internal memory blocks storage and closes status_fp if memcheck
                                             is managing it (Only a case when you let it do so using memcheck_set_status_fp(NULL)).
@@ -187,9 +584,233 @@ void  memcheck_cleanup(void);            /* Destroys the internal memory blocks
                                             Note: you will NOT get memcheck warnings if you forget to call memcheck_cleanup()! */
 void  memcheck_stats_reset(void);        /* Resets all statistics tracked to 0 */
 void  memcheck_purge_remaining(void);    /* Attempts to perform free() on all of the remaining memblocks that are being tracked */
+size_t memcheck_purge_where(const _memcheck_purge_filter_t* filter, int output);
+                                         /* Frees the tracked blocks that match `filter` (NULL -> all of them) in one pass over
+                                             the list, e.g. everything a test case allocated since a memcheck_get_generation()
+                                             reading. Permanent blocks are left alone. `output` is one of MEMCHECK_PURGE_*
+                                             (to memcheck_get_status_fp()). Returns the number of blocks freed */
+
+/* Queries and machine-readable reports */
+void  memcheck_get_stats(_memcheck_stats_t* out); /* Copies the global counters shown by memcheck_stats() */
+size_t memcheck_get_site_count(void);    /* Returns the number of distinct call sites seen so far */
+int   memcheck_get_site_stats(size_t idx, _memcheck_site_stats_t* out);
+                                         /* Fills `out` with counters of the idx-th site (0 <= idx < memcheck_get_site_count(),
+                                             in order of first use). Returns 1 on success, 0 if idx is out of range */
+size_t memcheck_report_json(FILE* fp, int sections); /* Streams the selected MEMCHECK_REPORT_* sections as one JSON object
+                                                        (one array element per line). Returns the number of bytes written */
+size_t memcheck_report_json_buf(char* buf, size_t cap, int sections);
+                                         /* Same, but into `buf`; like snprintf() the output is truncated to cap-1 bytes
+                                             plus a '\0' and the full length is returned */
+size_t memcheck_report_csv(FILE* fp, int section); /* Streams one MEMCHECK_REPORT_* section as CSV with a header row */
+size_t memcheck_report_csv_buf(char* buf, size_t cap, int section); /* Same, but into `buf` (see memcheck_report_json_buf()) */
+size_t memcheck_report_pprof(FILE* fp);  /* Writes the per-site counters as a pprof heap profile (uncompressed profile.proto,
+                                             one synthetic "file:line" frame per site). Open `fp` in binary mode.
+                                             Returns the number of bytes written */
+size_t memcheck_report_folded(FILE* fp, int weight); /* Writes one folded stack line ("dir;file.c:line value") per call site,
+                                                        weighted by MEMCHECK_FOLDED_*, for flamegraph.pl and compatible tools.
+                                                        Sites with a zero weight are left out. Returns the number of bytes written */
+size_t memcheck_report_folded_buf(char* buf, size_t cap, int weight); /* Same, but into `buf` (see memcheck_report_json_buf()) */
+int   memcheck_get_realloc_stats(size_t idx, _memcheck_realloc_stats_t* out);
+                                         /* Fills `out` with the resize history of the blocks first allocated at the idx-th
+                                             site (indexed like memcheck_get_site_stats()). Returns 1 on success, 0 if idx is out of range */
+size_t memcheck_report_realloc(FILE* fp); /* Lists the sites whose blocks grow through many small realloc() steps (see
+                                              MEMCHECK_REALLOC_SMALL_STEP), most bytes copied first, to `fp` (NULL ->
+                                              memcheck_get_status_fp()). Returns the number of sites listed */
+void  memcheck_get_overhead(_memcheck_overhead_t* out); /* Fills `out` with requested/usable bytes of the live blocks and memcheck's own overhead */
+int   memcheck_get_size_class(size_t idx, _memcheck_size_class_t* out);
+                                         /* Fills `out` with the live blocks of size class idx (0 <= idx < MEMCHECK_SIZE_CLASSES).
+                                             Returns 1 on success, 0 if idx is out of range */
+size_t memcheck_report_slack(FILE* fp, size_t max_sites);
+                                         /* Prints the allocator slack of the live blocks overall, per size class and for the
+                                             `max_sites` sites with the most of it, plus memcheck's own overhead, to `fp`
+                                             (NULL -> memcheck_get_status_fp()). Returns the number of sites listed */
+int   memcheck_sample_rss(_memcheck_rss_sample_t* out); /* Reads the process's resident memory and the allocator's numbers, sets
+                                             them against the tracked bytes and keeps the sample for memcheck_report_rss()
+                                             (the timeline takes one with each of its samples). Copies it to `out` unless NULL.
+                                             Returns 1 on success, 0 if the platform doesn't tell the resident size */
+size_t memcheck_get_rss_samples(_memcheck_rss_sample_t* out, size_t max);
+                                         /* Copies up to `max` of the most recent samples into `out`, oldest first. Returns the number copied */
+size_t memcheck_report_rss(FILE* fp);    /* Takes a sample and prints how resident memory splits up and how each part moved over the
+                                             kept samples to `fp` (NULL -> memcheck_get_status_fp()). Returns the number of samples listed */
+
+/* Dumps of running processes */
+size_t memcheck_dump(FILE* fp);          /* Copies the global and per-site counters under the lock and writes them to `fp`
+                                             (NULL -> memcheck_get_status_fp()) after releasing it, in the format of
+                                             memcheck_report_json(MEMCHECK_REPORT_STATS | MEMCHECK_REPORT_SITES).
+                                             Returns the number of bytes written */
+int   memcheck_set_dump_signal(int signo, FILE* fp); /* Installs a handler for `signo` (e.g. SIGUSR1) that only requests a dump.
+                                                        The dump is written to `fp` (NULL -> memcheck_get_status_fp()) by the
+                                                        next tracked call or memcheck_dump_poll(). Returns 1 on success */
+int   memcheck_dump_poll(void);          /* Writes the requested dump, if any (for service threads). Returns 1 if it did */
+int   memcheck_dump_process(const char* dir); /* Writes memcheck_dump() to "<dir>/memcheck.<pid>.json" (NULL -> "."), e.g. when
+                                                  each worker of a prefork server exits; tools/memcheck-merge adds such dumps up
+                                                  per site. Returns 1 on success */
+size_t memcheck_load_sites(FILE* fp, _memcheck_site_stats_t** out);
+                                         /* Reads the "sites" records of a memcheck_report_json() or memcheck_dump() document
+                                             into a malloc()'d array stored in `out` (release it with memcheck_free_sites()).
+                                             Works with MEMCHECK_IGNORE too. Returns the number of sites read */
+void  memcheck_free_sites(_memcheck_site_stats_t* sites, size_t n); /* Releases the result of memcheck_load_sites() */
+
+/* Baseline comparison */
+void  memcheck_compare_defaults(_memcheck_compare_opts_t* opts); /* Fills `opts` with the defaults */
+size_t memcheck_compare_sites(const _memcheck_site_stats_t* base, size_t n_base, const _memcheck_site_stats_t* cur, size_t n_cur,
+                              const _memcheck_compare_opts_t* opts, FILE* fp);
+                                         /* Matches the sites of two reports by file name and line and prints to `fp` (NULL ->
+                                             stderr) the ones that grew beyond the limits of `opts` (NULL -> defaults), the new
+                                             leaking sites and the change of the totals over all sites. Works with
+                                             MEMCHECK_IGNORE too. Returns the number of regressions */
+size_t memcheck_compare_baseline(FILE* baseline, FILE* fp, const _memcheck_compare_opts_t* opts);
+                                         /* Same, comparing the current call sites with a report read from `baseline`
+                                             (written earlier by memcheck_dump() or memcheck_report_json()).
+                                             Output goes to `fp` (NULL -> memcheck_get_status_fp()) */
+
+/* Processes that fork */
+size_t memcheck_after_fork(void);        /* To be run in the child after fork(): the blocks inherited from the parent join the
+                                             permanent set (flagged as inherited, so they are not reported as the child's leaks,
+                                             and taken out of the per-site counters, so worker dumps don't repeat them),
+                                             the child's event counters start over (see memcheck_stats_reset()) and the parent's
+                                             shared-memory segment and trace are let go. Threadsafe POSIX builds run it
+                                             automatically through pthread_atfork(), which also keeps fork() from copying a locked
+                                             mutex into the child and flushes the log and trace before forking (that handler logs
+                                             nothing); other builds flush those streams before fork() and call it right after.
+                                             Returns the number of inherited blocks (0 if it already ran in this process) */
+
+/* Heavy hitters (MEMCHECK_ENABLE_HEAVY_HITTERS) */
+size_t memcheck_get_heavy_hitters(int by, _memcheck_hh_entry_t* out, size_t max, size_t* total);
+                                         /* Copies up to `max` of the monitored sites, heaviest first, ranked by MEMCHECK_HH_COUNT
+                                             or MEMCHECK_HH_BYTES. `total` (may be NULL) receives the weight of all calls seen, so
+                                             every site above total / MEMCHECK_HH_SLOTS is guaranteed to be listed.
+                                             Returns the number of entries copied (0 if heavy hitters are not compiled in) */
+size_t memcheck_report_heavy_hitters(FILE* fp); /* Prints both rankings with their error bounds to `fp` (NULL -> memcheck_get_status_fp()).
+                                                   Returns the number of entries printed */
+
+/* Heap timeline (MEMCHECK_ENABLE_TIMELINE) */
+void  memcheck_timeline_tick(void);      /* Takes a timeline sample now (e.g. from a service thread in a program that rarely allocates) */
+size_t memcheck_get_timeline(_memcheck_timeline_sample_t* out, size_t max);
+                                         /* Copies up to `max` of the most recent whole-program samples into `out`, oldest first.
+                                             Returns the number copied (0 if the timeline is not compiled in) */
+size_t memcheck_get_site_timeline(size_t idx, _memcheck_timeline_sample_t* out, size_t max);
+                                         /* Same for the idx-th call site (indexed like memcheck_get_site_stats()) */
+size_t memcheck_report_growth(FILE* fp); /* Lists the sites whose live bytes grew in each of the last MEMCHECK_TIMELINE_TREND
+                                             samples or more to `fp` (NULL -> memcheck_get_status_fp()). Returns their number */
+
+/* Chrome trace export (MEMCHECK_ENABLE_TRACE) */
+int   memcheck_trace_start(FILE* fp);    /* Starts streaming a Chrome Trace Event JSON document to `fp`: counters of live bytes
+                                             (total, per tag, per thread) every MEMCHECK_TRACE_COUNTER_INTERVAL us and an instant
+                                             event for every malloc()/calloc()/realloc()/free() of at least MEMCHECK_TRACE_LARGE
+                                             bytes, at most MEMCHECK_TRACE_RATE of them per second. Timestamps use the monotonic
+                                             clock. Returns 1 on success, 0 if traces are not compiled in */
+void  memcheck_trace_stop(void);         /* Writes the last counters and closes the JSON document (also done by memcheck_cleanup()).
+                                             `fp` is left open */
+
+/* Live statistics in shared memory (MEMCHECK_ENABLE_SHM, POSIX only) */
+int   memcheck_shm_open(const char* name); /* Creates the shared-memory segment `name` (NULL -> "/memcheck.<pid>") and keeps
+                                               it up to date from then on. Returns 1 on success, 0 on failure or if shared
+                                               memory support is not compiled in */
+void  memcheck_shm_update(void);         /* Refreshes the tag/site summaries in the segment now (they are otherwise refreshed
+                                             every MEMCHECK_SHM_REFRESH tracked calls) */
+void  memcheck_shm_close(void);          /* Unmaps and removes the segment (also done by memcheck_cleanup()) */
+int   memcheck_shm_read(const _memcheck_shm_t* shm, _memcheck_shm_t* out);
+                                         /* For readers: copies a consistent snapshot of a mapped segment (at least
+                                             sizeof(_memcheck_shm_t) bytes). Works with MEMCHECK_IGNORE too. Returns 1 on
+                                             success, 0 if it is not a compatible segment or the writer kept it busy */
+
+/* Leak classification */
+int   memcheck_leak_check(FILE* fp, _memcheck_leak_summary_t* out);
+                                         /* Conservatively scans the roots (static data and the calling thread's stack and registers;
+                                             Linux only) and then the contents of reached blocks for pointers into tracked blocks,
+                                             classifying every unfreed block as definitely lost, indirectly lost or still reachable.
+                                             Prints a summary and the lost blocks to `fp` (NULL -> memcheck_get_status_fp()) and
+                                             fills `out` if given. Other threads' stacks and thread-local storage are not scanned,
+                                             so blocks only they point to are reported as lost. The global lock is held for the
+                                             whole scan, so every tracked call in other threads waits for it.
+                                             Returns 1 if nothing was lost, otherwise 0. */
+
+/* Permanent (intentionally long-lived) allocations */
+int   memcheck_mark_permanent(void* ptr); /* Moves a tracked block into the "permanent" set: it still counts towards live bytes
+                                             but is left out of the leak listing and of memcheck_stats()'s return value.
+                                             Permanent blocks are free()'d by memcheck_cleanup() if MEMCHECK_PURGE_ON_CLEANUP or
+                                             MEMCHECK_FREE_PERMANENT_ON_CLEANUP is defined. Returns 1 if the block was found. */
+void* memcheck_malloc_permanent(size_t size, const char* file, size_t line);            /* malloc() + memcheck_mark_permanent() */
+void* memcheck_calloc_permanent(size_t num, size_t size, const char* file, size_t line); /* calloc() + memcheck_mark_permanent() */
+
+/* Threads */
+size_t memcheck_get_thread_id(void);     /* Returns memcheck's id for the calling thread (assigned on its first tracked call) */
+size_t memcheck_get_thread_count(void);  /* Returns the number of threads that made at least one tracked call */
+int   memcheck_get_thread_stats(size_t id, _memcheck_thread_stats_t* out);
+                                         /* Fills `out` with counters of the thread with the given id, or with
+                                             the sum over all threads if id is 0. Returns 1 on success, 0 if
+                                             no such thread was seen (or it exited: its counters are then in
+                                             MEMCHECK_EXITED_THREADS, with threadsafety enabled). */
+
+/* Tags */
+size_t memcheck_intern_tag(const char* name); /* Returns the id for the given tag name, registering it if needed.
+                                                 Ids stay valid until memcheck_cleanup(). */
+void  memcheck_push_tag(const char* name); /* Every allocation made by this thread until the matching memcheck_pop_tag()
+                                              is attributed to `name` (nested pushes override the outer ones) */
+void  memcheck_push_tag_id(size_t id);   /* Same as memcheck_push_tag(), but with an id from memcheck_intern_tag() (no string lookup) */
+void  memcheck_pop_tag(void);            /* Restores the tag that was active before the last push on this thread */
+size_t memcheck_get_tag_count(void);     /* Returns the number of interned tags (including the implicit "untagged" tag with id 0) */
+size_t memcheck_get_tag_epoch(void);     /* Returns a counter (starting at 1) that memcheck_cleanup() bumps when it drops the tag
+                                             table, so cached ids can be re-interned once it changes. Lock-free */
+int   memcheck_get_tag_stats(size_t id, _memcheck_tag_stats_t* out);
+                                         /* Fills `out` with counters of the given tag. Returns 1 on success, 0 if no such tag */
+
+/* Memory budgets */
+int   memcheck_set_site_budget(const char* file, size_t line, size_t bytes, int action);
+                                         /* Limits the live bytes of the call site file:line (line 0: of every site in `file`,
+                                             each on its own) to `bytes`; an allocation that would go over runs the
+                                             MEMCHECK_BUDGET_* `action`. Files are matched by name, also for sites not seen yet.
+                                             `bytes` 0 removes the budget. Returns 1 on success, 0 if out of memory */
+int   memcheck_set_tag_budget(const char* name, size_t bytes, int action);
+                                         /* Same for the live bytes of a tag (see memcheck_push_tag()) */
+void  memcheck_set_budget_callback(_memcheck_budget_fn_t fn, void* ctx); /* Sets the function of MEMCHECK_BUDGET_CALLBACK */
+size_t memcheck_report_budgets(FILE* fp); /* Lists the sites and tags with a budget, their live and peak bytes and how often
+                                              the budget was hit, to `fp` (NULL -> memcheck_get_status_fp()).
+                                              Returns the number of budgets that were hit */
+
+/* Runtime options */
+int   memcheck_set_options(const char* options);
+                                         /* Applies comma- or space-separated key=value options, the same as the MEMCHECK_OPTIONS
+                                             environment variable (read on the first tracked allocation):
+                                               output=all|errors|none  log every call / only [!!] warnings / nothing
+                                               log=stdout|stderr|none|<path>  where the per-call log goes (a file is appended to)
+                                               sample=N                track one of every N malloc()'s and calloc()'s per thread
+                                               quarantine=BYTES[k|M|G] hold freed blocks back, filled with a pattern, to catch
+                                                                       double frees and writes after free (0: off)
+                                               track=0|1, include=PATTERN, exclude=PATTERN  (memcheck_set_tracking(), filters)
+                                             Values can't be quoted, so a log path or a pattern can't contain a comma or a space.
+                                             Sizes that don't fit in a size_t are rejected.
+                                             The implementations are picked once per change, not tested on every call.
+                                             Returns 1 if every option was applied, 0 if one was unknown or invalid */
+
+/* Call-site filters */
+int   memcheck_filter_include(const char* pattern);
+                                         /* Tracks only the malloc()'s and calloc()'s of call sites whose file name matches one of
+                                             the include patterns ('*' matches any characters including '/', '?' one character;
+                                             a trailing ":<line>" also requires that line), e.g. "*src/net*". Each site is
+                                             matched once; later calls from it read the cached decision without the lock.
+                                             Returns 1 on success, 0 if out of memory */
+int   memcheck_filter_exclude(const char* pattern);
+                                         /* Same, leaving out the matching sites (exclude patterns win over include patterns) */
+void  memcheck_filter_clear(void);       /* Removes all patterns, tracking every site again */
+
+/* Live block iteration */
+size_t memcheck_foreach_block(_memcheck_block_fn_t fn, void* ctx);
+                                         /* Calls fn() for every live block (regular ones oldest first, then permanent ones).
+                                             The blocks are copied under the lock and fn() runs after it is released, so
+                                             fn() may allocate and other threads are not held up by the iteration.
+                                             Returns the generation of the snapshot, 0 if it could not be taken */
+size_t memcheck_foreach_block_since(size_t generation, _memcheck_block_fn_t fn, void* ctx);
+                                         /* Same, but only for blocks allocated, resized or marked permanent after
+                                             `generation` (the value returned by a previous iteration) */
+size_t memcheck_get_generation(void);    /* Returns a counter that every tracked allocation, resize, free and
+                                             memcheck_mark_permanent() increments */
 
 /* Special */
-_memcheck_tou_llist_t** memcheck_get_memblocks(void); /* Returns a reference to the internal memory blocks storage */
+_memcheck_tou_llist_t** memcheck_get_memblocks(void); /* Returns a reference to the internal memory blocks storage.
+                                                         The list is not protected once this returns: with other threads
+                                                         running use memcheck_foreach_block() instead */
 
 /* Internal (but may use explicitly) */
 /* If MEMCHECK_IGNORE is defined these will simply pass their parameters to their stdlib counterparts ignoring file and line data */
@@ -202,6 +823,20 @@ void  memcheck_free(void* ptr, const char* file, size_t line);
 }
 #endif
 
+#ifdef __cplusplus
+/* Keeps a tag pushed for the lifetime of the guard:  { memcheck_tag_guard guard("parser"); ... } */
+class memcheck_tag_guard
+{
+public:
+	explicit memcheck_tag_guard(const char* name) { memcheck_push_tag(name); }
+	explicit memcheck_tag_guard(size_t id)        { memcheck_push_tag_id(id); }
+	~memcheck_tag_guard()                         { memcheck_pop_tag(); }
+private:
+	memcheck_tag_guard(const memcheck_tag_guard&);
+	memcheck_tag_guard& operator=(const memcheck_tag_guard&);
+};
+#endif
+
 #endif /* _MEMCHECK_H_ */
 
 
@@ -218,6 +853,359 @@ void  memcheck_free(void* ptr, const char* file, size_t line);
 #pragma message ("-- Memcheck active (implementation).")
 
 
+/* Seqlock primitives for the shared-memory segment */
+#if defined(__GNUC__) || defined(__clang__)
+#	define _MEMCHECK_SEQ_LOAD(seq)     __atomic_load_n(&(seq), __ATOMIC_ACQUIRE)
+#	define _MEMCHECK_SEQ_STORE(seq, v) __atomic_store_n(&(seq), (v), __ATOMIC_RELEASE)
+#	define _MEMCHECK_SEQ_FENCE()       __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#	define _MEMCHECK_SEQ_LOAD(seq)     (seq)
+#	define _MEMCHECK_SEQ_STORE(seq, v) ((seq) = (v))
+#	define _MEMCHECK_SEQ_FENCE()       ((void)0)
+#endif
+
+/* Needed by viewers, so it is the same with and without MEMCHECK_IGNORE */
+int memcheck_shm_read(const _memcheck_shm_t* shm, _memcheck_shm_t* out)
+{
+	int tries;
+
+	if (shm == NULL || out == NULL)
+		return 0;
+	for (tries = 0; tries < 1000; tries++) {
+		size_t seq = _MEMCHECK_SEQ_LOAD(shm->seq);
+		if (seq & 1)
+			continue;
+		memcpy(out, (const void*)shm, sizeof(*out));
+		_MEMCHECK_SEQ_FENCE();
+		if (_MEMCHECK_SEQ_LOAD(shm->seq) == seq)
+			return out->magic == MEMCHECK_SHM_MAGIC && out->version == MEMCHECK_SHM_VERSION && out->size == sizeof(*out);
+	}
+	return 0;
+}
+
+
+/* Reads a line of any length into *buf (grown as needed). Returns 0 at the end of the file */
+static int _memcheck_read_line(FILE* fp, char** buf, size_t* cap)
+{
+	size_t len = 0;
+	int c;
+
+	for (;;) {
+		c = getc(fp);
+		if (len + 1 >= *cap) {
+			size_t new_cap = (*cap > 0) ? *cap * 2 : 256;
+			char* grown = (char*) realloc(*buf, new_cap);
+			if (grown == NULL)
+				return 0;
+			*buf = grown;
+			*cap = new_cap;
+		}
+		if (c == EOF || c == '\n')
+			break;
+		(*buf)[len++] = (char)c;
+	}
+	(*buf)[len] = '\0';
+	return c != EOF || len > 0;
+}
+
+
+/* Copies the JSON string starting at the opening quote `s` into a malloc()'d string; *end is set past the closing quote */
+static char* _memcheck_parse_json_str(const char* s, const char** end)
+{
+	char* copy = (char*) malloc(strlen(s) + 1);
+	char* d = copy;
+
+	if (copy == NULL)
+		return NULL;
+	for (s++; *s != '\0' && *s != '"'; s++) {
+		if (*s != '\\' || s[1] == '\0') {
+			*d++ = *s;
+			continue;
+		}
+		switch (*++s) {
+		case 'n': *d++ = '\n'; break;
+		case 'r': *d++ = '\r'; break;
+		case 't': *d++ = '\t'; break;
+		case 'u': {
+			unsigned v = 0;
+			int k;
+			for (k = 0; k < 4; k++, s++) {
+				char h = s[1];
+				if (h >= '0' && h <= '9')      v = v * 16 + (unsigned)(h - '0');
+				else if (h >= 'a' && h <= 'f') v = v * 16 + (unsigned)(h - 'a' + 10);
+				else if (h >= 'A' && h <= 'F') v = v * 16 + (unsigned)(h - 'A' + 10);
+				else break;
+			}
+			*d++ = (char)v;
+			break;
+		}
+		default: *d++ = *s; break; /* \" \\ \/ */
+		}
+	}
+	*d = '\0';
+	*end = (*s == '"') ? s + 1 : s;
+	return copy;
+}
+
+
+/* Fills `site` from one {"file":..,"line":..,...} record; unknown fields are skipped. Returns 0 if there is no file */
+static int _memcheck_parse_site(const char* s, _memcheck_site_stats_t* site)
+{
+	const char* names[10];
+	size_t* fields[10];
+	size_t k;
+
+	memset(site, 0, sizeof(*site));
+	names[0] = "line";        fields[0] = &site->line;
+	names[1] = "n_allocs";    fields[1] = &site->n_allocs;
+	names[2] = "n_reallocs";  fields[2] = &site->n_reallocs;
+	names[3] = "n_frees";     fields[3] = &site->n_frees;
+	names[4] = "alloc_size";  fields[4] = &site->alloc_size;
+	names[5] = "free_size";   fields[5] = &site->free_size;
+	names[6] = "n_live";      fields[6] = &site->n_live;
+	names[7] = "live_size";   fields[7] = &site->live_size;
+	names[8] = "peak_size";   fields[8] = &site->peak_size;
+	names[9] = "live_usable"; fields[9] = &site->live_usable;
+
+	for (s++; *s == '"'; s++) {
+		const char* key = s + 1;
+		const char* key_end = strchr(key, '"');
+		size_t key_len;
+		if (key_end == NULL || key_end[1] != ':')
+			break;
+		key_len = (size_t)(key_end - key);
+		s = key_end + 2;
+		if (*s == '"') {
+			char* str = _memcheck_parse_json_str(s, &s);
+			if (key_len == 4 && memcmp(key, "file", 4) == 0 && site->file == NULL)
+				site->file = str;
+			else
+				free(str);
+		} else {
+			size_t v = 0;
+			for (; *s >= '0' && *s <= '9'; s++)
+				v = v * 10 + (size_t)(*s - '0');
+			for (k = 0; k < 10; k++) {
+				if (strlen(names[k]) == key_len && memcmp(names[k], key, key_len) == 0) {
+					*fields[k] = v;
+					break;
+				}
+			}
+			while (*s != '\0' && *s != ',' && *s != '}')
+				s++;
+		}
+		if (*s != ',')
+			break;
+	}
+	return site->file != NULL;
+}
+
+
+/* Needed by tools, so it is the same with and without MEMCHECK_IGNORE. Site records are recognized by
+   starting a line with "file" (block records start with "ptr", thread and tag records with "id") */
+size_t memcheck_load_sites(FILE* fp, _memcheck_site_stats_t** out)
+{
+	_memcheck_site_stats_t* sites = NULL;
+	size_t n = 0, cap = 0;
+	char* line = NULL;
+	size_t line_cap = 0;
+
+	if (out == NULL)
+		return 0;
+	*out = NULL;
+	if (fp == NULL)
+		return 0;
+	while (_memcheck_read_line(fp, &line, &line_cap)) {
+		_memcheck_site_stats_t site;
+		if (strncmp(line, "{\"file\":", 8) != 0 || !_memcheck_parse_site(line, &site))
+			continue;
+		if (n == cap) {
+			size_t new_cap = (cap > 0) ? cap * 2 : 64;
+			_memcheck_site_stats_t* grown = (_memcheck_site_stats_t*) realloc(sites, new_cap * sizeof(*sites));
+			if (grown == NULL) {
+				free((char*)site.file);
+				break;
+			}
+			sites = grown;
+			cap = new_cap;
+		}
+		sites[n++] = site;
+	}
+	free(line);
+	*out = sites;
+	return n;
+}
+
+
+void memcheck_free_sites(_memcheck_site_stats_t* sites, size_t n)
+{
+	size_t i;
+	if (sites == NULL)
+		return;
+	for (i = 0; i < n; i++)
+		free((char*)sites[i].file);
+	free(sites);
+}
+
+
+void memcheck_compare_defaults(_memcheck_compare_opts_t* opts)
+{
+	opts->max_allocs_growth = 10.0;
+	opts->max_bytes_growth  = -1.0;
+	opts->max_peak_growth   = -1.0;
+	opts->max_live_growth   = -1.0;
+	opts->new_leaks         = 1;
+	opts->min_allocs        = 0;
+	opts->verbose           = 0;
+}
+
+
+static int _memcheck_compare_by_site(const void* a, const void* b)
+{
+	const _memcheck_site_stats_t* x = *(const _memcheck_site_stats_t* const*) a;
+	const _memcheck_site_stats_t* y = *(const _memcheck_site_stats_t* const*) b;
+	int c = strcmp((x->file != NULL) ? x->file : "", (y->file != NULL) ? y->file : "");
+	if (c != 0)
+		return c;
+	return (x->line > y->line) - (x->line < y->line);
+}
+
+
+/* Sorted copy of the pointers, so that both reports can be walked side by side */
+static const _memcheck_site_stats_t** _memcheck_compare_sorted(const _memcheck_site_stats_t* sites, size_t n)
+{
+	const _memcheck_site_stats_t** sorted = (const _memcheck_site_stats_t**) malloc((n + 1) * sizeof(*sorted));
+	size_t i;
+	if (sorted == NULL)
+		return NULL;
+	for (i = 0; i < n; i++)
+		sorted[i] = &sites[i];
+	if (n > 0)
+		qsort((void*)sorted, n, sizeof(*sorted), _memcheck_compare_by_site);
+	return sorted;
+}
+
+
+/* Prints the counters that changed; those that grew beyond their limit are marked. Returns 1 if any did */
+static int _memcheck_compare_print(FILE* fp, const char* file, size_t line, const _memcheck_site_stats_t* b,
+                                   const _memcheck_site_stats_t* c, const _memcheck_compare_opts_t* opts, int check)
+{
+	const char* names[4];
+	size_t vb[4], vc[4];
+	double limits[4];
+	int over[4];
+	int any_over = 0, any_change = 0;
+	int k, n_printed = 0;
+
+	names[0] = "n_allocs";   vb[0] = b->n_allocs;   vc[0] = c->n_allocs;   limits[0] = opts->max_allocs_growth;
+	names[1] = "alloc_size"; vb[1] = b->alloc_size; vc[1] = c->alloc_size; limits[1] = opts->max_bytes_growth;
+	names[2] = "peak_size";  vb[2] = b->peak_size;  vc[2] = c->peak_size;  limits[2] = opts->max_peak_growth;
+	names[3] = "live_size";  vb[3] = b->live_size;  vc[3] = c->live_size;  limits[3] = opts->max_live_growth;
+	for (k = 0; k < 4; k++) {
+		over[k] = check && limits[k] >= 0.0 && vc[k] > vb[k]
+		          && (vb[k] == 0 || ((double)vc[k] - (double)vb[k]) * 100.0 / (double)vb[k] > limits[k]);
+		any_over |= over[k];
+		any_change |= (vc[k] != vb[k]);
+	}
+	if (!any_over && !(opts->verbose && any_change))
+		return 0;
+
+	if (file != NULL)
+		fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: ", file, line);
+	else
+		fprintf(fp, "  > all sites :: ");
+	for (k = 0; k < 4; k++) {
+		if (vc[k] == vb[k] || (!over[k] && !opts->verbose))
+			continue;
+		fprintf(fp, "%s%s %" _MEMCHECK_TOU_PRIuZ " -> %" _MEMCHECK_TOU_PRIuZ, (n_printed++ > 0) ? ", " : "", names[k], vb[k], vc[k]);
+		if (vb[k] > 0)
+			fprintf(fp, " (%+.1f%%)", ((double)vc[k] - (double)vb[k]) * 100.0 / (double)vb[k]);
+		if (over[k])
+			fprintf(fp, " [!!]");
+	}
+	fprintf(fp, "\n");
+	return any_over;
+}
+
+
+size_t memcheck_compare_sites(const _memcheck_site_stats_t* base, size_t n_base, const _memcheck_site_stats_t* cur, size_t n_cur,
+                              const _memcheck_compare_opts_t* opts, FILE* fp)
+{
+	_memcheck_compare_opts_t defaults;
+	const _memcheck_site_stats_t** b;
+	const _memcheck_site_stats_t** c;
+	_memcheck_site_stats_t total_b, total_c, none;
+	size_t i = 0, j = 0, n_regressions = 0;
+
+	if (opts == NULL) {
+		memcheck_compare_defaults(&defaults);
+		opts = &defaults;
+	}
+	if (fp == NULL)
+		fp = stderr;
+	b = _memcheck_compare_sorted(base, n_base);
+	c = _memcheck_compare_sorted(cur, n_cur);
+	if (b == NULL || c == NULL) {
+		fprintf(stderr, "[%s] Out of memory\n", __func__);
+		free((void*)b);
+		free((void*)c);
+		return 0;
+	}
+	memset(&total_b, 0, sizeof(total_b));
+	memset(&total_c, 0, sizeof(total_c));
+	memset(&none, 0, sizeof(none));
+
+	fprintf(fp, "\n-=[ Comparison with the baseline (%" _MEMCHECK_TOU_PRIuZ " -> %" _MEMCHECK_TOU_PRIuZ " sites): ]=-\n", n_base, n_cur);
+	while (i < n_base || j < n_cur) {
+		int order = (i == n_base) ? 1 : (j == n_cur) ? -1 : _memcheck_compare_by_site(&b[i], &c[j]);
+		const _memcheck_site_stats_t* sb = (order <= 0) ? b[i] : &none;
+		const _memcheck_site_stats_t* sc = (order >= 0) ? c[j] : &none;
+		const char* file = (order <= 0) ? sb->file : sc->file;
+		size_t line = (order <= 0) ? sb->line : sc->line;
+
+		if (order > 0) {
+			/* Shifted lines look like new sites, so only leaks are held against them; the totals catch the rest */
+			if (opts->new_leaks && sc->n_live > 0) {
+				fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: new site with %" _MEMCHECK_TOU_PRIuZ " live blocks (%" _MEMCHECK_TOU_PRIuZ " bytes) [!!]\n",
+					file, line, sc->n_live, sc->live_size);
+				n_regressions++;
+			} else if (opts->verbose) {
+				fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: new site, %" _MEMCHECK_TOU_PRIuZ " allocations\n", file, line, sc->n_allocs);
+			}
+		} else if (order < 0) {
+			if (opts->verbose)
+				fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: gone (had %" _MEMCHECK_TOU_PRIuZ " allocations)\n", file, line, sb->n_allocs);
+		} else if (opts->new_leaks && sb->n_live == 0 && sc->n_live > 0) {
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: now leaves %" _MEMCHECK_TOU_PRIuZ " live blocks (%" _MEMCHECK_TOU_PRIuZ " bytes) [!!]\n",
+				file, line, sc->n_live, sc->live_size);
+			n_regressions++;
+		} else {
+			int check = sb->n_allocs >= opts->min_allocs || sc->n_allocs >= opts->min_allocs;
+			n_regressions += (size_t) _memcheck_compare_print(fp, file, line, sb, sc, opts, check);
+		}
+
+		total_b.n_allocs += sb->n_allocs;  total_c.n_allocs += sc->n_allocs;
+		total_b.alloc_size += sb->alloc_size; total_c.alloc_size += sc->alloc_size;
+		total_b.peak_size += sb->peak_size; total_c.peak_size += sc->peak_size;
+		total_b.live_size += sb->live_size; total_c.live_size += sc->live_size;
+		if (order <= 0)
+			i++;
+		if (order >= 0)
+			j++;
+	}
+	n_regressions += (size_t) _memcheck_compare_print(fp, NULL, 0, &total_b, &total_c, opts, 1);
+	if (n_regressions > 0)
+		fprintf(fp, "-=[ %" _MEMCHECK_TOU_PRIuZ " regression(s). ]=-\n\n", n_regressions);
+	else
+		fprintf(fp, "-=[ No regressions. ]=-\n\n");
+	fflush(fp);
+
+	free((void*)b);
+	free((void*)c);
+	return n_regressions;
+}
+
+
 #ifdef MEMCHECK_IGNORE
 	int memcheck_stats(FILE* fp)
 	{
@@ -252,73 +1240,372 @@ void  memcheck_free(void* ptr, const char* file, size_t line);
 	{
 		(void)0;
 	}
+	size_t memcheck_purge_where(const _memcheck_purge_filter_t* filter, int output)
+	{
+		(void)filter; (void)output;
+		return 0;
+	}
 	_memcheck_tou_llist_t** memcheck_get_memblocks(void)
 	{
 		return NULL;
 	}
-	void* memcheck_malloc(size_t size, const char* file, size_t line)
+	size_t memcheck_foreach_block(_memcheck_block_fn_t fn, void* ctx)
 	{
-		(void)file; (void)line;
-		return malloc(size);
+		(void)fn; (void)ctx;
+		return 0;
 	}
-	void* memcheck_calloc(size_t num, size_t size, const char* file, size_t line)
+	size_t memcheck_foreach_block_since(size_t generation, _memcheck_block_fn_t fn, void* ctx)
 	{
-		(void)file; (void)line;
-		return calloc(num, size);
+		(void)generation; (void)fn; (void)ctx;
+		return 0;
 	}
-	void* memcheck_realloc(void* ptr, size_t new_size, const char* file, size_t line)
+	size_t memcheck_get_generation(void)
 	{
-		(void)file; (void)line;
-		return realloc(ptr, new_size);
+		return 0;
 	}
-	void memcheck_free(void* ptr, const char* file, size_t line)
+	void memcheck_get_stats(_memcheck_stats_t* out)
 	{
-		(void)file; (void)line;
-		free(ptr);
+		if (out != NULL)
+			memset(out, 0, sizeof(*out));
 	}
-#else
-
-
-/********** EMBED TOU_LLIST IMPL (extracted from tou.h) **********/
-
-#ifdef __cplusplus
-extern "C" {        /* Extern C for llist */
-#endif
-
-static _memcheck_tou_llist_t* _memcheck_tou_llist_append(_memcheck_tou_llist_t** node_ref, void* dat1, void* dat2, char dat1_is_dynalloc, char dat2_is_dynalloc)
-{
-	_memcheck_tou_llist_t* new_node;
-	_memcheck_tou_llist_t* prev_node;
-	_memcheck_tou_llist_t* previous_next;
-
-	if (node_ref == NULL)
-		return NULL;
-
-	/* Spawn new node */
-	new_node = (_memcheck_tou_llist_t*) malloc(sizeof(*new_node));
-
-	new_node->prev = NULL;
-	new_node->next = NULL;
-	
-	new_node->dat1 = dat1;
-	new_node->destroy_dat1 = dat1_is_dynalloc;
-	new_node->dat2 = dat2;
-	new_node->destroy_dat2 = dat2_is_dynalloc;
-
-	/* Given node is empty list */
-	if (*node_ref == NULL) {
-		*node_ref = new_node; /* Update passed reference to point to the new node */
-		return new_node;
+	size_t memcheck_get_site_count(void)
+	{
+		return 0;
 	}
-	/* Given node/list already has something and this node is head */
-	prev_node = (*node_ref);
-	if (prev_node->next == NULL) {
-		prev_node->next = new_node; /* Update passed node's .next */
-		new_node->prev = prev_node; /* Update new node's .prev */
-		*node_ref = new_node; /* Update passed reference to point to the new node */
-		return new_node;
+	int memcheck_get_site_stats(size_t idx, _memcheck_site_stats_t* out)
+	{
+		(void)idx; (void)out;
+		return 0;
 	}
-
+	size_t memcheck_report_json(FILE* fp, int sections)
+	{
+		(void)fp; (void)sections;
+		return 0;
+	}
+	size_t memcheck_report_json_buf(char* buf, size_t cap, int sections)
+	{
+		(void)sections;
+		if (buf != NULL && cap > 0)
+			buf[0] = '\0';
+		return 0;
+	}
+	size_t memcheck_report_csv(FILE* fp, int section)
+	{
+		(void)fp; (void)section;
+		return 0;
+	}
+	size_t memcheck_report_csv_buf(char* buf, size_t cap, int section)
+	{
+		(void)section;
+		if (buf != NULL && cap > 0)
+			buf[0] = '\0';
+		return 0;
+	}
+	size_t memcheck_report_pprof(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	size_t memcheck_report_folded(FILE* fp, int weight)
+	{
+		(void)fp; (void)weight;
+		return 0;
+	}
+	int memcheck_get_realloc_stats(size_t idx, _memcheck_realloc_stats_t* out)
+	{
+		(void)idx; (void)out;
+		return 0;
+	}
+	size_t memcheck_report_realloc(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	void memcheck_get_overhead(_memcheck_overhead_t* out)
+	{
+		if (out != NULL)
+			memset(out, 0, sizeof(*out));
+	}
+	int memcheck_get_size_class(size_t idx, _memcheck_size_class_t* out)
+	{
+		(void)idx; (void)out;
+		return 0;
+	}
+	size_t memcheck_report_slack(FILE* fp, size_t max_sites)
+	{
+		(void)fp; (void)max_sites;
+		return 0;
+	}
+	int memcheck_sample_rss(_memcheck_rss_sample_t* out)
+	{
+		if (out != NULL)
+			memset(out, 0, sizeof(*out));
+		return 0;
+	}
+	size_t memcheck_get_rss_samples(_memcheck_rss_sample_t* out, size_t max)
+	{
+		(void)out; (void)max;
+		return 0;
+	}
+	size_t memcheck_report_rss(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	size_t memcheck_get_heavy_hitters(int by, _memcheck_hh_entry_t* out, size_t max, size_t* total)
+	{
+		(void)by; (void)out; (void)max;
+		if (total != NULL)
+			*total = 0;
+		return 0;
+	}
+	size_t memcheck_report_heavy_hitters(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	void memcheck_timeline_tick(void)
+	{
+		(void)0;
+	}
+	int memcheck_set_site_budget(const char* file, size_t line, size_t bytes, int action)
+	{
+		(void)file; (void)line; (void)bytes; (void)action;
+		return 1;
+	}
+	int memcheck_set_tag_budget(const char* name, size_t bytes, int action)
+	{
+		(void)name; (void)bytes; (void)action;
+		return 1;
+	}
+	void memcheck_set_budget_callback(_memcheck_budget_fn_t fn, void* ctx)
+	{
+		(void)fn; (void)ctx;
+	}
+	size_t memcheck_report_budgets(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	int memcheck_set_options(const char* options)
+	{
+		(void)options;
+		return 1;
+	}
+	int memcheck_filter_include(const char* pattern)
+	{
+		(void)pattern;
+		return 1;
+	}
+	int memcheck_filter_exclude(const char* pattern)
+	{
+		(void)pattern;
+		return 1;
+	}
+	void memcheck_filter_clear(void)
+	{
+		(void)0;
+	}
+	int memcheck_trace_start(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	void memcheck_trace_stop(void)
+	{
+		(void)0;
+	}
+	size_t memcheck_get_timeline(_memcheck_timeline_sample_t* out, size_t max)
+	{
+		(void)out; (void)max;
+		return 0;
+	}
+	size_t memcheck_get_site_timeline(size_t idx, _memcheck_timeline_sample_t* out, size_t max)
+	{
+		(void)idx; (void)out; (void)max;
+		return 0;
+	}
+	size_t memcheck_report_growth(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	size_t memcheck_report_folded_buf(char* buf, size_t cap, int weight)
+	{
+		(void)weight;
+		if (buf != NULL && cap > 0)
+			buf[0] = '\0';
+		return 0;
+	}
+	size_t memcheck_dump(FILE* fp)
+	{
+		(void)fp;
+		return 0;
+	}
+	int memcheck_set_dump_signal(int signo, FILE* fp)
+	{
+		(void)signo; (void)fp;
+		return 0;
+	}
+	int memcheck_dump_poll(void)
+	{
+		return 0;
+	}
+	int memcheck_dump_process(const char* dir)
+	{
+		(void)dir;
+		return 0;
+	}
+	size_t memcheck_compare_baseline(FILE* baseline, FILE* fp, const _memcheck_compare_opts_t* opts)
+	{
+		(void)baseline; (void)fp; (void)opts;
+		return 0;
+	}
+	size_t memcheck_after_fork(void)
+	{
+		return 0;
+	}
+	int memcheck_shm_open(const char* name)
+	{
+		(void)name;
+		return 0;
+	}
+	void memcheck_shm_update(void)
+	{
+		(void)0;
+	}
+	void memcheck_shm_close(void)
+	{
+		(void)0;
+	}
+	int memcheck_leak_check(FILE* fp, _memcheck_leak_summary_t* out)
+	{
+		(void)fp;
+		if (out != NULL)
+			memset(out, 0, sizeof(*out));
+		return 1;
+	}
+	int memcheck_mark_permanent(void* ptr)
+	{
+		(void)ptr;
+		return 0;
+	}
+	void* memcheck_malloc_permanent(size_t size, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		return malloc(size);
+	}
+	void* memcheck_calloc_permanent(size_t num, size_t size, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		return calloc(num, size);
+	}
+	size_t memcheck_get_thread_id(void)
+	{
+		return 0;
+	}
+	size_t memcheck_get_thread_count(void)
+	{
+		return 0;
+	}
+	int memcheck_get_thread_stats(size_t id, _memcheck_thread_stats_t* out)
+	{
+		(void)id; (void)out;
+		return 0;
+	}
+	size_t memcheck_intern_tag(const char* name)
+	{
+		(void)name;
+		return 0;
+	}
+	void memcheck_push_tag(const char* name)
+	{
+		(void)name;
+	}
+	void memcheck_push_tag_id(size_t id)
+	{
+		(void)id;
+	}
+	void memcheck_pop_tag(void)
+	{
+		(void)0;
+	}
+	size_t memcheck_get_tag_count(void)
+	{
+		return 0;
+	}
+	size_t memcheck_get_tag_epoch(void)
+	{
+		return 1;
+	}
+	int memcheck_get_tag_stats(size_t id, _memcheck_tag_stats_t* out)
+	{
+		(void)id; (void)out;
+		return 0;
+	}
+	void* memcheck_malloc(size_t size, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		return malloc(size);
+	}
+	void* memcheck_calloc(size_t num, size_t size, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		return calloc(num, size);
+	}
+	void* memcheck_realloc(void* ptr, size_t new_size, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		return realloc(ptr, new_size);
+	}
+	void memcheck_free(void* ptr, const char* file, size_t line)
+	{
+		(void)file; (void)line;
+		free(ptr);
+	}
+#else
+
+
+/********** EMBED TOU_LLIST IMPL (extracted from tou.h) **********/
+
+#ifdef __cplusplus
+extern "C" {        /* Extern C for llist */
+#endif
+
+static _memcheck_tou_llist_t* _memcheck_tou_llist_append(_memcheck_tou_llist_t** node_ref, void* dat1, void* dat2, char dat1_is_dynalloc, char dat2_is_dynalloc)
+{
+	_memcheck_tou_llist_t* new_node;
+	_memcheck_tou_llist_t* prev_node;
+	_memcheck_tou_llist_t* previous_next;
+
+	if (node_ref == NULL)
+		return NULL;
+
+	/* Spawn new node */
+	new_node = (_memcheck_tou_llist_t*) malloc(sizeof(*new_node));
+
+	new_node->prev = NULL;
+	new_node->next = NULL;
+	
+	new_node->dat1 = dat1;
+	new_node->destroy_dat1 = dat1_is_dynalloc;
+	new_node->dat2 = dat2;
+	new_node->destroy_dat2 = dat2_is_dynalloc;
+
+	/* Given node is empty list */
+	if (*node_ref == NULL) {
+		*node_ref = new_node; /* Update passed reference to point to the new node */
+		return new_node;
+	}
+	/* Given node/list already has something and this node is head */
+	prev_node = (*node_ref);
+	if (prev_node->next == NULL) {
+		prev_node->next = new_node; /* Update passed node's .next */
+		new_node->prev = prev_node; /* Update new node's .prev */
+		*node_ref = new_node; /* Update passed reference to point to the new node */
+		return new_node;
+	}
+
 	/* The given node is now somewhere inbetween (after head) */
 
 	/* Setup new node links */
@@ -513,6 +1800,16 @@ static INIT_ONCE                    _memcheck_g_mutex_init_once = INIT_ONCE_STAT
 static pthread_once_t               _memcheck_g_mutex_init_once = PTHREAD_ONCE_INIT;
 #endif
 
+/* Thread-specific slot whose destructor tells memcheck that a thread exited (created along with the mutex) */
+#ifdef _WIN32
+static DWORD                        _memcheck_g_thread_key = FLS_OUT_OF_INDEXES;
+static void WINAPI _memcheck_thread_exit(void* rec);
+#else
+static pthread_key_t                _memcheck_g_thread_key;
+static void _memcheck_thread_exit(void* rec);
+#endif
+static int                          _memcheck_g_thread_key_ok = 0;
+
 static int _memcheck_tou_thread_mutex_init(_memcheck_tou_thread_mutex_t* mutex)
 {
 #ifdef _WIN32
@@ -549,13 +1846,52 @@ static /*bool*/int CALLBACK _memcheck_init_once_callback(INIT_ONCE* once, void*
 	if (_memcheck_tou_thread_mutex_init(&_memcheck_g_mutex) != 0)
 		return 0;
 	_memcheck_g_mutex_init_successful = 1;
+	_memcheck_g_thread_key = FlsAlloc(_memcheck_thread_exit);
+	_memcheck_g_thread_key_ok = (_memcheck_g_thread_key != FLS_OUT_OF_INDEXES);
 	return 1;
 }
 #else
+static void _memcheck_fork_flush(void);
+static int _memcheck_fork_take_over(unsigned long pid, size_t* n_inherited);
+
+/* Nobody holds the mutex across fork(), and the child gets a fresh one instead of a copy
+   that may have been locked by a thread that does not exist there. The handlers stay
+   registered after memcheck_cleanup(), which destroys the mutex, so they check for it. */
+static void _memcheck_atfork_prepare(void)
+{
+	if (!_memcheck_g_mutex_init_successful)
+		return;
+	pthread_mutex_lock(&_memcheck_g_mutex);
+	/* Whatever is still buffered would otherwise be written again by the child when it exits */
+	_memcheck_fork_flush();
+}
+
+static void _memcheck_atfork_parent(void)
+{
+	if (!_memcheck_g_mutex_init_successful)
+		return;
+	pthread_mutex_unlock(&_memcheck_g_mutex);
+}
+
+/* Runs in a child that may have forked off a multithreaded parent, so it neither locks nor prints;
+   the [FORK] line is only written when the program calls memcheck_after_fork() itself */
+static void _memcheck_atfork_child(void)
+{
+	size_t n_inherited;
+	if (!_memcheck_g_mutex_init_successful)
+		return;
+	if (_memcheck_tou_thread_mutex_init(&_memcheck_g_mutex) != 0)
+		_memcheck_g_mutex_init_successful = 0;
+	_memcheck_fork_take_over((unsigned long)getpid(), &n_inherited);
+}
+
 static void _memcheck_init_once_callback(void)
 {
-	if (_memcheck_tou_thread_mutex_init(&_memcheck_g_mutex) == 0)
+	if (_memcheck_tou_thread_mutex_init(&_memcheck_g_mutex) == 0) {
 	    _memcheck_g_mutex_init_successful = 1;
+	    pthread_atfork(_memcheck_atfork_prepare, _memcheck_atfork_parent, _memcheck_atfork_child);
+	    _memcheck_g_thread_key_ok = (pthread_key_create(&_memcheck_g_thread_key, _memcheck_thread_exit) == 0);
+	}
 }
 #endif
 
@@ -593,26 +1929,84 @@ static int _memcheck_tou_thread_mutex_unlock(_memcheck_tou_thread_mutex_t* mutex
 /********** END TOU_THREAD_MUTEX_T IMPL **********/
 
 
-typedef struct {
-	const char* file;
-	size_t line;
-	size_t size;
-} _memcheck_meta_t;
+/* Thread-local storage is only needed when several threads may call into memcheck */
+#ifndef _MEMCHECK_TLS
+#	if !defined(MEMCHECK_ENABLE_THREADSAFETY)
+#		define _MEMCHECK_TLS
+#	elif defined(_MSC_VER)
+#		define _MEMCHECK_TLS __declspec(thread)
+#	else
+#		define _MEMCHECK_TLS __thread
+#	endif
+#endif
+
 
+/* Per-thread record; registered on the thread's first tracked call and kept until the thread exits
+   (threadsafe builds; its counters then go to the record of exited threads) or memcheck_cleanup() */
+typedef struct _memcheck_thread_s {
+	struct _memcheck_thread_s* next;
+	_memcheck_thread_stats_t   stats;   /* Rates are only filled in when queried */
+	time_t                     started;
+} _memcheck_thread_t;
+
+/* Byte budget of a site or tag */
 typedef struct {
-	size_t n_mallocs;
-	size_t n_callocs;
-	size_t n_reallocs;
-	size_t n_total_allocs;
-	size_t n_frees;
-	size_t total_alloc_size;
-	size_t total_free_size;
-} _memcheck_stats_t;
+	size_t bytes;      /* Limit of live_size, 0 if none */
+	int    action;     /* MEMCHECK_BUDGET_* */
+	size_t n_exceeded; /* Allocations that would have gone over */
+} _memcheck_budget_t;
+
+/* Call-site record; lives until memcheck_cleanup() */
+typedef struct _memcheck_site_s {
+	struct _memcheck_site_s* next;  /* Hash bucket chain */
+	_memcheck_site_stats_t   stats;
+	size_t                   n_leaked;    /* Scratch counters of memcheck_stats()'s leak ranking and of memcheck_purge_where(), zero outside of them */
+	size_t                   leaked_size;
+	_memcheck_realloc_stats_t resizes;    /* Of blocks that originate here; mean_growth is unused */
+	double                   growth_sum;  /* Sum of new/old ratios of those growths */
+	_memcheck_budget_t       budget;
+#ifdef MEMCHECK_ENABLE_TIMELINE
+	size_t                   tl_n_live[MEMCHECK_TIMELINE_BUCKETS];    /* Samples, indexed like _memcheck_g_tl_time */
+	size_t                   tl_live_size[MEMCHECK_TIMELINE_BUCKETS];
+	size_t                   tl_growing;  /* Consecutive samples in which live_size grew */
+#endif
+} _memcheck_site_t;
+
+typedef struct {
+	const char* file;
+	size_t line;
+	size_t size;
+	_memcheck_thread_t* thread; /* Thread that allocated (or last realloc'd) the block */
+	_memcheck_site_t* site;     /* Site of file/line above */
+	size_t tag;                 /* Tag that was active on the allocating thread */
+	int flags;                  /* _MEMCHECK_META_* */
+	size_t usable;              /* Bytes the allocator handed out (_MEMCHECK_USABLE_SIZE) */
+	_memcheck_site_t* origin;   /* Site of the first allocation, kept across realloc()'s */
+	size_t n_resizes;           /* realloc()'s counted in origin->resizes */
+	size_t generation;          /* _memcheck_g_generation after the block's last change */
+} _memcheck_meta_t;
 
-static int                          _memcheck_g_do_track_mem     = 1; /* Controls current tracking of allocations and releases */
+#define _MEMCHECK_META_PERMANENT 0x1 /* Block lives in _memcheck_g_permanent instead of _memcheck_g_memblocks */
+#define _MEMCHECK_META_INHERITED 0x2 /* Block was allocated by the parent process (implies _MEMCHECK_META_PERMANENT) */
+
+/* Position of a blocks section that is copied in batches. Unlinking a block moves the cursors that
+   point to it on to the next newer block, so a cursor stays valid while the lock is released. */
+typedef struct _memcheck_block_cursor_s {
+	struct _memcheck_block_cursor_s* next;       /* Other cursors in use */
+	_memcheck_tou_llist_t*           elem;       /* Next block to look at, NULL at the end of the list */
+	int                              list;       /* 0 in _memcheck_g_memblocks, 1 in _memcheck_g_permanent, 2 when done */
+	int                              linked;     /* Whether it is in _memcheck_g_block_cursors */
+	size_t                           generation; /* Blocks changed after the section began are left out */
+	size_t                           n_batch;
+	_memcheck_block_info_t           batch[MEMCHECK_REPORT_BATCH];
+} _memcheck_block_cursor_t;
+
+static volatile int                 _memcheck_g_do_track_mem     = 1; /* Controls current tracking of allocations and releases (_MEMCHECK_FLAG_* access) */
 static FILE*                        _memcheck_g_status_fp        = NULL; /* FILE* that serves as log for allocations and releases */
-static int                          _memcheck_g_manages_devnull  = 0; /* Indicator whether this lib needs to keep track of g_status_fp and close it */
+static int                          _memcheck_g_owns_status_fp   = 0; /* Whether memcheck opened g_status_fp itself (/dev/null or a log= file) and closes it */
 static _memcheck_tou_llist_t*       _memcheck_g_memblocks        = NULL; /* Main storage for tracking allocations, releases and their locations */
+static _memcheck_tou_llist_t*       _memcheck_g_permanent        = NULL; /* Blocks marked as intentionally long-lived (same layout as _memcheck_g_memblocks) */
+static _memcheck_block_cursor_t*    _memcheck_g_block_cursors    = NULL; /* Blocks sections being written */
 #ifdef __cplusplus
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
 #endif
@@ -623,37 +2017,119 @@ static _memcheck_stats_t 	        _memcheck_g_stats            = {0}; /* Statist
 #ifdef MEMCHECK_FIRE_AND_FORGET
 static int                          _memcheck_g_fnf_cleanup_done = 0; /* Guard against double-cleanup (only against manual+automatic(destructor) cleanups) */
 #endif
+static _memcheck_thread_t*          _memcheck_g_threads          = NULL; /* All registered thread records (newest first) */
+static size_t                       _memcheck_g_n_threads        = 0; /* Number of threads seen (also the last assigned id) */
+static size_t                       _memcheck_g_n_thread_records = 0; /* Length of _memcheck_g_threads */
+static _memcheck_thread_t*          _memcheck_g_exited_threads   = NULL; /* Record of exited threads (in _memcheck_g_threads once created) */
+static size_t                       _memcheck_g_threads_epoch    = 1; /* Bumped by memcheck_cleanup() to invalidate thread-local record pointers */
+static _MEMCHECK_TLS _memcheck_thread_t* _memcheck_t_self        = NULL; /* This thread's record */
+static _MEMCHECK_TLS size_t         _memcheck_t_self_epoch       = 0; /* Epoch in which _memcheck_t_self was registered */
+static _memcheck_tag_stats_t*       _memcheck_g_tags             = NULL; /* Interned tags, indexed by id (entry 0 is "untagged") */
+static size_t                       _memcheck_g_n_tags           = 0;
+static size_t                       _memcheck_g_tags_cap         = 0;
+static size_t                       _memcheck_g_tags_epoch       = 1; /* Bumped by memcheck_cleanup() when the tag ids become invalid */
+static _MEMCHECK_TLS size_t         _memcheck_t_tag              = 0; /* Tag on top of this thread's stack (the only thing allocations read) */
+static _MEMCHECK_TLS size_t         _memcheck_t_tag_stack[MEMCHECK_TAG_STACK_DEPTH]; /* Tags below the top */
+static _MEMCHECK_TLS size_t         _memcheck_t_tag_depth        = 0;
+static _memcheck_site_t*            _memcheck_g_site_buckets[MEMCHECK_SITE_BUCKETS]; /* Call-site hash table */
+static _memcheck_site_t**           _memcheck_g_sites            = NULL; /* All call sites in order of first use */
+static size_t                       _memcheck_g_n_sites          = 0;
+static size_t                       _memcheck_g_sites_cap        = 0;
+static _memcheck_site_t*            _memcheck_g_site_last        = NULL; /* Site of the last lookup */
+static size_t                       _memcheck_g_sites_dropped    = 0; /* Tracked calls that got no site (past MEMCHECK_MAX_SITES) */
+static size_t                       _memcheck_g_generation       = 0; /* Bumped by every change to the set of live blocks (see memcheck_foreach_block_since()) */
+static _memcheck_size_class_t       _memcheck_g_size_classes[MEMCHECK_SIZE_CLASSES]; /* Live blocks by requested size (max_size filled in when queried) */
+static volatile sig_atomic_t        _memcheck_g_dump_requested   = 0; /* Set by the dump signal handler, cleared by whoever writes the dump */
+static FILE*                        _memcheck_g_dump_fp          = NULL; /* Where requested dumps go (NULL -> status_fp) */
+static int                          _memcheck_g_budgets_set      = 0; /* Whether any budget was ever set; allocations check nothing until then */
+static _memcheck_budget_t*          _memcheck_g_tag_budgets      = NULL; /* Indexed by tag id, grown by memcheck_set_tag_budget() */
+static size_t                       _memcheck_g_n_tag_budgets    = 0;
+
+/* Relaxed access to flags that are shared with signal handlers and read without the lock */
+#if defined(__GNUC__) || defined(__clang__)
+#	define _MEMCHECK_FLAG_LOAD(flag)     __atomic_load_n(&(flag), __ATOMIC_RELAXED)
+#	define _MEMCHECK_FLAG_STORE(flag, v) __atomic_store_n(&(flag), (v), __ATOMIC_RELAXED)
+#	define _MEMCHECK_PTR_LOAD(ptr)       __atomic_load_n(&(ptr), __ATOMIC_ACQUIRE) /* Pairs with _MEMCHECK_PTR_STORE() */
+#	define _MEMCHECK_PTR_STORE(ptr, v)   __atomic_store_n(&(ptr), (v), __ATOMIC_RELEASE)
+#else
+#	define _MEMCHECK_FLAG_LOAD(flag)     (flag)
+#	define _MEMCHECK_FLAG_STORE(flag, v) ((flag) = (v))
+#	define _MEMCHECK_PTR_LOAD(ptr)       (ptr)
+#	define _MEMCHECK_PTR_STORE(ptr, v)   ((ptr) = (v))
+#endif
 
 
-void memcheck_set_tracking(int yn)
+/* Implementations chosen from the options (see RUNTIME OPTIONS) whenever they change, so tracked calls do not test
+   the output, sampling and quarantine settings each time. The defaults follow the MEMCHECK_NO_*OUTPUT macros. */
+typedef struct {
+	int  (*admit)(const char* file, size_t line); /* Whether a malloc()/calloc() is tracked at all; read without the lock */
+	void (*log)(const char* fmt, ...);            /* Per-call lines to memcheck_get_status_fp() */
+	void (*warn)(const char* fmt, ...);           /* [!!] lines to stderr */
+	void (*release)(void* ptr, size_t size, const char* file, size_t line); /* Hands a freed block back (or holds it) */
+} _memcheck_dispatch_t;
+
+static void _memcheck_log_status(const char* fmt, ...)
 {
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return;
-	}
+	FILE* fp = memcheck_get_status_fp();
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(fp, fmt, args);
+	va_end(args);
+	fflush(fp);
+}
+
+static void _memcheck_log_stderr(const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fflush(stderr);
+}
+
+static void _memcheck_log_none(const char* fmt, ...)
+{
+	(void)fmt;
+}
+
+static void _memcheck_release_free(void* ptr, size_t size, const char* file, size_t line)
+{
+	(void)size; (void)file; (void)line;
+	free(ptr);
+}
+
+static int _memcheck_admit_first(const char* file, size_t line); /* Reads MEMCHECK_OPTIONS, then hands over */
+
+static _memcheck_dispatch_t _memcheck_g_dispatch = {
+	_memcheck_admit_first,
+#ifdef MEMCHECK_NO_OUTPUT
+	_memcheck_log_none,
+#else
+	_memcheck_log_status,
 #endif
-	_memcheck_g_do_track_mem = yn;
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#ifdef MEMCHECK_NO_CRITICAL_OUTPUT
+	_memcheck_log_none,
+#else
+	_memcheck_log_stderr,
 #endif
+	_memcheck_release_free
+};
+static int _memcheck_g_partial = 0; /* Whether admit() may refuse (filters or sampling); unknown pointers are expected then */
+
+#define _MEMCHECK_ADMIT(file, line) (_MEMCHECK_PTR_LOAD(_memcheck_g_dispatch.admit)(file, line))
+
+
+/* Lock-free, so that the disabled path of the allocation functions does not need the lock either.
+   Calls that already passed the check finish tracked. */
+void memcheck_set_tracking(int yn)
+{
+	_MEMCHECK_FLAG_STORE(_memcheck_g_do_track_mem, yn);
 }
 
 
 int memcheck_is_tracking(void)
 {
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	int track;
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return 0;
-	}
-	track = _memcheck_g_do_track_mem;
-	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
-	return track;
-#else
-	return _memcheck_g_do_track_mem;
-#endif
+	return _MEMCHECK_FLAG_LOAD(_memcheck_g_do_track_mem);
 }
 
 
@@ -669,20 +2145,20 @@ void memcheck_set_status_fp(FILE* fp)
 
 	if (_memcheck_g_status_fp != NULL) {
 		fflush(_memcheck_g_status_fp);
-		if (_memcheck_g_manages_devnull)
+		if (_memcheck_g_owns_status_fp)
 			fclose(_memcheck_g_status_fp);
 	}
 
 	if (fp != NULL) {
 		_memcheck_g_status_fp = fp;
-		_memcheck_g_manages_devnull = 0;
+		_memcheck_g_owns_status_fp = 0;
 	} else {
 #ifdef _WIN32
 		_memcheck_g_status_fp = fopen("NUL:", "w");
 #else
 		_memcheck_g_status_fp = fopen("/dev/null", "w");
 #endif
-		_memcheck_g_manages_devnull = 1;
+		_memcheck_g_owns_status_fp = 1;
 	}
 
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
@@ -715,452 +2191,5523 @@ FILE* memcheck_get_status_fp(void)
 }
 
 
-_memcheck_meta_t* memcheck_new_meta(const char* file, size_t line, size_t size)
+/* Returns the calling thread's record, registering it first if needed. Call with the mutex held. */
+static _memcheck_thread_t* _memcheck_thread_self(void)
 {
-	_memcheck_meta_t* meta = (_memcheck_meta_t*) malloc(sizeof(*meta));
-	meta->file = file;
-	meta->line = line;
-	meta->size = size;
-	return meta;
-}
+	_memcheck_thread_t* self;
 
+	if (_memcheck_t_self != NULL && _memcheck_t_self_epoch == _memcheck_g_threads_epoch)
+		return _memcheck_t_self;
 
-void* memcheck_malloc(size_t size, const char* file, size_t line)
-{
-	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
-	                         at the end after releasing mutex (if enabled)  */
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+	self = (_memcheck_thread_t*) malloc(sizeof(*self));
+	if (self == NULL)
 		return NULL;
+	memset(self, 0, sizeof(*self));
+	self->stats.id = ++_memcheck_g_n_threads;
+	self->started = time(NULL);
+	self->next = _memcheck_g_threads;
+	_memcheck_g_threads = self;
+	_memcheck_g_n_thread_records += 1;
+
+	_memcheck_t_self = self;
+	_memcheck_t_self_epoch = _memcheck_g_threads_epoch;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_g_thread_key_ok) {
+#ifdef _WIN32
+		FlsSetValue(_memcheck_g_thread_key, self);
+#else
+		pthread_setspecific(_memcheck_g_thread_key, self);
+#endif
 	}
 #endif
+	return self;
+}
 
-	if (!memcheck_is_tracking()) {
-		new_ptr = malloc(size);		
-	} else {
-		memcheck_set_tracking(0);
-		
-		new_ptr = malloc(size);
-		
-#ifndef MEMCHECK_NO_OUTPUT
-		fprintf(memcheck_get_status_fp(), "[MALLOC ] %p%s {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
-			new_ptr, (new_ptr == NULL ? " <SKIPPING>" : ""), size, file, line);
-		fflush(memcheck_get_status_fp());
-#endif
-		/* Since we don't want free() to bark at NULL frees, let's not add them in in the first place */
-		if (new_ptr != NULL) {
-			_memcheck_meta_t* meta = memcheck_new_meta(file, line, size);
-			_memcheck_tou_llist_append(&_memcheck_g_memblocks, new_ptr, meta, 0,1);
 
-			_memcheck_g_stats.n_mallocs += 1;
-			_memcheck_g_stats.n_total_allocs += 1;
-			_memcheck_g_stats.total_alloc_size += size;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+/* Adds the record of a thread that exited to the record of exited threads, hands that one its live
+   blocks and frees it. Only walks the block lists if the thread left blocks behind. Call with the mutex held. */
+static void _memcheck_thread_fold(_memcheck_thread_t* rec)
+{
+	_memcheck_thread_t* exited = _memcheck_g_exited_threads;
+	_memcheck_thread_t** link;
+
+	if (exited == NULL) {
+		exited = (_memcheck_thread_t*) malloc(sizeof(*exited));
+		if (exited == NULL)
+			return; /* The record stays as it is */
+		memset(exited, 0, sizeof(*exited));
+		exited->stats.id = MEMCHECK_EXITED_THREADS;
+		exited->started = rec->started;
+		exited->next = _memcheck_g_threads;
+		_memcheck_g_threads = exited;
+		_memcheck_g_n_thread_records += 1;
+		_memcheck_g_exited_threads = exited;
+	}
+	exited->stats.n_allocs       += rec->stats.n_allocs;
+	exited->stats.n_reallocs     += rec->stats.n_reallocs;
+	exited->stats.n_frees        += rec->stats.n_frees;
+	exited->stats.n_live         += rec->stats.n_live;
+	exited->stats.live_size      += rec->stats.live_size;
+	exited->stats.n_cross_frees  += rec->stats.n_cross_frees;
+	exited->stats.n_remote_frees += rec->stats.n_remote_frees;
+	if (difftime(rec->started, exited->started) < 0)
+		exited->started = rec->started;
+
+	if (rec->stats.n_live > 0) {
+		_memcheck_tou_llist_t* lists[2];
+		size_t k;
+		lists[0] = _memcheck_g_memblocks;
+		lists[1] = _memcheck_g_permanent;
+		for (k = 0; k < 2; k++) {
+			_memcheck_tou_llist_t* elem;
+			for (elem = lists[k]; elem != NULL; elem = _memcheck_tou_llist_get_older(elem)) {
+				_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
+				if (meta->thread == rec)
+					meta->thread = exited;
+			}
 		}
+	}
 
-		memcheck_set_tracking(1);
+	for (link = &_memcheck_g_threads; *link != NULL; link = &(*link)->next) {
+		if (*link == rec) {
+			*link = rec->next;
+			break;
+		}
+	}
+	_memcheck_g_n_thread_records -= 1;
+	free(rec);
+}
+
+
+/* Destructor of the thread-specific slot. Tracked calls made by later destructors of the same
+   thread register a new record, which comes back here in the next round of destructors. */
+#ifdef _WIN32
+static void WINAPI _memcheck_thread_exit(void* rec)
+#else
+static void _memcheck_thread_exit(void* rec)
+#endif
+{
+	if (!_memcheck_g_mutex_init_successful)
+		return; /* After memcheck_cleanup() */
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0)
+		return;
+	/* A record registered before memcheck_cleanup() is already gone */
+	if (rec == _memcheck_t_self && _memcheck_t_self_epoch == _memcheck_g_threads_epoch) {
+		_memcheck_thread_fold(_memcheck_t_self);
+		_memcheck_t_self = NULL;
 	}
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
 	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+}
 #endif
-	return new_ptr;
+
+
+static void _memcheck_thread_on_alloc(_memcheck_meta_t* meta, _memcheck_thread_t* self)
+{
+	meta->thread = self;
+	if (self == NULL)
+		return;
+	self->stats.n_allocs += 1;
+	self->stats.n_live += 1;
+	self->stats.live_size += meta->size;
 }
 
 
-void* memcheck_calloc(size_t num, size_t size, const char* file, size_t line)
+/* Moves the block's bytes from its owner to `self`; returns 1 if the owner was a different thread */
+static int _memcheck_thread_on_realloc(_memcheck_meta_t* meta, _memcheck_thread_t* self, size_t new_size)
 {
-	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
-	                         at the end after releasing mutex (if enabled)  */
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return NULL;
+	_memcheck_thread_t* owner = meta->thread;
+	int cross = (owner != NULL && self != NULL && owner != self);
+
+	if (owner != NULL) {
+		owner->stats.n_live -= 1;
+		owner->stats.live_size -= meta->size;
+		if (cross)
+			owner->stats.n_remote_frees += 1;
 	}
-#endif
+	meta->thread = self;
+	if (self != NULL) {
+		self->stats.n_reallocs += 1;
+		self->stats.n_live += 1;
+		self->stats.live_size += new_size;
+		if (cross)
+			self->stats.n_cross_frees += 1;
+	}
+	return cross;
+}
 
-	if (!memcheck_is_tracking()) {
-		new_ptr = calloc(num, size);
-	} else {
-		memcheck_set_tracking(0);
 
-		new_ptr = calloc(num, size);
+/* Returns 1 if the block is being freed on a different thread than the one that allocated it */
+static int _memcheck_thread_on_free(_memcheck_meta_t* meta, _memcheck_thread_t* self)
+{
+	_memcheck_thread_t* owner = meta->thread;
+	int cross = (owner != NULL && self != NULL && owner != self);
+
+	if (owner != NULL) {
+		owner->stats.n_live -= 1;
+		owner->stats.live_size -= meta->size;
+		if (cross)
+			owner->stats.n_remote_frees += 1;
+	}
+	if (self != NULL) {
+		self->stats.n_frees += 1;
+		if (cross)
+			self->stats.n_cross_frees += 1;
+	}
+	return cross;
+}
 
-		size = num * size; /*calloc size */
 
-#ifndef MEMCHECK_NO_OUTPUT
-		fprintf(memcheck_get_status_fp(), "[CALLOC ] %p%s {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
-			new_ptr, (new_ptr == NULL ? " <SKIPPING>" : ""), size, file, line);
-		fflush(memcheck_get_status_fp());
-#endif
-		if (new_ptr != NULL) {
-			_memcheck_meta_t* meta = memcheck_new_meta(file, line, size);
-			_memcheck_tou_llist_append(&_memcheck_g_memblocks, new_ptr, meta, 0,1);
+static void _memcheck_thread_fill_rates(_memcheck_thread_stats_t* st, time_t started)
+{
+	double elapsed = difftime(time(NULL), started);
+	if (elapsed < 1.0)
+		elapsed = 1.0;
+	st->alloc_rate = (double)st->n_allocs / elapsed;
+	st->free_rate  = (double)st->n_frees / elapsed;
+}
 
-			_memcheck_g_stats.n_callocs += 1;
-			_memcheck_g_stats.n_total_allocs += 1;
-			_memcheck_g_stats.total_alloc_size += size;
+
+/* Returns the table entry for the given tag id, creating the table (with its "untagged" entry) if needed.
+   Stale ids (pushed before a memcheck_cleanup()) fall back to "untagged". Call with the mutex held. */
+static _memcheck_tag_stats_t* _memcheck_tag_entry(size_t id)
+{
+	if (_memcheck_g_tags == NULL) {
+		_memcheck_g_tags_cap = 16;
+		_memcheck_g_tags = (_memcheck_tag_stats_t*) malloc(_memcheck_g_tags_cap * sizeof(*_memcheck_g_tags));
+		if (_memcheck_g_tags == NULL) {
+			_memcheck_g_tags_cap = 0;
+			return NULL;
 		}
-		
-		memcheck_set_tracking(1);
+		memset(&_memcheck_g_tags[0], 0, sizeof(_memcheck_g_tags[0]));
+		_memcheck_g_tags[0].name = "(untagged)";
+		_memcheck_g_n_tags = 1;
 	}
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
-#endif
-	return new_ptr;
+	return &_memcheck_g_tags[(id < _memcheck_g_n_tags) ? id : 0];
 }
 
 
-void* memcheck_realloc(void* ptr, size_t new_size, const char* file, size_t line)
+static void _memcheck_tag_on_alloc(_memcheck_meta_t* meta)
 {
-	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
-	                         at the end after releasing mutex (if enabled)  */
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return NULL;
+	_memcheck_tag_stats_t* tag = _memcheck_tag_entry(_memcheck_t_tag);
+	if (tag == NULL)
+		return;
+	meta->tag = tag->id;
+	tag->n_allocs += 1;
+	tag->n_live += 1;
+	tag->live_size += meta->size;
+	if (tag->live_size > tag->peak_size)
+		tag->peak_size = tag->live_size;
+}
+
+
+/* The block keeps its tag across realloc()'s; only its size changes */
+static void _memcheck_tag_on_realloc(_memcheck_meta_t* meta, size_t new_size)
+{
+	_memcheck_tag_stats_t* tag = _memcheck_tag_entry(meta->tag);
+	if (tag == NULL)
+		return;
+	tag->n_reallocs += 1;
+	tag->live_size = tag->live_size - meta->size + new_size;
+	if (tag->live_size > tag->peak_size)
+		tag->peak_size = tag->live_size;
+}
+
+
+static void _memcheck_tag_on_free(_memcheck_meta_t* meta)
+{
+	_memcheck_tag_stats_t* tag = _memcheck_tag_entry(meta->tag);
+	if (tag == NULL)
+		return;
+	tag->n_frees += 1;
+	tag->n_live -= 1;
+	tag->live_size -= meta->size;
+}
+
+
+static void _memcheck_budget_apply_rules(_memcheck_site_t* site);
+
+/* Sites are keyed by the __FILE__ pointer and line, so no string is hashed or compared per call.
+   NULL once MEMCHECK_MAX_SITES sites exist (or out of memory). Call with the mutex held. */
+static _memcheck_site_t* _memcheck_site_get(const char* file, size_t line)
+{
+	size_t h;
+	_memcheck_site_t* site = _memcheck_g_site_last;
+
+	/* A budget check and the accounting of the same call, or a loop allocating, ask for the same site again */
+	if (site != NULL && site->stats.file == file && site->stats.line == line)
+		return site;
+
+	h = (size_t)((((uintptr_t)file >> 3) ^ ((uintptr_t)line * 2654435761u)) % MEMCHECK_SITE_BUCKETS);
+	for (site = _memcheck_g_site_buckets[h]; site != NULL; site = site->next) {
+		if (site->stats.file == file && site->stats.line == line)
+			return _memcheck_g_site_last = site;
 	}
+
+#if MEMCHECK_MAX_SITES > 0
+	if (_memcheck_g_n_sites >= (size_t)MEMCHECK_MAX_SITES)
+		return NULL;
 #endif
+	if (_memcheck_g_n_sites == _memcheck_g_sites_cap) {
+		size_t cap = (_memcheck_g_sites_cap == 0) ? 64 : 2 * _memcheck_g_sites_cap;
+		_memcheck_site_t** grown = (_memcheck_site_t**) realloc(_memcheck_g_sites, cap * sizeof(*grown));
+		if (grown == NULL)
+			return NULL;
+		_memcheck_g_sites = grown;
+		_memcheck_g_sites_cap = cap;
+	}
+	site = (_memcheck_site_t*) malloc(sizeof(*site));
+	if (site == NULL)
+		return NULL;
+	memset(site, 0, sizeof(*site));
+	site->stats.file = file;
+	site->stats.line = line;
+	site->next = _memcheck_g_site_buckets[h];
+	_memcheck_g_site_buckets[h] = site;
+	_memcheck_g_sites[_memcheck_g_n_sites++] = site;
+	if (_memcheck_g_budgets_set)
+		_memcheck_budget_apply_rules(site);
+	return _memcheck_g_site_last = site;
+}
 
-	if (!memcheck_is_tracking()) {
-		new_ptr = realloc(ptr, new_size);
+
+static void _memcheck_site_add_live(_memcheck_site_t* site, size_t size, size_t usable)
+{
+	site->stats.n_live += 1;
+	site->stats.live_size += size;
+	site->stats.live_usable += usable;
+	site->stats.alloc_size += size;
+	if (site->stats.live_size > site->stats.peak_size)
+		site->stats.peak_size = site->stats.live_size;
+}
+
+
+static void _memcheck_site_remove_live(_memcheck_site_t* site, size_t size, size_t usable)
+{
+	site->stats.n_live -= 1;
+	site->stats.live_size -= size;
+	site->stats.live_usable -= usable;
+	site->stats.free_size += size;
+}
+
+
+static _memcheck_size_class_t* _memcheck_size_class_of(size_t size)
+{
+	size_t i = 0;
+	while (i < MEMCHECK_SIZE_CLASSES - 1 && ((size_t)1 << i) < size)
+		i++;
+	return &_memcheck_g_size_classes[i];
+}
+
+
+/* sign = 1 adds the block, -1 removes it */
+static void _memcheck_size_class_update(size_t size, size_t usable, int sign)
+{
+	_memcheck_size_class_t* cls = _memcheck_size_class_of(size);
+	if (sign > 0) {
+		cls->n_live += 1;
+		cls->live_size += size;
+		cls->live_usable += usable;
 	} else {
-		_memcheck_meta_t* meta;
-		_memcheck_tou_llist_t* elem;
-		memcheck_set_tracking(0);
+		cls->n_live -= 1;
+		cls->live_size -= size;
+		cls->live_usable -= usable;
+	}
+}
 
-		elem = _memcheck_tou_llist_find_exact_one(_memcheck_g_memblocks, ptr);
-		if (!elem) {
-#ifndef MEMCHECK_NO_CRITICAL_OUTPUT
-			if (ptr != NULL) {
-				fprintf(stderr/*memcheck_get_status_fp()*/, "[REALLOC] [!!] USING REALLOC ON NONEXISTENT ELEMENT (%p); RAW MALLOC/REALLOC/CALLOC USED SOMEWHERE?\n", ptr);
-				fflush(stderr/*memcheck_get_status_fp()*/);
-			}
-#endif
-			/* But patch it and continue anyways */
-			meta = memcheck_new_meta(file, line, 0);
-			elem = _memcheck_tou_llist_append(&_memcheck_g_memblocks, ptr, meta, 0,1);
-		} else {
-			meta = (_memcheck_meta_t*) elem->dat2;
-		}
 
-		/* Do output in two parts because using ptr after realloc is UB */
-#ifndef MEMCHECK_NO_OUTPUT
-		fprintf(memcheck_get_status_fp(), "[REALLOC] %p {n=%" _MEMCHECK_TOU_PRIuZ "}",
-			ptr, meta->size);
-		fflush(memcheck_get_status_fp());
-#endif
+/* Per-block bookkeeping shared by all tracked calls (threads, tags, sites). `self` may be NULL
+   when the event does not belong to any thread (patched blocks, purges). */
+static void _memcheck_account_alloc(_memcheck_meta_t* meta, _memcheck_thread_t* self)
+{
+	meta->generation = ++_memcheck_g_generation;
+	_memcheck_g_stats.n_live += 1;
+	_memcheck_g_stats.live_size += meta->size;
+	_memcheck_g_stats.live_usable += meta->usable;
+	_memcheck_size_class_update(meta->size, meta->usable, 1);
+	if (_memcheck_g_stats.live_size > _memcheck_g_stats.peak_size)
+		_memcheck_g_stats.peak_size = _memcheck_g_stats.live_size;
+	_memcheck_thread_on_alloc(meta, self);
+	_memcheck_tag_on_alloc(meta);
+	meta->site = _memcheck_site_get(meta->file, meta->line);
+	meta->origin = meta->site;
+	if (meta->site != NULL) {
+		meta->site->stats.n_allocs += 1;
+		_memcheck_site_add_live(meta->site, meta->size, meta->usable);
+	} else {
+		_MEMCHECK_FLAG_STORE(_memcheck_g_sites_dropped, _memcheck_g_sites_dropped + 1); /* Read by the report without the lock */
+	}
+}
 
-		new_ptr = realloc(ptr, new_size);
 
-#ifndef MEMCHECK_NO_OUTPUT
-		fprintf(memcheck_get_status_fp(), " --> %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
-			new_ptr, new_size, file, line);
-		fflush(memcheck_get_status_fp());
-#endif
+/* Adds a realloc() of a live block from meta->size to `new_size` to the chain of its originating site */
+static void _memcheck_account_resize(_memcheck_meta_t* meta, size_t new_size, int moved)
+{
+	_memcheck_realloc_stats_t* rs;
 
-		_memcheck_g_stats.n_reallocs += 1;
-		/* Change in total allocs only if requested size was 0 */
-		/* -> means it's effectively just a malloc */
-		if (meta->size == 0)
-			_memcheck_g_stats.n_total_allocs += 1;
+	if (meta->origin == NULL || meta->size == 0 || new_size == 0)
+		return;
+	rs = &meta->origin->resizes;
+	if (meta->n_resizes++ == 0)
+		rs->n_chains += 1;
+	if (meta->n_resizes > rs->max_chain)
+		rs->max_chain = meta->n_resizes;
+	rs->n_resizes += 1;
+	if (moved) {
+		rs->n_moved += 1;
+		rs->bytes_copied += (meta->size < new_size) ? meta->size : new_size;
+	} else {
+		rs->n_in_place += 1;
+	}
+	if (new_size > meta->size) {
+		rs->n_growths += 1;
+		rs->bytes_grown += new_size - meta->size;
+		meta->origin->growth_sum += (double)new_size / (double)meta->size;
+		if ((new_size - meta->size) / (double)meta->size * 100.0 < MEMCHECK_REALLOC_SMALL_STEP)
+			rs->n_small_steps += 1;
+	}
+}
 
-		_memcheck_g_stats.total_alloc_size += new_size - meta->size;
 
-		meta->file = file;
-		meta->line = line;
-		meta->size = new_size;
-		elem->dat1 = new_ptr;
-		
-		memcheck_set_tracking(1);
-		
+/* Also moves the block to its new call site and updates meta->file/line/size/usable */
+static int _memcheck_account_realloc(_memcheck_meta_t* meta, _memcheck_thread_t* self, const char* file, size_t line, size_t new_size, size_t new_usable)
+{
+	int cross = _memcheck_thread_on_realloc(meta, self, new_size);
+	meta->generation = ++_memcheck_g_generation;
+	_memcheck_g_stats.live_size += new_size - meta->size;
+	_memcheck_g_stats.live_usable += new_usable - meta->usable;
+	_memcheck_size_class_update(meta->size, meta->usable, -1);
+	_memcheck_size_class_update(new_size, new_usable, 1);
+	if (_memcheck_g_stats.live_size > _memcheck_g_stats.peak_size)
+		_memcheck_g_stats.peak_size = _memcheck_g_stats.live_size;
+	_memcheck_tag_on_realloc(meta, new_size);
+	if (meta->site != NULL)
+		_memcheck_site_remove_live(meta->site, meta->size, meta->usable);
+
+	meta->file = file;
+	meta->line = line;
+	meta->size = new_size;
+	meta->usable = new_usable;
+	meta->site = _memcheck_site_get(file, line);
+	if (meta->site != NULL) {
+		meta->site->stats.n_reallocs += 1;
+		_memcheck_site_add_live(meta->site, new_size, new_usable);
+	} else {
+		_MEMCHECK_FLAG_STORE(_memcheck_g_sites_dropped, _memcheck_g_sites_dropped + 1);
+	}
+	return cross;
+}
+
+
+/* Returns 1 if the block is freed on a different thread than the one that allocated it */
+static int _memcheck_account_free(_memcheck_meta_t* meta, _memcheck_thread_t* self)
+{
+	int cross = _memcheck_thread_on_free(meta, self);
+	_memcheck_g_generation += 1;
+	_memcheck_g_stats.n_live -= 1;
+	_memcheck_g_stats.live_size -= meta->size;
+	_memcheck_g_stats.live_usable -= meta->usable;
+	_memcheck_size_class_update(meta->size, meta->usable, -1);
+	_memcheck_tag_on_free(meta);
+	if (meta->site != NULL) {
+		meta->site->stats.n_frees += 1;
+		_memcheck_site_remove_live(meta->site, meta->size, meta->usable);
+	}
+	return cross;
+}
+
+
+_memcheck_meta_t* memcheck_new_meta(const char* file, size_t line, size_t size)
+{
+	_memcheck_meta_t* meta = (_memcheck_meta_t*) malloc(sizeof(*meta));
+	meta->file = file;
+	meta->line = line;
+	meta->size = size;
+	meta->usable = size;
+	meta->thread = NULL;
+	meta->site = NULL;
+	meta->tag = 0;
+	meta->flags = 0;
+	meta->origin = NULL;
+	meta->n_resizes = 0;
+	meta->generation = 0;
+	return meta;
+}
+
+
+/* Looks `ptr` up among regular blocks first, then among the permanent ones; `list` receives the owning list */
+static _memcheck_tou_llist_t* _memcheck_find_block(void* ptr, _memcheck_tou_llist_t*** list)
+{
+	_memcheck_tou_llist_t* elem = _memcheck_tou_llist_find_exact_one(_memcheck_g_memblocks, ptr);
+	*list = &_memcheck_g_memblocks;
+	if (elem == NULL && _memcheck_g_permanent != NULL) {
+		elem = _memcheck_tou_llist_find_exact_one(_memcheck_g_permanent, ptr);
+		if (elem != NULL)
+			*list = &_memcheck_g_permanent;
+	}
+	return elem;
+}
+
+
+/* Moves the cursors of blocks sections off a node that is leaving its list, on to `newer`. Call with the mutex held. */
+static void _memcheck_block_cursors_skip(const _memcheck_tou_llist_t* elem, _memcheck_tou_llist_t* newer)
+{
+	_memcheck_block_cursor_t* c;
+	for (c = _memcheck_g_block_cursors; c != NULL; c = c->next)
+		if (c->elem == elem)
+			c->elem = newer;
+}
+
+
+/* Removes (and destroys) the node, keeping the list's head reference up to date */
+static void _memcheck_unlink_block(_memcheck_tou_llist_t** list, _memcheck_tou_llist_t* elem)
+{
+	_memcheck_block_cursors_skip(elem, elem->next);
+	if (_memcheck_tou_llist_is_head(elem)) {
+		*list = _memcheck_tou_llist_remove(elem);
+	} else {
+		_memcheck_tou_llist_remove(elem);
+	}
+}
+
+
+/********** SHARED-MEMORY STATISTICS **********/
+
+#ifdef _MEMCHECK_SHM_SUPPORTED
+static _memcheck_shm_t* _memcheck_g_shm       = NULL; /* Published segment, NULL if there is none */
+static char             _memcheck_g_shm_name[64];     /* Its name, for shm_unlink() */
+static size_t           _memcheck_g_shm_calls = 0;    /* Tracked calls since the last summary refresh */
+
+/* Keeps the tail of `src`; for paths that is the part that tells them apart */
+static void _memcheck_shm_copy_str(char* dst, size_t cap, const char* src)
+{
+	size_t n = (src != NULL) ? strlen(src) : 0;
+	if (n >= cap) {
+		src += n - (cap - 1);
+		n = cap - 1;
+	}
+	if (n > 0)
+		memcpy(dst, src, n);
+	dst[n] = '\0';
+}
+
+
+/* Top-N selection by insertion into the short, descending tags[]/sites[] arrays */
+static void _memcheck_shm_summarize(_memcheck_shm_t* shm)
+{
+	size_t i, j;
+
+	shm->n_tags = 0;
+	for (i = 0; i < _memcheck_g_n_tags; i++) {
+		const _memcheck_tag_stats_t* tag = &_memcheck_g_tags[i];
+		j = shm->n_tags;
+		if (j == MEMCHECK_SHM_TAGS) {
+			if (tag->live_size <= shm->tags[j - 1].live_size)
+				continue;
+			j--;
+		} else {
+			shm->n_tags++;
+		}
+		for (; j > 0 && shm->tags[j - 1].live_size < tag->live_size; j--)
+			shm->tags[j] = shm->tags[j - 1];
+		_memcheck_shm_copy_str(shm->tags[j].name, sizeof(shm->tags[j].name), tag->name);
+		shm->tags[j].n_live    = tag->n_live;
+		shm->tags[j].live_size = tag->live_size;
+		shm->tags[j].peak_size = tag->peak_size;
+	}
+
+	shm->n_sites = 0;
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		const _memcheck_site_stats_t* site = &_memcheck_g_sites[i]->stats;
+		if (site->n_live == 0)
+			continue;
+		j = shm->n_sites;
+		if (j == MEMCHECK_SHM_SITES) {
+			if (site->live_size <= shm->sites[j - 1].live_size)
+				continue;
+			j--;
+		} else {
+			shm->n_sites++;
+		}
+		for (; j > 0 && shm->sites[j - 1].live_size < site->live_size; j--)
+			shm->sites[j] = shm->sites[j - 1];
+		_memcheck_shm_copy_str(shm->sites[j].file, sizeof(shm->sites[j].file), site->file);
+		shm->sites[j].line      = site->line;
+		shm->sites[j].n_allocs  = site->n_allocs;
+		shm->sites[j].n_live    = site->n_live;
+		shm->sites[j].live_size = site->live_size;
+	}
+}
+
+
+/* Called with the lock held after every tracked call; only the summaries cost more than a few stores */
+static void _memcheck_shm_publish(int summarize)
+{
+	_memcheck_shm_t* shm = _memcheck_g_shm;
+	if (shm == NULL)
+		return;
+
+	_MEMCHECK_SEQ_STORE(shm->seq, shm->seq + 1);
+	_MEMCHECK_SEQ_FENCE();
+	shm->stats = _memcheck_g_stats;
+	shm->n_updates += 1;
+	if (summarize || ++_memcheck_g_shm_calls >= MEMCHECK_SHM_REFRESH) {
+		_memcheck_g_shm_calls = 0;
+		shm->summary_time = (size_t) time(NULL);
+		_memcheck_shm_summarize(shm);
+	}
+	_MEMCHECK_SEQ_FENCE();
+	_MEMCHECK_SEQ_STORE(shm->seq, shm->seq + 1);
+}
+
+
+static void _memcheck_shm_close(void)
+{
+	if (_memcheck_g_shm == NULL)
+		return;
+	munmap((void*)_memcheck_g_shm, sizeof(*_memcheck_g_shm));
+	shm_unlink(_memcheck_g_shm_name);
+	_memcheck_g_shm = NULL;
+}
+
+#	define _MEMCHECK_SHM_PUBLISH() _memcheck_shm_publish(0)
+#else
+#	define _MEMCHECK_SHM_PUBLISH() ((void)0)
+#endif /* _MEMCHECK_SHM_SUPPORTED */
+
+
+int memcheck_shm_open(const char* name)
+{
+#ifdef _MEMCHECK_SHM_SUPPORTED
+	int fd;
+	void* addr;
+	_memcheck_shm_t* shm;
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	_memcheck_shm_close();
+	if (name == NULL)
+		sprintf(_memcheck_g_shm_name, "/memcheck.%ld", (long) getpid());
+	else
+		_memcheck_shm_copy_str(_memcheck_g_shm_name, sizeof(_memcheck_g_shm_name), name);
+
+	addr = MAP_FAILED;
+	fd = shm_open(_memcheck_g_shm_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, sizeof(_memcheck_shm_t)) == 0)
+			addr = mmap(NULL, sizeof(_memcheck_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+			shm_unlink(_memcheck_g_shm_name);
+	}
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "[%s] Could not create shared memory segment %s\n", __func__, _memcheck_g_shm_name);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return 0;
+	}
+
+	/* The segment starts out zeroed, so readers see an even (idle) seq */
+	shm = (_memcheck_shm_t*) addr;
+	shm->magic = MEMCHECK_SHM_MAGIC;
+	shm->version = MEMCHECK_SHM_VERSION;
+	shm->size = sizeof(*shm);
+	shm->pid = (size_t) getpid();
+	_memcheck_g_shm = shm;
+	_memcheck_shm_publish(1);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+#else
+	(void)name;
+	return 0;
+#endif
+}
+
+
+void memcheck_shm_update(void)
+{
+#ifdef _MEMCHECK_SHM_SUPPORTED
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_shm_publish(1);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+#endif
+}
+
+
+void memcheck_shm_close(void)
+{
+#ifdef _MEMCHECK_SHM_SUPPORTED
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_shm_close();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+#endif
+}
+
+/********** END SHARED-MEMORY STATISTICS **********/
+
+
+/********** HEAVY HITTERS **********/
+
+#ifdef MEMCHECK_ENABLE_HEAVY_HITTERS
+/*
+	Space-saving summary (Metwally et al.): MEMCHECK_HH_SLOTS counters, a hit adds to its counter,
+	  a new site takes over the smallest counter and inherits its value as the error.
+	Sites are found through a chained index over the slots; the smallest slot is only searched
+	  for when a new site arrives in a full summary.
+*/
+typedef struct {
+	_memcheck_hh_entry_t slot[MEMCHECK_HH_SLOTS];
+	int                  bucket[MEMCHECK_HH_SLOTS]; /* First slot + 1 of each chain, 0 = empty */
+	int                  next[MEMCHECK_HH_SLOTS];   /* Next slot + 1 in the chain */
+	size_t               n_used;
+	size_t               total;                     /* Weight of everything added */
+} _memcheck_hh_t;
+
+static _memcheck_hh_t _memcheck_g_hh[2]; /* Indexed by MEMCHECK_HH_COUNT / MEMCHECK_HH_BYTES */
+
+static size_t _memcheck_hh_bucket(const char* file, size_t line)
+{
+	return (size_t)((((uintptr_t)file >> 3) ^ ((uintptr_t)line * 2654435761u)) % MEMCHECK_HH_SLOTS);
+}
+
+static void _memcheck_hh_unlink(_memcheck_hh_t* hh, int idx)
+{
+	int* link = &hh->bucket[_memcheck_hh_bucket(hh->slot[idx].file, hh->slot[idx].line)];
+	while (*link != idx + 1)
+		link = &hh->next[*link - 1];
+	*link = hh->next[idx];
+}
+
+/* Call with the mutex held */
+static void _memcheck_hh_add(_memcheck_hh_t* hh, const char* file, size_t line, size_t weight)
+{
+	size_t h = _memcheck_hh_bucket(file, line);
+	int idx;
+
+	hh->total += weight;
+	for (idx = hh->bucket[h]; idx != 0; idx = hh->next[idx - 1]) {
+		if (hh->slot[idx - 1].file == file && hh->slot[idx - 1].line == line) {
+			hh->slot[idx - 1].weight += weight;
+			return;
+		}
+	}
+
+	if (hh->n_used < MEMCHECK_HH_SLOTS) {
+		idx = (int)hh->n_used++;
+		hh->slot[idx].weight = weight;
+		hh->slot[idx].error = 0;
+	} else {
+		int i;
+		idx = 0;
+		for (i = 1; i < MEMCHECK_HH_SLOTS; i++) {
+			if (hh->slot[i].weight < hh->slot[idx].weight)
+				idx = i;
+		}
+		_memcheck_hh_unlink(hh, idx);
+		hh->slot[idx].error = hh->slot[idx].weight;
+		hh->slot[idx].weight += weight;
+	}
+	hh->slot[idx].file = file;
+	hh->slot[idx].line = line;
+	hh->next[idx] = hh->bucket[h];
+	hh->bucket[h] = idx + 1;
+}
+
+#	define _MEMCHECK_HH_ADD(file, line, size) \
+		(_memcheck_hh_add(&_memcheck_g_hh[MEMCHECK_HH_COUNT], (file), (line), 1), \
+		 _memcheck_hh_add(&_memcheck_g_hh[MEMCHECK_HH_BYTES], (file), (line), (size)))
+
+static int _memcheck_hh_by_weight(const void* a, const void* b)
+{
+	size_t wa = ((const _memcheck_hh_entry_t*)a)->weight;
+	size_t wb = ((const _memcheck_hh_entry_t*)b)->weight;
+	return (wa < wb) - (wa > wb);
+}
+#else
+#	define _MEMCHECK_HH_ADD(file, line, size) ((void)0)
+#endif /* MEMCHECK_ENABLE_HEAVY_HITTERS */
+
+
+size_t memcheck_get_heavy_hitters(int by, _memcheck_hh_entry_t* out, size_t max, size_t* total)
+{
+#ifdef MEMCHECK_ENABLE_HEAVY_HITTERS
+	_memcheck_hh_entry_t slots[MEMCHECK_HH_SLOTS];
+	size_t n;
+
+	if (total != NULL)
+		*total = 0;
+	if (by != MEMCHECK_HH_COUNT && by != MEMCHECK_HH_BYTES)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_g_hh[by].n_used;
+	memcpy(slots, _memcheck_g_hh[by].slot, n * sizeof(slots[0]));
+	if (total != NULL)
+		*total = _memcheck_g_hh[by].total;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+
+	if (out == NULL)
+		return 0;
+	qsort(slots, n, sizeof(slots[0]), _memcheck_hh_by_weight);
+	if (n > max)
+		n = max;
+	memcpy(out, slots, n * sizeof(slots[0]));
+	return n;
+#else
+	(void)by; (void)out; (void)max;
+	if (total != NULL)
+		*total = 0;
+	return 0;
+#endif
+}
+
+
+size_t memcheck_report_heavy_hitters(FILE* fp)
+{
+	static const char* const titles[2] = { "allocations", "bytes" };
+	_memcheck_hh_entry_t top[MEMCHECK_HH_SLOTS];
+	size_t n_printed = 0;
+	int by;
+
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	for (by = MEMCHECK_HH_COUNT; by <= MEMCHECK_HH_BYTES; by++) {
+		size_t total, n, i;
+		n = memcheck_get_heavy_hitters(by, top, MEMCHECK_HH_SLOTS, &total);
+		if (n == 0)
+			continue;
+		fprintf(fp, "\n-=[ Heaviest sites by %s (of %" _MEMCHECK_TOU_PRIuZ ", errors <= %" _MEMCHECK_TOU_PRIuZ "): ]=-\n",
+			titles[by], total, total / MEMCHECK_HH_SLOTS);
+		for (i = 0; i < n; i++) {
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: %" _MEMCHECK_TOU_PRIuZ " (error <= %" _MEMCHECK_TOU_PRIuZ ")\n",
+				top[i].file, top[i].line, top[i].weight, top[i].error);
+		}
+		n_printed += n;
+	}
+	if (n_printed > 0) {
+		size_t dropped = _MEMCHECK_FLAG_LOAD(_memcheck_g_sites_dropped);
+		if (dropped > 0)
+			fprintf(fp, "  (%" _MEMCHECK_TOU_PRIuZ " calls at sites without exact stats, see MEMCHECK_MAX_SITES)\n", dropped);
+		fprintf(fp, "-=[ Heavy hitters over. ]=-\n\n");
+		fflush(fp);
+	}
+	return n_printed;
+}
+
+/********** END HEAVY HITTERS **********/
+
+
+/********** PROCESS MEMORY **********/
+
+/* glibc tells its in-use and free bytes (mallinfo() wraps around at 4 GiB, so only its successor is used).
+   Every chunk it hands out carries one size_t header on top of the usable bytes. */
+#if defined(__GLIBC__) && !defined(__ANDROID__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	#define _MEMCHECK_HAS_MALLINFO2
+	#define _MEMCHECK_CHUNK_HEADER sizeof(size_t)
+#endif
+
+static _memcheck_rss_sample_t _memcheck_g_rss[MEMCHECK_RSS_SAMPLES]; /* Ring of the kept samples */
+static size_t                 _memcheck_g_rss_head  = 0;              /* Slot of the next sample */
+static size_t                 _memcheck_g_rss_count = 0;              /* Samples in the ring */
+
+/* Resident bytes of the process, 0 where unknown */
+static size_t _memcheck_rss_read(void)
+{
+	size_t rss = 0;
+#if defined(__linux__)
+	unsigned long pages_total, pages_resident;
+	FILE* fp = fopen("/proc/self/statm", "r");
+	if (fp != NULL) {
+		if (fscanf(fp, "%lu %lu", &pages_total, &pages_resident) == 2)
+			rss = (size_t) pages_resident * (size_t) sysconf(_SC_PAGESIZE);
+		fclose(fp);
+	}
+#endif
+	return rss;
+}
+
+/* What the system and the allocator tell. Read without the mutex, since it means file I/O and a walk of the allocator's arenas */
+typedef struct {
+	size_t rss;
+#ifdef _MEMCHECK_HAS_MALLINFO2
+	struct mallinfo2 mi;
+#endif
+} _memcheck_rss_probe_t;
+
+static void _memcheck_rss_probe(_memcheck_rss_probe_t* p)
+{
+	/* Read first, so the FILE opened for it is gone again when the allocator is asked */
+	p->rss = _memcheck_rss_read();
+#ifdef _MEMCHECK_HAS_MALLINFO2
+	p->mi = mallinfo2();
+#endif
+}
+
+/* Fills `s` (taken at `now`) from the probe and the tracked counters. Call with the mutex held. */
+static int _memcheck_rss_fill(time_t now, const _memcheck_rss_probe_t* p, _memcheck_rss_sample_t* s)
+{
+	_memcheck_overhead_t ov;
+	size_t accounted;
+#ifdef _MEMCHECK_HAS_MALLINFO2
+	const struct mallinfo2* mi = &p->mi;
+	size_t headers;
+#endif
+
+	memset(s, 0, sizeof(*s));
+	s->time = now;
+	s->rss  = p->rss;
+	memcheck_get_overhead(&ov);
+	s->tracked  = ov.live_size;
+	s->slack    = ov.slack;
+	s->overhead = ov.meta_size + ov.table_size;
+	accounted   = s->tracked + s->slack + s->overhead;
+#ifdef _MEMCHECK_HAS_MALLINFO2
+	/* A tracked block takes three chunks: the block itself, its list node and its metadata.
+	   An interposed allocator (tcmalloc, a sanitizer...) leaves glibc's numbers at 0, so they tell nothing. */
+	if (mi->arena + mi->hblkhd > 0) {
+		headers      = ov.n_live * _MEMCHECK_CHUNK_HEADER;
+		s->slack    += headers;
+		s->overhead += 2 * headers;
+		accounted   += 3 * headers;
+		s->has_heap   = 1;
+		s->untracked  = (mi->uordblks + mi->hblkhd > accounted) ? mi->uordblks + mi->hblkhd - accounted : 0;
+		s->retained   = mi->keepcost;
+		s->fragmented = (mi->fordblks > mi->keepcost) ? mi->fordblks - mi->keepcost : 0;
+		accounted    += s->untracked + s->fragmented + s->retained;
+	}
+#endif
+	/* Free heap pages need not be resident, so the parts can exceed rss */
+	s->other = (s->rss > accounted) ? s->rss - accounted : 0;
+	return s->rss != 0;
+}
+
+/* Adds `s` to the ring. Call with the mutex held. */
+static void _memcheck_rss_keep(const _memcheck_rss_sample_t* s)
+{
+	_memcheck_g_rss[_memcheck_g_rss_head] = *s;
+	_memcheck_g_rss_head = (_memcheck_g_rss_head + 1) % MEMCHECK_RSS_SAMPLES;
+	if (_memcheck_g_rss_count < MEMCHECK_RSS_SAMPLES)
+		_memcheck_g_rss_count += 1;
+}
+
+/* Takes a sample and keeps it. Call without the mutex held; it is only taken for the tracked counters. */
+static int _memcheck_rss_take(time_t now, _memcheck_rss_sample_t* s)
+{
+	_memcheck_rss_probe_t probe;
+	int ok;
+
+	_memcheck_rss_probe(&probe);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		memset(s, 0, sizeof(*s));
+		return 0;
+	}
+#endif
+	ok = _memcheck_rss_fill(now, &probe, s);
+	_memcheck_rss_keep(s);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return ok;
+}
+
+/* Copies the last `max` samples, oldest first. Call with the mutex held. */
+static size_t _memcheck_rss_copy(_memcheck_rss_sample_t* out, size_t max)
+{
+	size_t n = (_memcheck_g_rss_count < max) ? _memcheck_g_rss_count : max;
+	size_t first = (_memcheck_g_rss_head + MEMCHECK_RSS_SAMPLES - n) % MEMCHECK_RSS_SAMPLES;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = _memcheck_g_rss[(first + i) % MEMCHECK_RSS_SAMPLES];
+	return n;
+}
+
+
+int memcheck_sample_rss(_memcheck_rss_sample_t* out)
+{
+	_memcheck_rss_sample_t s;
+	int ok = _memcheck_rss_take(time(NULL), &s);
+	if (out != NULL)
+		*out = s;
+	return ok;
+}
+
+
+size_t memcheck_get_rss_samples(_memcheck_rss_sample_t* out, size_t max)
+{
+	size_t n;
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_rss_copy(out, max);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+}
+
+
+/* Prints "+N" or "-N" for the change from `from` to `to` */
+static void _memcheck_rss_delta(FILE* fp, size_t from, size_t to)
+{
+	if (to >= from)
+		fprintf(fp, "+%" _MEMCHECK_TOU_PRIuZ, to - from);
+	else
+		fprintf(fp, "-%" _MEMCHECK_TOU_PRIuZ, from - to);
+}
+
+/* The breakdown of one sample, shared by memcheck_report_rss() and memcheck_stats() */
+static void _memcheck_rss_print(FILE* fp, const _memcheck_rss_sample_t* s)
+{
+	fprintf(fp, "  - Resident (RSS):         %" _MEMCHECK_TOU_PRIuZ "\n", s->rss);
+	fprintf(fp, "     Tracked live bytes:    %" _MEMCHECK_TOU_PRIuZ "\n", s->tracked);
+	fprintf(fp, "     Allocator slack:       %" _MEMCHECK_TOU_PRIuZ "\n", s->slack);
+	fprintf(fp, "     Memcheck overhead:     %" _MEMCHECK_TOU_PRIuZ "\n", s->overhead);
+	if (s->has_heap) {
+		fprintf(fp, "     Untracked heap:        %" _MEMCHECK_TOU_PRIuZ "\n", s->untracked);
+		fprintf(fp, "     Fragmented free:       %" _MEMCHECK_TOU_PRIuZ "\n", s->fragmented);
+		fprintf(fp, "     Retained free:         %" _MEMCHECK_TOU_PRIuZ "\n", s->retained);
+		fprintf(fp, "     Outside the heap:      %" _MEMCHECK_TOU_PRIuZ "\n", s->other);
+	} else {
+		fprintf(fp, "     Rest:                  %" _MEMCHECK_TOU_PRIuZ " (untracked, free heap, code, stacks)\n", s->other);
+	}
+}
+
+
+size_t memcheck_report_rss(FILE* fp)
+{
+	_memcheck_rss_sample_t* run;
+	_memcheck_rss_sample_t now;
+	_memcheck_rss_probe_t probe;
+	size_t n, i;
+
+	run = (_memcheck_rss_sample_t*) malloc(MEMCHECK_RSS_SAMPLES * sizeof(*run));
+	if (run == NULL)
+		return 0;
+	_memcheck_rss_probe(&probe);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		free(run);
+		return 0;
+	}
+#endif
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	_memcheck_rss_fill(time(NULL), &probe, &now);
+	_memcheck_rss_keep(&now);
+	n = _memcheck_rss_copy(run, MEMCHECK_RSS_SAMPLES);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+
+	fprintf(fp, "\n-=[ Process memory vs. tracked bytes: ]=-\n");
+	if (now.rss == 0) {
+		fprintf(fp, "  (the resident size can't be read on this platform)\n");
+		fprintf(fp, "-=[ Process memory report over. ]=-\n\n");
+		fflush(fp);
+		free(run);
+		return 0;
+	}
+	_memcheck_rss_print(fp, &now);
+	if (n > 1) {
+		const _memcheck_rss_sample_t* first = &run[0];
+		const char* culprit = "outside the heap";
+		size_t grown = (now.other > first->other) ? now.other - first->other : 0;
+
+		fprintf(fp, "-=[ Over time (%" _MEMCHECK_TOU_PRIuZ " samples): ]=-\n", n);
+		fprintf(fp, "  > %8s %14s %14s %14s %14s %14s %14s\n",
+			"SECONDS", "RSS", "TRACKED", "GAP", "UNTRACKED", "FRAGMENTED", "RETAINED");
+		for (i = 0; i < n; i++) {
+			const _memcheck_rss_sample_t* s = &run[i];
+			fprintf(fp, "  > %8ld %14" _MEMCHECK_TOU_PRIuZ " %14" _MEMCHECK_TOU_PRIuZ " %14" _MEMCHECK_TOU_PRIuZ
+				" %14" _MEMCHECK_TOU_PRIuZ " %14" _MEMCHECK_TOU_PRIuZ " %14" _MEMCHECK_TOU_PRIuZ "\n",
+				(long) (s->time - first->time), s->rss, s->tracked, (s->rss > s->tracked) ? s->rss - s->tracked : 0,
+				s->untracked, s->fragmented, s->retained);
+		}
+
+		/* Name the part of the gap that grew the most since the first sample */
+		if (now.has_heap) {
+			if (now.untracked > first->untracked && now.untracked - first->untracked > grown) {
+				grown = now.untracked - first->untracked;
+				culprit = "untracked allocations";
+			}
+			if (now.fragmented > first->fragmented && now.fragmented - first->fragmented > grown) {
+				grown = now.fragmented - first->fragmented;
+				culprit = "fragmentation";
+			}
+			if (now.retained > first->retained && now.retained - first->retained > grown) {
+				grown = now.retained - first->retained;
+				culprit = "retained free memory";
+			}
+		}
+		fprintf(fp, "-=[ Since the first sample: ]=-\n");
+		fprintf(fp, "  - RSS ");
+		_memcheck_rss_delta(fp, first->rss, now.rss);
+		fprintf(fp, ", tracked ");
+		_memcheck_rss_delta(fp, first->tracked, now.tracked);
+		fprintf(fp, " bytes\n");
+		if (grown > 0)
+			fprintf(fp, "  - Most of the gap's growth: %s (+%" _MEMCHECK_TOU_PRIuZ ")\n", culprit, grown);
+	}
+	fprintf(fp, "-=[ Process memory report over. ]=-\n\n");
+	fflush(fp);
+	free(run);
+	return n;
+}
+
+/********** END PROCESS MEMORY **********/
+
+
+/********** HEAP TIMELINE **********/
+
+#ifdef MEMCHECK_ENABLE_TIMELINE
+static time_t                      _memcheck_g_tl_time[MEMCHECK_TIMELINE_BUCKETS];   /* Time of each sample in the ring */
+static _memcheck_timeline_sample_t _memcheck_g_tl_total[MEMCHECK_TIMELINE_BUCKETS];  /* Whole-program samples */
+static size_t                      _memcheck_g_tl_head  = 0; /* Slot of the next sample */
+static size_t                      _memcheck_g_tl_count = 0; /* Samples in the ring */
+static time_t                      _memcheck_g_tl_last  = 0; /* Time of the last sample */
+static _MEMCHECK_TLS time_t        _memcheck_t_rss_due  = 0; /* Time of a sample whose process memory part is still to be read */
+
+/* One pass over the site table: the live counters are kept per site anyway, so no block is visited.
+   Call with the mutex held. */
+static void _memcheck_timeline_sample(time_t now)
+{
+	size_t slot = _memcheck_g_tl_head;
+	size_t prev = (slot + MEMCHECK_TIMELINE_BUCKETS - 1) % MEMCHECK_TIMELINE_BUCKETS;
+	size_t i;
+
+	_memcheck_g_tl_time[slot] = now;
+	_memcheck_g_tl_total[slot].time      = now;
+	_memcheck_g_tl_total[slot].n_live    = _memcheck_g_stats.n_live;
+	_memcheck_g_tl_total[slot].live_size = _memcheck_g_stats.live_size;
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		_memcheck_site_t* site = _memcheck_g_sites[i];
+		/* A site that is younger than the previous sample had nothing live back then (its ring starts zeroed) */
+		if (_memcheck_g_tl_count > 0 && site->stats.live_size > site->tl_live_size[prev])
+			site->tl_growing += 1;
+		else
+			site->tl_growing = 0;
+		site->tl_n_live[slot]    = site->stats.n_live;
+		site->tl_live_size[slot] = site->stats.live_size;
+	}
+
+	_memcheck_g_tl_head = (slot + 1) % MEMCHECK_TIMELINE_BUCKETS;
+	if (_memcheck_g_tl_count < MEMCHECK_TIMELINE_BUCKETS)
+		_memcheck_g_tl_count += 1;
+	_memcheck_g_tl_last = now;
+
+	/* Resident memory next to it, so memcheck_report_rss() has a history without extra calls.
+	   Reading it means file I/O, so it waits until this thread has released the mutex. */
+	_memcheck_t_rss_due = now;
+}
+
+/* Takes the process memory sample that the last timeline sample of this thread asked for */
+static void _memcheck_timeline_rss(void)
+{
+	_memcheck_rss_sample_t rss;
+	time_t due = _memcheck_t_rss_due;
+	_memcheck_t_rss_due = 0;
+	_memcheck_rss_take(due, &rss);
+}
+
+/* Piggy-backed on tracked calls: one time() call unless a sample is due */
+static void _memcheck_timeline_poll(void)
+{
+	time_t now = time(NULL);
+	if (_memcheck_g_tl_count == 0 || now - _memcheck_g_tl_last >= MEMCHECK_TIMELINE_INTERVAL)
+		_memcheck_timeline_sample(now);
+}
+
+/* Copies the last `max` samples of `site` (NULL -> whole program), oldest first. Call with the mutex held. */
+static size_t _memcheck_timeline_copy(const _memcheck_site_t* site, _memcheck_timeline_sample_t* out, size_t max)
+{
+	size_t n = (_memcheck_g_tl_count < max) ? _memcheck_g_tl_count : max;
+	size_t first = (_memcheck_g_tl_head + MEMCHECK_TIMELINE_BUCKETS - n) % MEMCHECK_TIMELINE_BUCKETS;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		size_t slot = (first + i) % MEMCHECK_TIMELINE_BUCKETS;
+		if (site == NULL) {
+			out[i] = _memcheck_g_tl_total[slot];
+		} else {
+			out[i].time      = _memcheck_g_tl_time[slot];
+			out[i].n_live    = site->tl_n_live[slot];
+			out[i].live_size = site->tl_live_size[slot];
+		}
+	}
+	return n;
+}
+
+#	define _MEMCHECK_TIMELINE_POLL() _memcheck_timeline_poll()
+/* After releasing the mutex */
+#	define _MEMCHECK_TIMELINE_RSS() \
+		do { if (_memcheck_t_rss_due != 0) _memcheck_timeline_rss(); } while (0)
+#else
+#	define _MEMCHECK_TIMELINE_POLL() ((void)0)
+#	define _MEMCHECK_TIMELINE_RSS()  ((void)0)
+#endif /* MEMCHECK_ENABLE_TIMELINE */
+
+
+void memcheck_timeline_tick(void)
+{
+#ifdef MEMCHECK_ENABLE_TIMELINE
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_timeline_sample(time(NULL));
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	_MEMCHECK_TIMELINE_RSS();
+#endif
+}
+
+
+size_t memcheck_get_timeline(_memcheck_timeline_sample_t* out, size_t max)
+{
+#ifdef MEMCHECK_ENABLE_TIMELINE
+	size_t n;
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_timeline_copy(NULL, out, max);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+#else
+	(void)out; (void)max;
+	return 0;
+#endif
+}
+
+
+size_t memcheck_get_site_timeline(size_t idx, _memcheck_timeline_sample_t* out, size_t max)
+{
+#ifdef MEMCHECK_ENABLE_TIMELINE
+	size_t n = 0;
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (idx < _memcheck_g_n_sites)
+		n = _memcheck_timeline_copy(_memcheck_g_sites[idx], out, max);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+#else
+	(void)idx; (void)out; (void)max;
+	return 0;
+#endif
+}
+
+
+size_t memcheck_report_growth(FILE* fp)
+{
+#ifdef MEMCHECK_ENABLE_TIMELINE
+	/* Growing sites with the first and last sample of their run, copied under the lock */
+	typedef struct {
+		const char*                 file;
+		size_t                      line;
+		size_t                      n_growing;
+		_memcheck_timeline_sample_t from;
+		_memcheck_timeline_sample_t to;
+	} growing_t;
+	growing_t* found = NULL;
+	size_t n_found = 0;
+	size_t i;
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		const _memcheck_site_t* site = _memcheck_g_sites[i];
+		_memcheck_timeline_sample_t run[MEMCHECK_TIMELINE_BUCKETS];
+		size_t n;
+		if (site->tl_growing < MEMCHECK_TIMELINE_TREND)
+			continue;
+		if (found == NULL) {
+			found = (growing_t*) malloc((_memcheck_g_n_sites - i) * sizeof(*found));
+			if (found == NULL)
+				break;
+		}
+		/* The run may be longer than the ring; it then starts at the oldest sample still kept */
+		n = _memcheck_timeline_copy(site, run, (site->tl_growing + 1 < MEMCHECK_TIMELINE_BUCKETS) ? site->tl_growing + 1 : MEMCHECK_TIMELINE_BUCKETS);
+		found[n_found].file      = site->stats.file;
+		found[n_found].line      = site->stats.line;
+		found[n_found].n_growing = site->tl_growing;
+		found[n_found].from      = run[0];
+		found[n_found].to        = run[n - 1];
+		n_found++;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	if (n_found == 0)
+		return 0;
+
+	fprintf(fp, "\n-=[ Sites with steadily growing live bytes: ]=-\n");
+	for (i = 0; i < n_found; i++) {
+		const growing_t* g = &found[i];
+		fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: grew in %" _MEMCHECK_TOU_PRIuZ " samples in a row, %" _MEMCHECK_TOU_PRIuZ " -> %" _MEMCHECK_TOU_PRIuZ
+			" bytes, %" _MEMCHECK_TOU_PRIuZ " -> %" _MEMCHECK_TOU_PRIuZ " blocks in %lds\n",
+			g->file, g->line, g->n_growing, g->from.live_size, g->to.live_size, g->from.n_live, g->to.n_live, (long)(g->to.time - g->from.time));
+	}
+	fprintf(fp, "-=[ Growth report over. ]=-\n\n");
+	fflush(fp);
+	free(found);
+	return n_found;
+#else
+	(void)fp;
+	return 0;
+#endif
+}
+
+/********** END HEAP TIMELINE **********/
+
+
+/********** MEMORY BUDGETS **********/
+
+/* Budgets set by file name; applied to matching sites when they are created */
+typedef struct {
+	char*  file;
+	size_t line;   /* 0: every line */
+	size_t bytes;
+	int    action;
+} _memcheck_site_rule_t;
+
+static _memcheck_site_rule_t* _memcheck_g_site_rules   = NULL;
+static size_t                 _memcheck_g_n_site_rules = 0;
+static _memcheck_budget_fn_t  _memcheck_g_budget_fn    = NULL;
+static void*                  _memcheck_g_budget_ctx   = NULL;
+
+/* Budgets hit by this thread's current call (a site and a tag at most); the callback gets them once the lock is released */
+typedef struct {
+	_memcheck_budget_event_t event;
+	_memcheck_budget_fn_t    fn;
+	void*                    ctx;
+} _memcheck_budget_pending_t;
+
+static _MEMCHECK_TLS _memcheck_budget_pending_t _memcheck_t_budget_pending[2];
+static _MEMCHECK_TLS size_t                     _memcheck_t_n_budget_pending = 0;
+
+
+/* Rules are compared by name here, once per site; later rules override earlier ones */
+static void _memcheck_budget_apply_rules(_memcheck_site_t* site)
+{
+	size_t i;
+	for (i = 0; i < _memcheck_g_n_site_rules; i++) {
+		const _memcheck_site_rule_t* rule = &_memcheck_g_site_rules[i];
+		if ((rule->line == 0 || rule->line == site->stats.line) && strcmp(rule->file, site->stats.file) == 0) {
+			site->budget.bytes = rule->bytes;
+			site->budget.action = rule->action;
+		}
+	}
+}
+
+
+/* Runs the budget's action, except for the callback, which is queued for _memcheck_budget_notify().
+   Returns 0 if the allocation must fail */
+static int _memcheck_budget_exceeded(_memcheck_budget_t* budget, const char* file, size_t line, const char* tag, size_t live, size_t request)
+{
+	budget->n_exceeded += 1;
+	if (budget->action & MEMCHECK_BUDGET_LOG) {
+		_memcheck_g_dispatch.warn("[BUDGET ] [!!] %s%s%s OVER BUDGET: %" _MEMCHECK_TOU_PRIuZ " + %" _MEMCHECK_TOU_PRIuZ " > %" _MEMCHECK_TOU_PRIuZ " BYTES @ %s L%" _MEMCHECK_TOU_PRIuZ "%s\n",
+			(tag != NULL) ? "TAG \"" : "SITE", (tag != NULL) ? tag : "", (tag != NULL) ? "\"" : "",
+			live, request, budget->bytes, file, line, (budget->action & MEMCHECK_BUDGET_FAIL) ? " <FAILING>" : "");
+	}
+	if ((budget->action & MEMCHECK_BUDGET_CALLBACK) && _memcheck_g_budget_fn != NULL
+	    && _memcheck_t_n_budget_pending < sizeof(_memcheck_t_budget_pending) / sizeof(_memcheck_t_budget_pending[0])) {
+		_memcheck_budget_pending_t* pending = &_memcheck_t_budget_pending[_memcheck_t_n_budget_pending++];
+		pending->event.file      = file;
+		pending->event.line      = line;
+		pending->event.tag       = tag;
+		pending->event.live_size = live;
+		pending->event.request   = request;
+		pending->event.budget    = budget->bytes;
+		pending->event.action    = budget->action;
+		pending->fn  = _memcheck_g_budget_fn;
+		pending->ctx = _memcheck_g_budget_ctx;
+	}
+	return !(budget->action & MEMCHECK_BUDGET_FAIL);
+}
+
+
+/* Calls the budget callback for the events queued by this thread. Call after releasing the mutex;
+   the queue is emptied first, so the callback may allocate (and hit budgets) itself. */
+static void _memcheck_budget_notify(void)
+{
+	_memcheck_budget_pending_t pending[2];
+	size_t i, n = _memcheck_t_n_budget_pending;
+
+	memcpy(pending, _memcheck_t_budget_pending, n * sizeof(pending[0]));
+	_memcheck_t_n_budget_pending = 0;
+	for (i = 0; i < n; i++)
+		pending[i].fn(&pending[i].event, pending[i].ctx);
+}
+
+#define _MEMCHECK_BUDGET_NOTIFY() \
+	do { if (_memcheck_t_n_budget_pending > 0) _memcheck_budget_notify(); } while (0)
+
+
+/*
+	Called with the mutex held before an allocation of `size` bytes at file/line; `meta` is the block
+	  being reallocated, NULL for malloc()/calloc(). The live counters are kept up to date anyway, so a
+	  budget costs a comparison per call. Returns 0 if the allocation must fail.
+*/
+static int _memcheck_budget_check(const char* file, size_t line, const _memcheck_meta_t* meta, size_t size)
+{
+	_memcheck_site_t* site = _memcheck_site_get(file, line);
+	size_t tag_id = (meta != NULL) ? meta->tag : _memcheck_t_tag;
+	int allow = 1;
+
+	if (site != NULL && site->budget.bytes > 0) {
+		/* A block reallocated at its own site only adds the difference */
+		size_t live = site->stats.live_size - ((meta != NULL && meta->site == site) ? meta->size : 0);
+		if (live + size > site->budget.bytes && live + size > site->stats.live_size)
+			allow &= _memcheck_budget_exceeded(&site->budget, file, line, NULL, live, size);
+	}
+	if (tag_id < _memcheck_g_n_tag_budgets && _memcheck_g_tag_budgets[tag_id].bytes > 0) {
+		_memcheck_tag_stats_t* tag = _memcheck_tag_entry(tag_id);
+		size_t live = tag->live_size - ((meta != NULL) ? meta->size : 0);
+		if (live + size > _memcheck_g_tag_budgets[tag_id].bytes && live + size > tag->live_size)
+			allow &= _memcheck_budget_exceeded(&_memcheck_g_tag_budgets[tag_id], file, line, tag->name, live, size);
+	}
+	return allow;
+}
+
+
+int memcheck_set_site_budget(const char* file, size_t line, size_t bytes, int action)
+{
+	_memcheck_site_rule_t* grown;
+	char* copy;
+	size_t i;
+
+	if (file == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	grown = (_memcheck_site_rule_t*) realloc(_memcheck_g_site_rules, (_memcheck_g_n_site_rules + 1) * sizeof(*grown));
+	copy = (char*) malloc(strlen(file) + 1);
+	if (grown != NULL)
+		_memcheck_g_site_rules = grown;
+	if (grown == NULL || copy == NULL) {
+		free(copy);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return 0;
+	}
+	strcpy(copy, file);
+	_memcheck_g_site_rules[_memcheck_g_n_site_rules].file = copy;
+	_memcheck_g_site_rules[_memcheck_g_n_site_rules].line = line;
+	_memcheck_g_site_rules[_memcheck_g_n_site_rules].bytes = bytes;
+	_memcheck_g_site_rules[_memcheck_g_n_site_rules].action = action;
+	_memcheck_g_n_site_rules += 1;
+	_memcheck_g_budgets_set = 1;
+
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		_memcheck_site_t* site = _memcheck_g_sites[i];
+		if ((line == 0 || line == site->stats.line) && strcmp(file, site->stats.file) == 0) {
+			site->budget.bytes = bytes;
+			site->budget.action = action;
+		}
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+}
+
+
+int memcheck_set_tag_budget(const char* name, size_t bytes, int action)
+{
+	size_t id;
+
+	if (name == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	id = memcheck_intern_tag(name);
+	if (id >= _memcheck_g_n_tag_budgets) {
+		_memcheck_budget_t* grown = (_memcheck_budget_t*) realloc(_memcheck_g_tag_budgets, (id + 1) * sizeof(*grown));
+		if (grown == NULL) {
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+			_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+			return 0;
+		}
+		memset(&grown[_memcheck_g_n_tag_budgets], 0, (id + 1 - _memcheck_g_n_tag_budgets) * sizeof(*grown));
+		_memcheck_g_tag_budgets = grown;
+		_memcheck_g_n_tag_budgets = id + 1;
+	}
+	_memcheck_g_tag_budgets[id].bytes = bytes;
+	_memcheck_g_tag_budgets[id].action = action;
+	_memcheck_g_budgets_set = 1;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+}
+
+
+void memcheck_set_budget_callback(_memcheck_budget_fn_t fn, void* ctx)
+{
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_g_budget_fn = fn;
+	_memcheck_g_budget_ctx = ctx;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+
+size_t memcheck_report_budgets(FILE* fp)
+{
+	/* Budgeted sites and tags, copied under the lock */
+	typedef struct {
+		const char*        file; /* NULL for tags */
+		size_t             line;
+		const char*        tag;
+		size_t             live_size;
+		size_t             peak_size;
+		_memcheck_budget_t budget;
+	} budgeted_t;
+	budgeted_t* found;
+	size_t n_found = 0, n_hit = 0;
+	size_t i;
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	found = (budgeted_t*) malloc((_memcheck_g_n_sites + _memcheck_g_n_tag_budgets + 1) * sizeof(*found));
+	for (i = 0; found != NULL && i < _memcheck_g_n_sites; i++) {
+		const _memcheck_site_t* site = _memcheck_g_sites[i];
+		if (site->budget.bytes == 0)
+			continue;
+		found[n_found].file      = site->stats.file;
+		found[n_found].line      = site->stats.line;
+		found[n_found].tag       = NULL;
+		found[n_found].live_size = site->stats.live_size;
+		found[n_found].peak_size = site->stats.peak_size;
+		found[n_found].budget    = site->budget;
+		n_found++;
+	}
+	for (i = 0; found != NULL && i < _memcheck_g_n_tag_budgets && i < _memcheck_g_n_tags; i++) {
+		if (_memcheck_g_tag_budgets[i].bytes == 0)
+			continue;
+		found[n_found].file      = NULL;
+		found[n_found].line      = 0;
+		found[n_found].tag       = _memcheck_g_tags[i].name; /* Tag names live until memcheck_cleanup() */
+		found[n_found].live_size = _memcheck_g_tags[i].live_size;
+		found[n_found].peak_size = _memcheck_g_tags[i].peak_size;
+		found[n_found].budget    = _memcheck_g_tag_budgets[i];
+		n_found++;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	if (n_found == 0) {
+		free(found);
+		return 0;
+	}
+
+	fprintf(fp, "\n-=[ Memory budgets: ]=-\n");
+	for (i = 0; i < n_found; i++) {
+		const budgeted_t* b = &found[i];
+		if (b->file != NULL)
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: ", b->file, b->line);
+		else
+			fprintf(fp, "  > tag \"%s\" :: ", b->tag);
+		fprintf(fp, "%" _MEMCHECK_TOU_PRIuZ " / %" _MEMCHECK_TOU_PRIuZ " bytes live, peak %" _MEMCHECK_TOU_PRIuZ "%s",
+			b->live_size, b->budget.bytes, b->peak_size, (b->peak_size > b->budget.bytes) ? " (over)" : "");
+		if (b->budget.n_exceeded > 0) {
+			fprintf(fp, ", hit %" _MEMCHECK_TOU_PRIuZ " times", b->budget.n_exceeded);
+			n_hit++;
+		}
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "-=[ Budget report over. ]=-\n\n");
+	fflush(fp);
+	free(found);
+	return n_hit;
+}
+
+/********** END MEMORY BUDGETS **********/
+
+
+/********** CALL-SITE FILTERS **********/
+
+/* Include or exclude pattern */
+typedef struct {
+	char*  glob;
+	size_t line;    /* 0: every line */
+	int    include;
+} _memcheck_filter_t;
+
+/* Cached decision of one call site. Entries are published once to readers that do not take the lock
+   and are only freed by memcheck_cleanup(); `track` is re-evaluated in place when the patterns change. */
+typedef struct _memcheck_filter_site_s {
+	struct _memcheck_filter_site_s* next;
+	const char*                     file;
+	size_t                          line;
+	int                             track;
+} _memcheck_filter_site_t;
+
+static _memcheck_filter_t*      _memcheck_g_filters   = NULL;
+static size_t                   _memcheck_g_n_filters = 0;
+static int                      _memcheck_g_filtered  = 0; /* Whether any pattern is set */
+static _memcheck_filter_site_t* _memcheck_g_filter_buckets[MEMCHECK_FILTER_BUCKETS];
+
+
+/* '*' matches any run of characters (also '/'), '?' any single one */
+static int _memcheck_glob_match(const char* glob, const char* s)
+{
+	const char* star = NULL;
+	const char* resume = NULL;
+
+	while (*s != '\0') {
+		if (*glob == '*') {
+			star = glob++;
+			resume = s;
+		} else if (*glob == '?' || *glob == *s) {
+			glob++;
+			s++;
+		} else if (star != NULL) {
+			glob = star + 1;
+			s = ++resume;
+		} else {
+			return 0;
+		}
+	}
+	while (*glob == '*')
+		glob++;
+	return *glob == '\0';
+}
+
+
+/* Compares the site against every pattern. Call with the mutex held. */
+static int _memcheck_filter_evaluate(const char* file, size_t line)
+{
+	int has_include = 0;
+	int included = 0;
+	size_t i;
+
+	for (i = 0; i < _memcheck_g_n_filters; i++) {
+		const _memcheck_filter_t* filter = &_memcheck_g_filters[i];
+		int matches = (filter->line == 0 || filter->line == line) && _memcheck_glob_match(filter->glob, file);
+		if (!filter->include) {
+			if (matches)
+				return 0;
+		} else {
+			has_include = 1;
+			included |= matches;
+		}
+	}
+	return !has_include || included;
+}
+
+
+/* Slow path of _memcheck_filter_allows(): evaluates the site under the lock and caches the decision */
+static int _memcheck_filter_add_site(const char* file, size_t line, size_t h)
+{
+	_memcheck_filter_site_t* entry;
+	int track = 1;
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 1;
+	}
+#endif
+	/* Another thread may have added it in the meantime */
+	for (entry = _memcheck_g_filter_buckets[h]; entry != NULL; entry = entry->next) {
+		if (entry->file == file && entry->line == line)
+			break;
+	}
+	if (entry != NULL) {
+		track = entry->track;
+	} else {
+		track = _memcheck_filter_evaluate(file, line);
+		entry = (_memcheck_filter_site_t*) malloc(sizeof(*entry));
+		if (entry != NULL) { /* Otherwise the site is simply evaluated again next time */
+			entry->file = file;
+			entry->line = line;
+			entry->track = track;
+			entry->next = _memcheck_g_filter_buckets[h];
+			_MEMCHECK_PTR_STORE(_memcheck_g_filter_buckets[h], entry);
+		}
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return track;
+}
+
+
+/* Whether calls from file:line are tracked (the admit() of filtered dispatches). Once the site is cached
+   this is a bucket load and, almost always, a single entry, without the lock. */
+static int _memcheck_filter_allows(const char* file, size_t line)
+{
+	size_t h = (size_t)((((uintptr_t)file >> 3) ^ ((uintptr_t)line * 2654435761u)) % MEMCHECK_FILTER_BUCKETS);
+	_memcheck_filter_site_t* entry;
+
+	for (entry = _MEMCHECK_PTR_LOAD(_memcheck_g_filter_buckets[h]); entry != NULL; entry = entry->next) {
+		if (entry->file == file && entry->line == line)
+			return _MEMCHECK_FLAG_LOAD(entry->track);
+	}
+	return _memcheck_filter_add_site(file, line, h);
+}
+
+
+/* Re-evaluates the cached decisions after the patterns changed. Call with the mutex held. */
+static void _memcheck_select_dispatch(void);
+
+static void _memcheck_filter_refresh(void)
+{
+	size_t h;
+	for (h = 0; h < MEMCHECK_FILTER_BUCKETS; h++) {
+		_memcheck_filter_site_t* entry;
+		for (entry = _memcheck_g_filter_buckets[h]; entry != NULL; entry = entry->next)
+			_MEMCHECK_FLAG_STORE(entry->track, _memcheck_filter_evaluate(entry->file, entry->line));
+	}
+	_memcheck_g_filtered = (_memcheck_g_n_filters > 0);
+	_memcheck_select_dispatch();
+}
+
+
+static int _memcheck_filter_add(const char* pattern, int include)
+{
+	_memcheck_filter_t* grown;
+	const char* colon;
+	char* copy;
+	size_t len;
+	size_t line = 0;
+
+	if (pattern == NULL)
+		return 0;
+	/* A trailing ":<digits>" selects a line */
+	len = strlen(pattern);
+	colon = strrchr(pattern, ':');
+	if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+		line = (size_t) strtoul(colon + 1, NULL, 10);
+		len = (size_t)(colon - pattern);
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	grown = (_memcheck_filter_t*) realloc(_memcheck_g_filters, (_memcheck_g_n_filters + 1) * sizeof(*grown));
+	copy = (char*) malloc(len + 1);
+	if (grown != NULL)
+		_memcheck_g_filters = grown;
+	if (grown == NULL || copy == NULL) {
+		free(copy);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return 0;
+	}
+	memcpy(copy, pattern, len);
+	copy[len] = '\0';
+	_memcheck_g_filters[_memcheck_g_n_filters].glob = copy;
+	_memcheck_g_filters[_memcheck_g_n_filters].line = line;
+	_memcheck_g_filters[_memcheck_g_n_filters].include = include;
+	_memcheck_g_n_filters += 1;
+	_memcheck_filter_refresh();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+}
+
+
+int memcheck_filter_include(const char* pattern)
+{
+	return _memcheck_filter_add(pattern, 1);
+}
+
+
+int memcheck_filter_exclude(const char* pattern)
+{
+	return _memcheck_filter_add(pattern, 0);
+}
+
+
+/* The cached entries stay (readers may be walking them) until memcheck_cleanup() */
+static void _memcheck_filter_free_patterns(void)
+{
+	while (_memcheck_g_n_filters > 0)
+		free(_memcheck_g_filters[--_memcheck_g_n_filters].glob);
+	free(_memcheck_g_filters);
+	_memcheck_g_filters = NULL;
+}
+
+
+void memcheck_filter_clear(void)
+{
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_filter_free_patterns();
+	_memcheck_filter_refresh();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+/********** END CALL-SITE FILTERS **********/
+
+
+/********** RUNTIME OPTIONS **********/
+
+/* Freed block held back by the quarantine (oldest first) */
+typedef struct _memcheck_quarantined_s {
+	struct _memcheck_quarantined_s* next;
+	void*                           ptr;
+	size_t                          size;
+	const char*                     file; /* Where it was freed */
+	size_t                          line;
+} _memcheck_quarantined_t;
+
+#define _MEMCHECK_QUARANTINE_FILL 0xdd
+
+static int                      _memcheck_g_options_loaded  = 0; /* MEMCHECK_OPTIONS is read once */
+#ifdef MEMCHECK_NO_OUTPUT
+static int                      _memcheck_g_log_calls       = 0; /* output= settings, defaulting to the macros */
+#else
+static int                      _memcheck_g_log_calls       = 1; /* output= settings, defaulting to the macros */
+#endif
+#ifdef MEMCHECK_NO_CRITICAL_OUTPUT
+static int                      _memcheck_g_log_errors      = 0;
+#else
+static int                      _memcheck_g_log_errors      = 1;
+#endif
+static size_t                   _memcheck_g_sample_rate     = 1; /* sample= (1: every call) */
+static size_t                   _memcheck_g_quarantine_cap  = 0; /* quarantine= bytes */
+static size_t                   _memcheck_g_quarantine_size = 0;
+static _memcheck_quarantined_t* _memcheck_g_quarantine      = NULL; /* Oldest */
+static _memcheck_quarantined_t* _memcheck_g_quarantine_last = NULL; /* Newest */
+static _MEMCHECK_TLS size_t     _memcheck_t_sample_skip     = 0; /* Calls this thread still leaves out */
+
+
+static int _memcheck_admit_all(const char* file, size_t line)
+{
+	(void)file; (void)line;
+	return 1;
+}
+
+
+/* Deterministic per thread: the first call, then every sample_rate-th */
+static int _memcheck_admit_sampled(const char* file, size_t line)
+{
+	(void)file; (void)line;
+	if (_memcheck_t_sample_skip > 0) {
+		_memcheck_t_sample_skip -= 1;
+		return 0;
+	}
+	_memcheck_t_sample_skip = _MEMCHECK_FLAG_LOAD(_memcheck_g_sample_rate) - 1;
+	return 1;
+}
+
+
+static int _memcheck_admit_filtered_sampled(const char* file, size_t line)
+{
+	return _memcheck_filter_allows(file, line) && _memcheck_admit_sampled(file, line);
+}
+
+
+/* Checks the pattern and gives the block back. Call with the mutex held. */
+static void _memcheck_quarantine_evict(void)
+{
+	_memcheck_quarantined_t* oldest = _memcheck_g_quarantine;
+	const unsigned char* bytes = (const unsigned char*) oldest->ptr;
+	size_t i;
+
+	for (i = 0; i < oldest->size && bytes[i] == _MEMCHECK_QUARANTINE_FILL; i++)
+		;
+	if (i < oldest->size) {
+		_memcheck_g_dispatch.warn("[FREE   ] [!!] BLOCK %p {n=%" _MEMCHECK_TOU_PRIuZ "} FREED @ %s L%" _MEMCHECK_TOU_PRIuZ " WAS WRITTEN AFTER FREE (AT OFFSET %" _MEMCHECK_TOU_PRIuZ ")\n",
+			oldest->ptr, oldest->size, oldest->file, oldest->line, i);
+	}
+	_memcheck_g_quarantine = oldest->next;
+	if (_memcheck_g_quarantine == NULL)
+		_memcheck_g_quarantine_last = NULL;
+	_memcheck_g_quarantine_size -= oldest->size;
+	free(oldest->ptr);
+	free(oldest);
+}
+
+
+/* release() while quarantine= is set: the block is filled and kept until quarantine= bytes of newer ones pushed it out */
+static void _memcheck_release_quarantine(void* ptr, size_t size, const char* file, size_t line)
+{
+	_memcheck_quarantined_t* entry;
+
+	if (ptr == NULL)
+		return;
+	entry = (size <= _memcheck_g_quarantine_cap) ? (_memcheck_quarantined_t*) malloc(sizeof(*entry)) : NULL;
+	if (entry == NULL) {
+		free(ptr);
+		return;
+	}
+	memset(ptr, _MEMCHECK_QUARANTINE_FILL, size);
+	entry->next = NULL;
+	entry->ptr = ptr;
+	entry->size = size;
+	entry->file = file;
+	entry->line = line;
+	if (_memcheck_g_quarantine_last != NULL)
+		_memcheck_g_quarantine_last->next = entry;
+	else
+		_memcheck_g_quarantine = entry;
+	_memcheck_g_quarantine_last = entry;
+	_memcheck_g_quarantine_size += size;
+	while (_memcheck_g_quarantine_size > _memcheck_g_quarantine_cap)
+		_memcheck_quarantine_evict();
+}
+
+
+/* Only on the paths of unknown pointers. Call with the mutex held. */
+static _memcheck_quarantined_t* _memcheck_quarantine_find(void* ptr)
+{
+	_memcheck_quarantined_t* entry;
+	for (entry = _memcheck_g_quarantine; entry != NULL; entry = entry->next) {
+		if (entry->ptr == ptr)
+			return entry;
+	}
+	return NULL;
+}
+
+
+static void _memcheck_quarantine_drain(void)
+{
+	while (_memcheck_g_quarantine != NULL)
+		_memcheck_quarantine_evict();
+}
+
+
+/* Picks the implementations for the current settings. Call with the mutex held. */
+static void _memcheck_options_load(void);
+
+static void _memcheck_select_dispatch(void)
+{
+	int (*admit)(const char*, size_t) = _memcheck_admit_all;
+
+	_memcheck_options_load(); /* Settings made before the first allocation must not skip MEMCHECK_OPTIONS */
+	if (_memcheck_g_filtered && _memcheck_g_sample_rate > 1)
+		admit = _memcheck_admit_filtered_sampled;
+	else if (_memcheck_g_filtered)
+		admit = _memcheck_filter_allows;
+	else if (_memcheck_g_sample_rate > 1)
+		admit = _memcheck_admit_sampled;
+	_memcheck_g_partial = (admit != _memcheck_admit_all);
+
+	_memcheck_g_dispatch.log = _memcheck_g_log_calls ? _memcheck_log_status : _memcheck_log_none;
+	_memcheck_g_dispatch.warn = _memcheck_g_log_errors ? _memcheck_log_stderr : _memcheck_log_none;
+	_memcheck_g_dispatch.release = (_memcheck_g_quarantine_cap > 0) ? _memcheck_release_quarantine : _memcheck_release_free;
+	if (_memcheck_g_quarantine_cap == 0)
+		_memcheck_quarantine_drain();
+	while (_memcheck_g_quarantine_size > _memcheck_g_quarantine_cap)
+		_memcheck_quarantine_evict();
+	_MEMCHECK_PTR_STORE(_memcheck_g_dispatch.admit, admit);
+}
+
+
+static int _memcheck_option_output(const char* value)
+{
+	if (strcmp(value, "all") == 0)
+		_memcheck_g_log_calls = _memcheck_g_log_errors = 1;
+	else if (strcmp(value, "errors") == 0)
+		_memcheck_g_log_calls = 0, _memcheck_g_log_errors = 1;
+	else if (strcmp(value, "none") == 0)
+		_memcheck_g_log_calls = _memcheck_g_log_errors = 0;
+	else
+		return 0;
+	return 1;
+}
+
+
+static int _memcheck_option_log(const char* value)
+{
+	FILE* fp;
+	if (strcmp(value, "stdout") == 0) {
+		memcheck_set_status_fp(stdout);
+	} else if (strcmp(value, "stderr") == 0) {
+		memcheck_set_status_fp(stderr);
+	} else if (strcmp(value, "none") == 0) {
+		memcheck_set_status_fp(NULL);
+	} else {
+		fp = fopen(value, "a");
+		if (fp == NULL)
+			return 0;
+		memcheck_set_status_fp(fp);
+		_memcheck_g_owns_status_fp = 1; /* Closed by memcheck_cleanup() */
+	}
+	return 1;
+}
+
+
+/* Reads an unsigned number with an optional k/M/G suffix */
+static int _memcheck_option_size(const char* value, size_t* out)
+{
+	char* end;
+	unsigned long n;
+	int shift = 0;
+
+	if (*value < '0' || *value > '9') /* strtoul() would take "-1" */
+		return 0;
+	n = strtoul(value, &end, 10);
+	switch (*end) {
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		case 'g': case 'G': shift = 30; end++; break;
+		default: break;
+	}
+	if (*end != '\0')
+		return 0;
+	/* Values that don't fit are rejected rather than wrapped (8G where long or size_t is 32-bit would turn into 0);
+	   strtoul() saturates at ULONG_MAX on overflow */
+	if (n == ~0UL || n > (~0UL >> shift) || (n << shift) > (unsigned long)(size_t)-1)
+		return 0;
+	*out = (size_t)(n << shift);
+	return 1;
+}
+
+
+static int _memcheck_option_sample(const char* value)
+{
+	size_t rate;
+	if (!_memcheck_option_size(value, &rate) || rate == 0)
+		return 0;
+	_MEMCHECK_FLAG_STORE(_memcheck_g_sample_rate, rate);
+	return 1;
+}
+
+
+static int _memcheck_option_quarantine(const char* value)
+{
+	return _memcheck_option_size(value, &_memcheck_g_quarantine_cap);
+}
+
+
+static int _memcheck_option_track(const char* value)
+{
+	if (strcmp(value, "0") != 0 && strcmp(value, "1") != 0)
+		return 0;
+	memcheck_set_tracking(value[0] == '1');
+	return 1;
+}
+
+
+static int _memcheck_option_include(const char* value)
+{
+	return _memcheck_filter_add(value, 1);
+}
+
+
+static int _memcheck_option_exclude(const char* value)
+{
+	return _memcheck_filter_add(value, 0);
+}
+
+
+static const struct {
+	const char* name;
+	int (*apply)(const char* value);
+} _memcheck_g_option_table[] = {
+	{ "output",     _memcheck_option_output },
+	{ "log",        _memcheck_option_log },
+	{ "sample",     _memcheck_option_sample },
+	{ "quarantine", _memcheck_option_quarantine },
+	{ "track",      _memcheck_option_track },
+	{ "include",    _memcheck_option_include },
+	{ "exclude",    _memcheck_option_exclude }
+};
+
+
+/* Applies every key=value; errors go to stderr whatever output= says. Call with the mutex held. Returns the number of failures */
+static size_t _memcheck_options_parse(const char* options)
+{
+	size_t n_failed = 0;
+	size_t len = strlen(options);
+	char* copy = (char*) malloc(len + 1);
+	char* token;
+	char* next;
+
+	if (copy == NULL)
+		return 1;
+	memcpy(copy, options, len + 1);
+	for (token = copy; *token != '\0'; token = next) {
+		char* value;
+		size_t i;
+		token += strspn(token, ", \t\n");
+		next = token + strcspn(token, ", \t\n");
+		if (*next != '\0')
+			*next++ = '\0';
+		if (*token == '\0')
+			continue;
+
+		value = strchr(token, '=');
+		if (value != NULL)
+			*value++ = '\0';
+		for (i = 0; i < sizeof(_memcheck_g_option_table) / sizeof(_memcheck_g_option_table[0]); i++) {
+			if (strcmp(token, _memcheck_g_option_table[i].name) == 0)
+				break;
+		}
+		if (i == sizeof(_memcheck_g_option_table) / sizeof(_memcheck_g_option_table[0])) {
+			fprintf(stderr, "[OPTIONS] [!!] UNKNOWN OPTION \"%s\"\n", token);
+			n_failed++;
+		} else if (value == NULL || !_memcheck_g_option_table[i].apply(value)) {
+			fprintf(stderr, "[OPTIONS] [!!] INVALID VALUE FOR \"%s\"\n", token);
+			n_failed++;
+		}
+	}
+	free(copy);
+	return n_failed;
+}
+
+
+/* Reads MEMCHECK_OPTIONS on first use. Call with the mutex held. */
+static void _memcheck_options_load(void)
+{
+	const char* env;
+	if (_memcheck_g_options_loaded)
+		return;
+	_memcheck_g_options_loaded = 1;
+	env = getenv("MEMCHECK_OPTIONS");
+	if (env != NULL)
+		_memcheck_options_parse(env);
+	_memcheck_select_dispatch();
+}
+
+
+static int _memcheck_admit_first(const char* file, size_t line)
+{
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 1;
+	}
+#endif
+	_memcheck_options_load();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return _MEMCHECK_ADMIT(file, line);
+}
+
+
+int memcheck_set_options(const char* options)
+{
+	size_t n_failed;
+	if (options == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	_memcheck_options_load();
+	n_failed = _memcheck_options_parse(options);
+	_memcheck_select_dispatch();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n_failed == 0;
+}
+
+/********** END RUNTIME OPTIONS **********/
+
+
+/* Trace hook of the tracked calls (see CHROME TRACE EXPORT) */
+#ifdef MEMCHECK_ENABLE_TRACE
+static void _memcheck_trace_event(const char* name, const void* ptr, size_t size, const char* file, size_t line);
+#	define _MEMCHECK_TRACE(name, ptr, size, file, line) _memcheck_trace_event(name, ptr, size, file, line)
+#else
+#	define _MEMCHECK_TRACE(name, ptr, size, file, line) ((void)0)
+#endif
+
+
+void* memcheck_malloc(size_t size, const char* file, size_t line)
+{
+	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
+	                         at the end after releasing mutex (if enabled)  */
+
+	/* Disabled tracking costs one relaxed load: no lock and no bookkeeping */
+	if (!_MEMCHECK_FLAG_LOAD(_memcheck_g_do_track_mem))
+		return malloc(size);
+
+	/* So do calls left out by call-site filters or sampling (one indirect call, see _memcheck_select_dispatch()) */
+	if (!_MEMCHECK_ADMIT(file, line))
+		return malloc(size);
+
+	/* Requested dumps are written before taking the lock for this call */
+	if (_MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested))
+		memcheck_dump_poll();
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return NULL;
+	}
+#endif
+
+	if (!memcheck_is_tracking()) {
+		new_ptr = malloc(size);		
+	} else {
+		if (!_memcheck_g_budgets_set || _memcheck_budget_check(file, line, NULL, size))
+			new_ptr = malloc(size);
+		
+		_memcheck_g_dispatch.log("[MALLOC ] %p%s {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
+			new_ptr, (new_ptr == NULL ? " <SKIPPING>" : ""), size, file, line);
+		/* Since we don't want free() to bark at NULL frees, let's not add them in in the first place */
+		if (new_ptr != NULL) {
+			_memcheck_meta_t* meta = memcheck_new_meta(file, line, size);
+			meta->usable = _MEMCHECK_USABLE_SIZE(new_ptr, size);
+			_memcheck_tou_llist_append(&_memcheck_g_memblocks, new_ptr, meta, 0,1);
+			_memcheck_account_alloc(meta, _memcheck_thread_self());
+
+			_memcheck_g_stats.n_mallocs += 1;
+			_memcheck_g_stats.n_total_allocs += 1;
+			_memcheck_g_stats.total_alloc_size += size;
+			_MEMCHECK_HH_ADD(file, line, size);
+			_MEMCHECK_TRACE("malloc", new_ptr, size, file, line);
+		}
+
+		_MEMCHECK_TIMELINE_POLL();
+		_MEMCHECK_SHM_PUBLISH();
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	_MEMCHECK_BUDGET_NOTIFY();
+	_MEMCHECK_TIMELINE_RSS();
+	return new_ptr;
+}
+
+
+void* memcheck_calloc(size_t num, size_t size, const char* file, size_t line)
+{
+	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
+	                         at the end after releasing mutex (if enabled)  */
+
+	/* Disabled tracking costs one relaxed load: no lock and no bookkeeping */
+	if (!_MEMCHECK_FLAG_LOAD(_memcheck_g_do_track_mem))
+		return calloc(num, size);
+
+	/* So do calls left out by call-site filters or sampling (one indirect call, see _memcheck_select_dispatch()) */
+	if (!_MEMCHECK_ADMIT(file, line))
+		return calloc(num, size);
+
+	/* Requested dumps are written before taking the lock for this call */
+	if (_MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested))
+		memcheck_dump_poll();
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return NULL;
+	}
+#endif
+
+	if (!memcheck_is_tracking()) {
+		new_ptr = calloc(num, size);
+	} else {
+		if (!_memcheck_g_budgets_set || _memcheck_budget_check(file, line, NULL, num * size))
+			new_ptr = calloc(num, size);
+
+		size = num * size; /*calloc size */
+
+		_memcheck_g_dispatch.log("[CALLOC ] %p%s {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
+			new_ptr, (new_ptr == NULL ? " <SKIPPING>" : ""), size, file, line);
+		if (new_ptr != NULL) {
+			_memcheck_meta_t* meta = memcheck_new_meta(file, line, size);
+			meta->usable = _MEMCHECK_USABLE_SIZE(new_ptr, size);
+			_memcheck_tou_llist_append(&_memcheck_g_memblocks, new_ptr, meta, 0,1);
+			_memcheck_account_alloc(meta, _memcheck_thread_self());
+
+			_memcheck_g_stats.n_callocs += 1;
+			_memcheck_g_stats.n_total_allocs += 1;
+			_memcheck_g_stats.total_alloc_size += size;
+			_MEMCHECK_HH_ADD(file, line, size);
+			_MEMCHECK_TRACE("calloc", new_ptr, size, file, line);
+		}
+		
+		_MEMCHECK_TIMELINE_POLL();
+		_MEMCHECK_SHM_PUBLISH();
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	_MEMCHECK_BUDGET_NOTIFY();
+	_MEMCHECK_TIMELINE_RSS();
+	return new_ptr;
+}
+
+
+void* memcheck_realloc(void* ptr, size_t new_size, const char* file, size_t line)
+{
+	void* new_ptr = NULL; /* Pointer to a new block of memory to be returned
+	                         at the end after releasing mutex (if enabled)  */
+
+	/* Disabled tracking costs one relaxed load: no lock and no bookkeeping */
+	if (!_MEMCHECK_FLAG_LOAD(_memcheck_g_do_track_mem))
+		return realloc(ptr, new_size);
+
+	/* realloc(NULL) is a malloc(); other pointers have to be looked up, since they may be tracked */
+	if (ptr == NULL && !_MEMCHECK_ADMIT(file, line))
+		return realloc(ptr, new_size);
+
+	/* Requested dumps are written before taking the lock for this call */
+	if (_MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested))
+		memcheck_dump_poll();
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return NULL;
+	}
+#endif
+
+	if (!memcheck_is_tracking()) {
+		new_ptr = realloc(ptr, new_size);
+	} else {
+		_memcheck_meta_t* meta;
+		_memcheck_tou_llist_t* elem;
+		_memcheck_tou_llist_t** list;
+
+		elem = _memcheck_find_block(ptr, &list);
+
+		if (elem == NULL && ptr != NULL) {
+			_memcheck_quarantined_t* freed = _memcheck_quarantine_find(ptr);
+			/* An untracked block resized at a filtered-out or sampled-out call stays untracked */
+			int untracked = (freed == NULL && _memcheck_g_partial && !_MEMCHECK_ADMIT(file, line));
+			if (freed != NULL) {
+				/* Still held by the quarantine, so realloc() would corrupt the heap */
+				_memcheck_g_dispatch.warn("[REALLOC] [!!] USING REALLOC ON FREED ELEMENT (%p) @ %s L%" _MEMCHECK_TOU_PRIuZ " (FREED @ %s L%" _MEMCHECK_TOU_PRIuZ "); RETURNING NULL\n",
+					ptr, file, line, freed->file, freed->line);
+			} else if (untracked) {
+				new_ptr = realloc(ptr, new_size);
+			}
+			if (freed != NULL || untracked) {
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+				_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+				return new_ptr;
+			}
+		}
+
+		/* A failing budget leaves the block as it was, like a failed realloc() */
+		if (_memcheck_g_budgets_set && new_size > 0
+		    && !_memcheck_budget_check(file, line, (elem != NULL) ? (const _memcheck_meta_t*) elem->dat2 : NULL, new_size)) {
+			_memcheck_g_dispatch.log("[REALLOC] %p --> (nil) <BUDGET> {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
+				ptr, new_size, file, line);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+			_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+			_MEMCHECK_BUDGET_NOTIFY();
+			return NULL;
+		}
+
+		if (!elem) {
+			/* With filters or sampling this is a block of a call that was left out, tracked from now on */
+			if (ptr != NULL && !_memcheck_g_partial)
+				_memcheck_g_dispatch.warn("[REALLOC] [!!] USING REALLOC ON NONEXISTENT ELEMENT (%p); RAW MALLOC/REALLOC/CALLOC USED SOMEWHERE?\n", ptr);
+			/* But patch it and continue anyways */
+			meta = memcheck_new_meta(file, line, 0);
+			elem = _memcheck_tou_llist_append(&_memcheck_g_memblocks, ptr, meta, 0,1);
+			_memcheck_account_alloc(meta, NULL); /* Only for its site and tag; the realloc below hands it to this thread */
+		} else {
+			meta = (_memcheck_meta_t*) elem->dat2;
+		}
+
+		/* Do output in two parts because using ptr after realloc is UB */
+		_memcheck_g_dispatch.log("[REALLOC] %p {n=%" _MEMCHECK_TOU_PRIuZ "}",
+			ptr, meta->size);
+
+		new_ptr = realloc(ptr, new_size);
+
+		_memcheck_g_dispatch.log(" --> %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
+			new_ptr, new_size, file, line);
+
+		_memcheck_g_stats.n_reallocs += 1;
+		/* Change in total allocs only if requested size was 0 */
+		/* -> means it's effectively just a malloc */
+		if (meta->size == 0)
+			_memcheck_g_stats.n_total_allocs += 1;
+
+		_memcheck_g_stats.total_alloc_size += new_size - meta->size;
+
+		if (meta->flags & _MEMCHECK_META_PERMANENT)
+			_memcheck_g_stats.permanent_size += new_size - meta->size;
+		if (ptr != NULL && new_ptr != NULL)
+			_memcheck_account_resize(meta, new_size, new_ptr != ptr);
+		_memcheck_account_realloc(meta, _memcheck_thread_self(), file, line, new_size,
+			(new_ptr != NULL) ? _MEMCHECK_USABLE_SIZE(new_ptr, new_size) : new_size);
+		_MEMCHECK_HH_ADD(file, line, new_size);
+		_MEMCHECK_TRACE("realloc", new_ptr, new_size, file, line);
+		elem->dat1 = new_ptr;
+		
+		_MEMCHECK_TIMELINE_POLL();
+		_MEMCHECK_SHM_PUBLISH();
+		
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	_MEMCHECK_BUDGET_NOTIFY();
+	_MEMCHECK_TIMELINE_RSS();
+	return new_ptr;
+}
+
+
+void memcheck_free(void* ptr, const char* file, size_t line)
+{
+	/* Disabled tracking costs one relaxed load: no lock and no bookkeeping */
+	if (!_MEMCHECK_FLAG_LOAD(_memcheck_g_do_track_mem)) {
+		free(ptr);
+		return;
+	}
+
+	/* Requested dumps are written before taking the lock for this call */
+	if (_MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested))
+		memcheck_dump_poll();
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	if (!memcheck_is_tracking()) {
+		free(ptr);
+	} else {
+		_memcheck_meta_t* meta;
+		_memcheck_tou_llist_t* elem;
+		_memcheck_tou_llist_t** list;
+		_memcheck_thread_t* self;
+		int cross;
+
+		self = _memcheck_thread_self();
+		elem = _memcheck_find_block(ptr, &list);
+		if (!elem) {
+			if (ptr == NULL) {
+				/* Do not bark at null pointers */
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+				_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+				return;
+			}
+			if (_memcheck_g_quarantine != NULL) {
+				_memcheck_quarantined_t* freed = _memcheck_quarantine_find(ptr);
+				if (freed != NULL) {
+					/* The block is still held, so nothing breaks by leaving it there */
+					_memcheck_g_dispatch.warn("[FREE   ] [!!] DOUBLE FREE OF %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ " (FREED @ %s L%" _MEMCHECK_TOU_PRIuZ "); IGNORED\n",
+						ptr, freed->size, file, line, freed->file, freed->line);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+					_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+					return;
+				}
+			}
+			if (_memcheck_g_partial) {
+				/* Expected with filters or sampling: the block comes from a call that was left out */
+				free(ptr);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+				_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+				return;
+			}
+
+			_memcheck_g_dispatch.warn("[FREE   ] [!!] TRYING TO USE FREE ON NONEXISTENT ELEMENT (%p); RAW MALLOC/REALLOC/CALLOC USED SOMEWHERE?\n"
+			                          "          [!!] MIGHT CAUSE SEGFAULT (CONTINUING ANYWAY...)\n", ptr);
+			/* But patch it and try to continue anyways (just pretend we had a malloc() with size 0) */
+			meta = memcheck_new_meta(file, line, 0);
+			elem = _memcheck_tou_llist_append(&_memcheck_g_memblocks, ptr, meta, 0,1); 
+			_memcheck_account_alloc(meta, self);
+			_memcheck_g_stats.n_mallocs += 1;
+			_memcheck_g_stats.n_total_allocs += 1;
+		} else {
+			meta = (_memcheck_meta_t*) elem->dat2;
+		}
+
+		cross = _memcheck_account_free(meta, self);
+		_memcheck_g_dispatch.log("[FREE   ] %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "%s\n",
+			ptr, meta->size, file, line, (cross ? " <CROSS-THREAD>" : ""));
+		_MEMCHECK_TRACE("free", ptr, meta->size, file, line);
+		_memcheck_g_dispatch.release(ptr, meta->size, file, line);
+
+		_memcheck_g_stats.n_frees += 1;
+		_memcheck_g_stats.total_free_size += meta->size;
+		if (meta->flags & _MEMCHECK_META_PERMANENT) {
+			_memcheck_g_stats.n_permanent -= 1;
+			_memcheck_g_stats.permanent_size -= meta->size;
+		}
+		
+		/*
+			NEED TO CHECK WHETHER ELEM WAS HEAD OR NOT (TO UPDATE _memcheck_g_memblocks)
+		*/
+		_memcheck_unlink_block(list, elem);
+
+		_MEMCHECK_TIMELINE_POLL();
+		_MEMCHECK_SHM_PUBLISH();
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	_MEMCHECK_TIMELINE_RSS();
+}
+
+
+/* Leak listing of memcheck_stats(), copied under the lock and printed after releasing it */
+typedef struct {
+	void*       ptr;
+	size_t      size;
+	const char* file;
+	size_t      line;
+	int         n_head;
+	char        head[20]; /* First bytes of the block, it may be freed before they are printed */
+} _memcheck_leak_block_t;
+
+typedef struct {
+	const char* file;
+	size_t      line;
+	size_t      n_blocks;
+	size_t      size;
+} _memcheck_leak_site_t;
+
+typedef struct {
+	size_t                 n_blocks; /* Non-permanent live blocks */
+	size_t                 size;
+	size_t                 n_top;
+	_memcheck_leak_block_t top[MEMCHECK_STATS_TOP_LEAKS];       /* Largest first */
+	size_t                 n_sites;  /* Sites with at least one of those blocks */
+	size_t                 n_top_sites;
+	_memcheck_leak_site_t  top_sites[MEMCHECK_STATS_TOP_LEAKS]; /* Most bytes first */
+} _memcheck_leaks_t;
+
+/*
+	Bounded top-K selection over the leak list (insertion into the short descending arrays).
+	Per-site totals are gathered in the site records' scratch counters, which are reset again
+	  while ranking the sites.
+*/
+static void _memcheck_snapshot_leaks(_memcheck_leaks_t* lk)
+{
+	_memcheck_tou_llist_t* elem;
+	size_t i, j;
+
+	memset(lk, 0, sizeof(*lk));
+	for (elem = _memcheck_tou_llist_get_oldest(_memcheck_g_memblocks); elem != NULL; elem = _memcheck_tou_llist_get_newer(elem)) {
+		_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
+		lk->n_blocks += 1;
+		lk->size += meta->size;
+		if (meta->site != NULL) {
+			lk->n_sites += (meta->site->n_leaked++ == 0);
+			meta->site->leaked_size += meta->size;
+		}
+
+		j = lk->n_top;
+		if (j == MEMCHECK_STATS_TOP_LEAKS) {
+			if (meta->size <= lk->top[j - 1].size)
+				continue;
+			j--;
+		} else {
+			lk->n_top++;
+		}
+		for (; j > 0 && lk->top[j - 1].size < meta->size; j--)
+			lk->top[j] = lk->top[j - 1];
+		lk->top[j].ptr    = elem->dat1;
+		lk->top[j].size   = meta->size;
+		lk->top[j].file   = meta->file;
+		lk->top[j].line   = meta->line;
+		lk->top[j].n_head = (meta->size < sizeof(lk->top[j].head)) ? (int)meta->size : (int)sizeof(lk->top[j].head);
+		memcpy(lk->top[j].head, elem->dat1, (size_t)lk->top[j].n_head);
+	}
+
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		_memcheck_site_t* site = _memcheck_g_sites[i];
+		size_t n = site->n_leaked, size = site->leaked_size;
+		if (n == 0)
+			continue;
+		site->n_leaked = site->leaked_size = 0;
+
+		j = lk->n_top_sites;
+		if (j == MEMCHECK_STATS_TOP_LEAKS) {
+			if (size <= lk->top_sites[j - 1].size)
+				continue;
+			j--;
+		} else {
+			lk->n_top_sites++;
+		}
+		for (; j > 0 && lk->top_sites[j - 1].size < size; j--)
+			lk->top_sites[j] = lk->top_sites[j - 1];
+		lk->top_sites[j].file     = site->stats.file;
+		lk->top_sites[j].line     = site->stats.line;
+		lk->top_sites[j].n_blocks = n;
+		lk->top_sites[j].size     = size;
+	}
+}
+
+
+int memcheck_stats(FILE* fp)
+{
+	_memcheck_stats_t stats;
+	size_t n_frees;
+	size_t free_size;
+	size_t n_threads;
+	size_t n_cross = 0;
+	_memcheck_tag_stats_t* tags = NULL;
+	size_t n_tags = 0;
+	_memcheck_leaks_t* leaks = NULL;
+	_memcheck_rss_sample_t rss;
+	_memcheck_rss_sample_t rss_first;
+	_memcheck_rss_probe_t probe;
+	int has_leaks;
+	size_t i;
+
+	/* Only copies are made under the lock, all printing happens after releasing it */
+	_memcheck_rss_probe(&probe);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (!fp)
+		fp = memcheck_get_status_fp();
+	/* The current split is printed but not kept; the ring only gets the timeline's and the explicit samples */
+	_memcheck_rss_fill(time(NULL), &probe, &rss);
+	if (_memcheck_g_rss_count > 0)
+		rss_first = _memcheck_g_rss[(_memcheck_g_rss_head + MEMCHECK_RSS_SAMPLES - _memcheck_g_rss_count) % MEMCHECK_RSS_SAMPLES];
+	else
+		rss_first = rss;
+	stats = _memcheck_g_stats;
+	n_threads = _memcheck_g_n_threads;
+	if (n_threads > 1) {
+		_memcheck_thread_t* th;
+		for (th = _memcheck_g_threads; th != NULL; th = th->next)
+			n_cross += th->stats.n_cross_frees;
+	}
+	if (_memcheck_g_n_tags > 1) {
+		tags = (_memcheck_tag_stats_t*) malloc(_memcheck_g_n_tags * sizeof(*tags));
+		if (tags != NULL) {
+			n_tags = _memcheck_g_n_tags;
+			memcpy(tags, _memcheck_g_tags, n_tags * sizeof(*tags));
+		}
+	}
+	/* The live counters include the permanent set, which is not listed */
+	has_leaks = (_memcheck_g_memblocks != NULL && _memcheck_g_stats.n_live > _memcheck_g_stats.n_permanent);
+	if (has_leaks) {
+		leaks = (_memcheck_leaks_t*) malloc(sizeof(*leaks));
+		if (leaks != NULL)
+			_memcheck_snapshot_leaks(leaks);
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	n_frees   = stats.n_frees + stats.n_permanent;
+	free_size = stats.total_free_size + stats.permanent_size;
+
+	fprintf(fp, "\n------------------------------------------\n");
+	fprintf(fp, " >      Displaying memcheck stats:      <\n");
+	fprintf(fp, "------------------------------------------\n");
+	fprintf(fp, "  - malloc()'s:             %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_mallocs);
+	fprintf(fp, "  - calloc()'s:             %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_callocs);
+	fprintf(fp, "  - realloc()'s:            %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_reallocs);
+	fprintf(fp, "     Total acquiring calls: %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_total_allocs);
+	fprintf(fp, "     Total freeing calls:   %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_frees);
+	if (stats.n_permanent > 0)
+		fprintf(fp, "     Permanent blocks:      %" _MEMCHECK_TOU_PRIuZ "\n", stats.n_permanent);
+	fprintf(fp, "------------------------------------------\n");
+	/* Permanent blocks are expected to be unfreed, so they count as if they were */
+	if (n_frees < stats.n_total_allocs) {
+		fprintf(fp, " ===> MISSING: %" _MEMCHECK_TOU_PRIdZ " free()'s \n", stats.n_total_allocs - n_frees);
+	} else if (n_frees > stats.n_total_allocs) {
+		fprintf(fp, " ===> SURPLUS: %" _MEMCHECK_TOU_PRIdZ " allocation(s) \n", n_frees - stats.n_total_allocs);
+		fprintf(fp, " ===> THIS SHOULDN'T HAPPEN, CHECK LOGS \n");
+	} else {
+		fprintf(fp, "                   OK.                  \n");
+	}
+	fprintf(fp, "------------------------------------------\n");
+	fprintf(fp, "  - Total alloc'd size:     %" _MEMCHECK_TOU_PRIuZ "\n", stats.total_alloc_size);
+	fprintf(fp, "  - Total free'd size:      %" _MEMCHECK_TOU_PRIuZ "\n", stats.total_free_size);
+	if (stats.n_permanent > 0)
+		fprintf(fp, "     Permanent size:        %" _MEMCHECK_TOU_PRIuZ "\n", stats.permanent_size);
+	fprintf(fp, "------------------------------------------\n");
+	if (free_size < stats.total_alloc_size) {
+		fprintf(fp, " ===> DIFF: %" _MEMCHECK_TOU_PRIdZ " bytes (0x%" _MEMCHECK_TOU_PRIxZ ") \n",
+			stats.total_alloc_size - free_size,
+			stats.total_alloc_size - free_size);
+	} else if (free_size > stats.total_alloc_size) {
+		fprintf(fp, " ===> FREE() SURPLUS: %" _MEMCHECK_TOU_PRIdZ " bytes (0x%" _MEMCHECK_TOU_PRIxZ ") \n",
+			free_size - stats.total_alloc_size,
+			free_size - stats.total_alloc_size);
+		fprintf(fp, " ===> THIS SHOULDN'T HAPPEN, CHECK LOGS \n");
+	} else {
+		fprintf(fp, "                   OK.                  \n");
+	}
+	fprintf(fp, "------------------------------------------\n");
+	if (n_threads > 1) {
+		fprintf(fp, "  - Threads seen:           %" _MEMCHECK_TOU_PRIuZ "\n", n_threads);
+		fprintf(fp, "  - Cross-thread frees:     %" _MEMCHECK_TOU_PRIuZ "\n", n_cross);
+		fprintf(fp, "------------------------------------------\n");
+	}
+	if (n_tags > 1) {
+		fprintf(fp, "  - Tags (live / peak bytes, allocs / frees):\n");
+		for (i = 0; i < n_tags; i++) {
+			const _memcheck_tag_stats_t* tag = &tags[i];
+			if (tag->n_allocs == 0 && tag->n_live == 0)
+				continue;
+			fprintf(fp, "     %-20s %" _MEMCHECK_TOU_PRIuZ " / %" _MEMCHECK_TOU_PRIuZ ", %" _MEMCHECK_TOU_PRIuZ " / %" _MEMCHECK_TOU_PRIuZ "\n",
+				tag->name, tag->live_size, tag->peak_size, tag->n_allocs, tag->n_frees);
+		}
+		fprintf(fp, "------------------------------------------\n");
+	}
+	if (rss.rss != 0) {
+		_memcheck_rss_print(fp, &rss);
+		if (rss_first.time != rss.time) {
+			fprintf(fp, "     Since the first sample: RSS ");
+			_memcheck_rss_delta(fp, rss_first.rss, rss.rss);
+			fprintf(fp, ", tracked ");
+			_memcheck_rss_delta(fp, rss_first.tracked, rss.tracked);
+			fprintf(fp, " (%lds)\n", (long) (rss.time - rss_first.time));
+		}
+		fprintf(fp, "------------------------------------------\n");
+	}
+	fprintf(fp, "\n");
+	fflush(fp);
+	free(tags);
+
+	/* All is good, no unfreed elements (or no memory for the listing, the counters above still tell) */
+	if (leaks == NULL)
+		return !has_leaks;
+
+	/* If unfreed allocations were detected, display the largest ones and the sites holding the most */
+	fprintf(fp, "\n-=[ UNFREED ALLOCATIONS DETECTED. ]=-\n");
+	fprintf(fp, "\n-=[ Largest remaining elements (%" _MEMCHECK_TOU_PRIuZ " of %" _MEMCHECK_TOU_PRIuZ "): ]=-\n",
+		leaks->n_top, leaks->n_blocks);
+	for (i = 0; i < leaks->n_top; i++) {
+		const _memcheck_leak_block_t* b = &leaks->top[i];
+		fprintf(fp, "  > %p {n=%" _MEMCHECK_TOU_PRIuZ " (0x%" _MEMCHECK_TOU_PRIxZ ")} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "  (first %d bytes...  |%.*s|)\n",
+			b->ptr, b->size, b->size, b->file, b->line, b->n_head, b->n_head, b->head);
+	}
+	if (leaks->n_top < leaks->n_blocks) {
+		size_t shown = 0;
+		for (i = 0; i < leaks->n_top; i++)
+			shown += leaks->top[i].size;
+		fprintf(fp, "  ... and %" _MEMCHECK_TOU_PRIuZ " smaller elements (%" _MEMCHECK_TOU_PRIuZ " bytes)\n",
+			leaks->n_blocks - leaks->n_top, leaks->size - shown);
+	}
+	if (leaks->n_sites > 1) {
+		fprintf(fp, "\n-=[ Sites holding the most (%" _MEMCHECK_TOU_PRIuZ " of %" _MEMCHECK_TOU_PRIuZ "): ]=-\n",
+			leaks->n_top_sites, leaks->n_sites);
+		for (i = 0; i < leaks->n_top_sites; i++) {
+			const _memcheck_leak_site_t* st = &leaks->top_sites[i];
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: %" _MEMCHECK_TOU_PRIuZ " elements, %" _MEMCHECK_TOU_PRIuZ " bytes\n",
+				st->file, st->line, st->n_blocks, st->size);
+		}
+	}
+	fprintf(fp, "-=[ Memcheck elements over. ]=-\n\n");
+	fflush(fp);
+	free(leaks);
+	return 0;
+}
+
+
+/* Call with the mutex held (or in a child being set up after fork()) */
+static void _memcheck_stats_reset_locked(void)
+{
+	{
+		/* The permanent set and the live counters describe blocks that still exist, so they survive the reset */
+		_memcheck_stats_t kept = _memcheck_g_stats;
+		memset(&_memcheck_g_stats, 0, sizeof(_memcheck_g_stats));
+		_memcheck_g_stats.n_permanent    = kept.n_permanent;
+		_memcheck_g_stats.permanent_size = kept.permanent_size;
+		_memcheck_g_stats.n_live         = kept.n_live;
+		_memcheck_g_stats.live_size      = kept.live_size;
+		_memcheck_g_stats.live_usable    = kept.live_usable;
+		_memcheck_g_stats.peak_size      = kept.live_size;
+	}
+	{
+		/* Live counters describe blocks that still exist, so only the event counters start over */
+		_memcheck_thread_t* th;
+		for (th = _memcheck_g_threads; th != NULL; th = th->next) {
+			th->stats.n_allocs = th->stats.n_reallocs = th->stats.n_frees = 0;
+			th->stats.n_cross_frees = th->stats.n_remote_frees = 0;
+			th->started = time(NULL);
+		}
+	}
+	{
+		size_t i;
+		for (i = 0; i < _memcheck_g_n_sites; i++) {
+			_memcheck_site_stats_t* st = &_memcheck_g_sites[i]->stats;
+			st->n_allocs = st->n_reallocs = st->n_frees = 0;
+			st->alloc_size = st->live_size;
+			st->free_size = 0;
+			st->peak_size = st->live_size;
+			memset(&_memcheck_g_sites[i]->resizes, 0, sizeof(_memcheck_g_sites[i]->resizes));
+			_memcheck_g_sites[i]->growth_sum = 0.0;
+		}
+		for (i = 0; i < _memcheck_g_n_tags; i++) {
+			_memcheck_g_tags[i].n_allocs = _memcheck_g_tags[i].n_reallocs = _memcheck_g_tags[i].n_frees = 0;
+			_memcheck_g_tags[i].peak_size = _memcheck_g_tags[i].live_size;
+		}
+	}
+#ifdef MEMCHECK_ENABLE_HEAVY_HITTERS
+	memset(_memcheck_g_hh, 0, sizeof(_memcheck_g_hh));
+#endif
+#ifdef _MEMCHECK_SHM_SUPPORTED
+	_memcheck_shm_publish(1);
+#endif
+}
+
+
+void memcheck_stats_reset(void)
+{
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	_memcheck_stats_reset_locked();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+
+/********** LEAK REACHABILITY SCAN **********/
+
+/* Worker threads need pthreads and an atomic compare-and-swap to claim blocks */
+#if defined(MEMCHECK_ENABLE_THREADSAFETY) && !defined(_WIN32) && defined(__GNUC__) && MEMCHECK_SCAN_THREADS > 1
+#	define _MEMCHECK_SCAN_PARALLEL
+#endif
+
+/* Index building must not be inlined into the frame the stack scan starts from */
+#if defined(__GNUC__)
+#	define _MEMCHECK_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#	define _MEMCHECK_NOINLINE __declspec(noinline)
+#else
+#	define _MEMCHECK_NOINLINE
+#endif
+
+/* The scan reads whole mappings word by word, redzones and poisoned stack slots included,
+   so AddressSanitizer must not instrument the functions doing the reads */
+#if defined(__SANITIZE_ADDRESS__)
+#	define _MEMCHECK_SCAN_ASAN
+#elif defined(__has_feature)
+#	if __has_feature(address_sanitizer)
+#		define _MEMCHECK_SCAN_ASAN
+#	endif
+#endif
+#if defined(_MEMCHECK_SCAN_ASAN) && defined(__GNUC__)
+#	define _MEMCHECK_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(_MEMCHECK_SCAN_ASAN) && defined(_MSC_VER)
+#	define _MEMCHECK_NO_ASAN __declspec(no_sanitize_address)
+#else
+#	define _MEMCHECK_NO_ASAN
+#endif
+
+#define _MEMCHECK_SCAN_UNSEEN     0
+#define _MEMCHECK_SCAN_REACHABLE  1
+#define _MEMCHECK_SCAN_DEFINITELY 2
+#define _MEMCHECK_SCAN_INDIRECTLY 3
+#define _MEMCHECK_SCAN_NONE       ((size_t)-1)
+
+typedef struct {
+	uintptr_t              start;
+	uintptr_t              end;   /* start + size; blocks of size 0 only match their start address */
+	_memcheck_tou_llist_t* elem;
+} _memcheck_scan_block_t;
+
+typedef struct {
+	size_t* items;
+	size_t  n;
+	size_t  cap;
+} _memcheck_scan_list_t;
+
+typedef struct {
+	_memcheck_scan_block_t*  blocks;  /* Sorted by start address */
+	size_t                   n_blocks;
+	volatile unsigned char*  state;   /* _MEMCHECK_SCAN_* per block */
+	uintptr_t                min;     /* Lowest start / highest end, for rejecting most words without a search */
+	uintptr_t                max;
+} _memcheck_scan_t;
+
+typedef struct {
+	_memcheck_scan_t*     scan;
+	const size_t*         frontier;
+	size_t                begin;
+	size_t                end;
+	_memcheck_scan_list_t next;
+} _memcheck_scan_job_t;
+
+
+static int _memcheck_scan_block_cmp(const void* a, const void* b)
+{
+	uintptr_t x = ((const _memcheck_scan_block_t*)a)->start;
+	uintptr_t y = ((const _memcheck_scan_block_t*)b)->start;
+	return (x < y) ? -1 : (x > y);
+}
+
+
+static void _memcheck_scan_list_push(_memcheck_scan_list_t* list, size_t idx)
+{
+	if (list->n == list->cap) {
+		size_t cap = (list->cap == 0) ? 256 : list->cap * 2;
+		size_t* grown = (size_t*) realloc(list->items, cap * sizeof(*grown));
+		if (grown == NULL)
+			return; /* Out of memory: the block stays unscanned, which can only make the report more pessimistic */
+		list->items = grown;
+		list->cap = cap;
+	}
+	list->items[list->n++] = idx;
+}
+
+
+/* Binary search for the block containing address `p` (interior pointers included) */
+static size_t _memcheck_scan_lookup(const _memcheck_scan_t* scan, uintptr_t p)
+{
+	size_t lo = 0;
+	size_t hi = scan->n_blocks;
+	const _memcheck_scan_block_t* b;
+
+	if (p < scan->min || p > scan->max)
+		return _MEMCHECK_SCAN_NONE;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (scan->blocks[mid].start <= p)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return _MEMCHECK_SCAN_NONE;
+	b = &scan->blocks[lo - 1];
+	return (p < b->end || p == b->start) ? lo - 1 : _MEMCHECK_SCAN_NONE;
+}
+
+
+/* Atomically moves a block from state `from` to `to`; only one scanning thread can win */
+static int _memcheck_scan_claim(_memcheck_scan_t* scan, size_t idx, unsigned char from, unsigned char to)
+{
+#ifdef _MEMCHECK_SCAN_PARALLEL
+	return __sync_bool_compare_and_swap(&scan->state[idx], from, to);
+#else
+	if (scan->state[idx] != from)
+		return 0;
+	scan->state[idx] = to;
+	return 1;
+#endif
+}
+
+
+/* Looks at every aligned pointer-sized word in [lo, hi) and queues the blocks it newly reaches */
+static _MEMCHECK_NO_ASAN void _memcheck_scan_region(_memcheck_scan_t* scan, uintptr_t lo, uintptr_t hi, unsigned char from, unsigned char to, _memcheck_scan_list_t* out)
+{
+	uintptr_t skip_lo = (uintptr_t)scan->blocks;
+	uintptr_t skip_hi = skip_lo + scan->n_blocks * sizeof(*scan->blocks);
+	uintptr_t at;
+
+	lo = (lo + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+	for (at = lo; at + sizeof(void*) <= hi; at += sizeof(void*)) {
+		size_t idx;
+		if (at >= skip_lo && at < skip_hi) /* Our own index holds every block's address */
+			continue;
+		idx = _memcheck_scan_lookup(scan, *(const uintptr_t*)at);
+		if (idx != _MEMCHECK_SCAN_NONE && _memcheck_scan_claim(scan, idx, from, to))
+			_memcheck_scan_list_push(out, idx);
+	}
+}
+
+
+static void* _memcheck_scan_job_run(void* arg)
+{
+	_memcheck_scan_job_t* job = (_memcheck_scan_job_t*) arg;
+	size_t i;
+	for (i = job->begin; i < job->end; i++) {
+		const _memcheck_scan_block_t* b = &job->scan->blocks[job->frontier[i]];
+		_memcheck_scan_region(job->scan, b->start, b->end, _MEMCHECK_SCAN_UNSEEN, _MEMCHECK_SCAN_REACHABLE, &job->next);
+	}
+	return NULL;
+}
+
+
+/* Level-by-level mark phase: every level of the frontier is split across the worker threads */
+static void _memcheck_scan_propagate(_memcheck_scan_t* scan, _memcheck_scan_list_t* frontier)
+{
+	_memcheck_scan_job_t jobs[MEMCHECK_SCAN_THREADS > 1 ? MEMCHECK_SCAN_THREADS : 1];
+	size_t n_jobs_max = sizeof(jobs) / sizeof(jobs[0]);
+
+	while (frontier->n > 0) {
+		size_t n_jobs = (frontier->n >= 4 * n_jobs_max) ? n_jobs_max : 1;
+		size_t chunk = (frontier->n + n_jobs - 1) / n_jobs;
+		size_t j;
+#ifdef _MEMCHECK_SCAN_PARALLEL
+		pthread_t threads[sizeof(jobs) / sizeof(jobs[0])];
+		int started[sizeof(jobs) / sizeof(jobs[0])];
+#endif
+
+		for (j = 0; j < n_jobs; j++) {
+			jobs[j].scan = scan;
+			jobs[j].frontier = frontier->items;
+			jobs[j].begin = j * chunk;
+			jobs[j].end = (j + 1) * chunk < frontier->n ? (j + 1) * chunk : frontier->n;
+			jobs[j].next.items = NULL;
+			jobs[j].next.n = jobs[j].next.cap = 0;
+		}
+#ifdef _MEMCHECK_SCAN_PARALLEL
+		for (j = 1; j < n_jobs; j++)
+			started[j] = (pthread_create(&threads[j], NULL, _memcheck_scan_job_run, &jobs[j]) == 0);
+		_memcheck_scan_job_run(&jobs[0]);
+		for (j = 1; j < n_jobs; j++) {
+			if (started[j])
+				pthread_join(threads[j], NULL);
+			else
+				_memcheck_scan_job_run(&jobs[j]);
+		}
+#else
+		for (j = 0; j < n_jobs; j++)
+			_memcheck_scan_job_run(&jobs[j]);
+#endif
+
+		frontier->n = 0;
+		for (j = 0; j < n_jobs; j++) {
+			size_t i;
+			for (i = 0; i < jobs[j].next.n; i++)
+				_memcheck_scan_list_push(frontier, jobs[j].next.items[i]);
+			free(jobs[j].next.items);
+		}
+	}
+}
+
+
+/* Static data (writable file mappings and the bss right after them) and the calling thread's stack from `stack_lo` up */
+static void _memcheck_scan_roots(_memcheck_scan_t* scan, uintptr_t stack_lo, _memcheck_scan_list_t* out)
+{
+#ifdef __linux__
+	FILE* maps = fopen("/proc/self/maps", "r");
+	char line[512];
+	unsigned long prev_end = 0;
+	int prev_is_file = 0;
+
+	if (maps == NULL)
+		return;
+	while (fgets(line, sizeof(line), maps) != NULL) {
+		unsigned long lo, hi;
+		char perms[8];
+		char path[256];
+		int is_file;
+
+		path[0] = '\0';
+		if (sscanf(line, "%lx-%lx %7s %*s %*s %*s %255s", &lo, &hi, perms, path) < 3)
+			continue;
+		is_file = (path[0] != '\0' && path[0] != '[');
+
+		if (stack_lo >= lo && stack_lo < hi) {
+			_memcheck_scan_region(scan, stack_lo, hi, _MEMCHECK_SCAN_UNSEEN, _MEMCHECK_SCAN_REACHABLE, out);
+		} else if (perms[0] == 'r' && perms[1] == 'w'
+		           && (is_file || (path[0] == '\0' && prev_is_file && lo == prev_end))) {
+			_memcheck_scan_region(scan, lo, hi, _MEMCHECK_SCAN_UNSEEN, _MEMCHECK_SCAN_REACHABLE, out);
+		}
+		prev_end = hi;
+		prev_is_file = is_file;
+	}
+	fclose(maps);
+#else
+	(void)scan; (void)stack_lo; (void)out;
+#endif
+}
+
+
+/* Valgrind-style grouping of unreachable blocks: a lost block that no other lost block points to is
+   definitely lost and everything reachable only through it is indirectly lost */
+static _MEMCHECK_NO_ASAN void _memcheck_scan_classify_lost(_memcheck_scan_t* scan)
+{
+	_memcheck_scan_list_t work;
+	size_t i;
+
+	work.items = NULL;
+	work.n = work.cap = 0;
+	for (i = 0; i < scan->n_blocks; i++) {
+		if (scan->state[i] != _MEMCHECK_SCAN_UNSEEN)
+			continue;
+		scan->state[i] = _MEMCHECK_SCAN_DEFINITELY;
+		_memcheck_scan_list_push(&work, i);
+		while (work.n > 0) {
+			const _memcheck_scan_block_t* b = &scan->blocks[work.items[--work.n]];
+			uintptr_t at = (b->start + sizeof(void*) - 1) & ~(uintptr_t)(sizeof(void*) - 1);
+			for (; at + sizeof(void*) <= b->end; at += sizeof(void*)) {
+				size_t idx = _memcheck_scan_lookup(scan, *(const uintptr_t*)at);
+				if (idx == _MEMCHECK_SCAN_NONE || idx == i)
+					continue;
+				if (scan->state[idx] == _MEMCHECK_SCAN_UNSEEN) {
+					scan->state[idx] = _MEMCHECK_SCAN_INDIRECTLY;
+					_memcheck_scan_list_push(&work, idx);
+				} else if (scan->state[idx] == _MEMCHECK_SCAN_DEFINITELY) {
+					scan->state[idx] = _MEMCHECK_SCAN_INDIRECTLY; /* An earlier "leader" hangs off this group */
+				}
+			}
+		}
+	}
+	free(work.items);
+}
+
+
+/* Fills the sorted block index; done in its own frame so that nothing it leaves on the stack
+   lies above the scan start chosen by memcheck_leak_check() */
+static _MEMCHECK_NOINLINE int _memcheck_scan_build(_memcheck_scan_t* scan)
+{
+	_memcheck_tou_llist_t* lists[2];
+	size_t i, l;
+
+	lists[0] = _memcheck_g_memblocks;
+	lists[1] = _memcheck_g_permanent;
+	scan->n_blocks = _memcheck_tou_llist_len(lists[0]) + _memcheck_tou_llist_len(lists[1]);
+	scan->blocks = (_memcheck_scan_block_t*) malloc((scan->n_blocks + 1) * sizeof(*scan->blocks));
+	scan->state = (volatile unsigned char*) calloc(scan->n_blocks + 1, 1);
+	if (scan->blocks == NULL || scan->state == NULL)
+		return 0;
+
+	i = 0;
+	for (l = 0; l < 2; l++) {
+		_memcheck_tou_llist_t* elem;
+		for (elem = lists[l]; elem != NULL; elem = elem->prev, i++) {
+			scan->blocks[i].start = (uintptr_t)elem->dat1;
+			scan->blocks[i].end   = (uintptr_t)elem->dat1 + ((_memcheck_meta_t*)elem->dat2)->size;
+			scan->blocks[i].elem  = elem;
+		}
+	}
+	qsort(scan->blocks, scan->n_blocks, sizeof(*scan->blocks), _memcheck_scan_block_cmp);
+
+	scan->min = (scan->n_blocks > 0) ? scan->blocks[0].start : 1;
+	scan->max = 0;
+	for (i = 0; i < scan->n_blocks; i++) {
+		if (scan->blocks[i].end > scan->max)
+			scan->max = scan->blocks[i].end;
+	}
+	return 1;
+}
+
+
+/* `regs` lives in memcheck_leak_check()'s frame: it holds the caller's registers and marks where the stack scan starts */
+static void _memcheck_scan_run(_memcheck_scan_t* scan, jmp_buf* regs)
+{
+	_memcheck_scan_list_t frontier;
+	size_t i;
+
+	frontier.items = NULL;
+	frontier.n = frontier.cap = 0;
+
+	/* Permanent blocks are intentionally alive, so they act as roots too */
+	for (i = 0; i < scan->n_blocks; i++) {
+		const _memcheck_meta_t* meta = (const _memcheck_meta_t*) scan->blocks[i].elem->dat2;
+		if ((meta->flags & _MEMCHECK_META_PERMANENT) && _memcheck_scan_claim(scan, i, _MEMCHECK_SCAN_UNSEEN, _MEMCHECK_SCAN_REACHABLE))
+			_memcheck_scan_list_push(&frontier, i);
+	}
+
+	_memcheck_scan_region(scan, (uintptr_t)regs, (uintptr_t)regs + sizeof(*regs), _MEMCHECK_SCAN_UNSEEN, _MEMCHECK_SCAN_REACHABLE, &frontier);
+	_memcheck_scan_roots(scan, (uintptr_t)regs, &frontier);
+
+	_memcheck_scan_propagate(scan, &frontier);
+	free(frontier.items);
+
+	_memcheck_scan_classify_lost(scan);
+}
+
+/********** END LEAK REACHABILITY SCAN **********/
+
+
+
+static _MEMCHECK_NOINLINE int _memcheck_leak_check(FILE* fp, _memcheck_leak_summary_t* out, jmp_buf* regs)
+{
+	_memcheck_scan_t scan;
+	_memcheck_leak_summary_t summary;
+	size_t i, l;
+
+	memset(&summary, 0, sizeof(summary));
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (!fp)
+		fp = memcheck_get_status_fp();
+
+	memset(&scan, 0, sizeof(scan));
+	if (!_memcheck_scan_build(&scan)) {
+		fprintf(stderr, "[%s] Not enough memory for the block index\n", __func__);
+		free(scan.blocks);
+		free((void*)scan.state);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return 0;
+	}
+
+	_memcheck_scan_run(&scan, regs);
+
+	for (i = 0; i < scan.n_blocks; i++) {
+		size_t size = scan.blocks[i].end - scan.blocks[i].start;
+		if (scan.state[i] == _MEMCHECK_SCAN_DEFINITELY) {
+			summary.n_definitely_lost += 1;
+			summary.definitely_lost_size += size;
+		} else if (scan.state[i] == _MEMCHECK_SCAN_INDIRECTLY) {
+			summary.n_indirectly_lost += 1;
+			summary.indirectly_lost_size += size;
+		} else {
+			summary.n_reachable += 1;
+			summary.reachable_size += size;
+		}
+	}
+
+	fprintf(fp, "\n------------------------------------------\n");
+	fprintf(fp, " >       Memcheck leak check:           <\n");
+	fprintf(fp, "------------------------------------------\n");
+	fprintf(fp, "  - Definitely lost:        %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " bytes\n", summary.n_definitely_lost, summary.definitely_lost_size);
+	fprintf(fp, "  - Indirectly lost:        %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " bytes\n", summary.n_indirectly_lost, summary.indirectly_lost_size);
+	fprintf(fp, "  - Still reachable:        %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " bytes\n", summary.n_reachable, summary.reachable_size);
+	fprintf(fp, "------------------------------------------\n");
+	for (l = _MEMCHECK_SCAN_DEFINITELY; l <= _MEMCHECK_SCAN_INDIRECTLY; l++) {
+		for (i = 0; i < scan.n_blocks; i++) {
+			const _memcheck_meta_t* meta = (const _memcheck_meta_t*) scan.blocks[i].elem->dat2;
+			if (scan.state[i] != l)
+				continue;
+			fprintf(fp, "  > %p {n=%" _MEMCHECK_TOU_PRIuZ " (0x%" _MEMCHECK_TOU_PRIxZ ")} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "  [%s]\n",
+				scan.blocks[i].elem->dat1, meta->size, meta->size, meta->file, meta->line,
+				(l == _MEMCHECK_SCAN_DEFINITELY) ? "DEFINITELY LOST" : "INDIRECTLY LOST");
+		}
+	}
+	fprintf(fp, "\n");
+	fflush(fp);
+
+	free(scan.blocks);
+	free((void*)scan.state);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	if (out != NULL)
+		*out = summary;
+	return summary.n_definitely_lost == 0 && summary.n_indirectly_lost == 0;
+}
+
+
+int memcheck_leak_check(FILE* fp, _memcheck_leak_summary_t* out)
+{
+	jmp_buf regs; /* Registers of the calling context; the stack is scanned from here upwards */
+	setjmp(regs);
+	return _memcheck_leak_check(fp, out, &regs);
+}
+
+
+/* Releases the permanent set and the thread and tag tables (the memblocks list is handled by memcheck_cleanup() itself) */
+static void _memcheck_cleanup_tables(void)
+{
+	if (_memcheck_g_permanent != NULL) {
+#if defined(MEMCHECK_PURGE_ON_CLEANUP) || defined(MEMCHECK_FREE_PERMANENT_ON_CLEANUP)
+		_memcheck_tou_llist_t* elem;
+		for (elem = _memcheck_g_permanent; elem != NULL; elem = elem->prev)
+			free(elem->dat1);
+		_memcheck_g_stats.n_frees += _memcheck_g_stats.n_permanent;
+		_memcheck_g_stats.total_free_size += _memcheck_g_stats.permanent_size;
+		_memcheck_g_stats.n_permanent = _memcheck_g_stats.permanent_size = 0;
+#endif
+		_memcheck_tou_llist_destroy(_memcheck_g_permanent);
+		_memcheck_g_permanent = NULL;
+	}
+
+	/* Whatever is still allocated is not tracked anymore */
+	_memcheck_g_stats.n_live = _memcheck_g_stats.live_size = _memcheck_g_stats.live_usable = 0;
+	memset(_memcheck_g_size_classes, 0, sizeof(_memcheck_g_size_classes));
+#ifdef MEMCHECK_ENABLE_HEAVY_HITTERS
+	memset(_memcheck_g_hh, 0, sizeof(_memcheck_g_hh));
+#endif
+#ifdef MEMCHECK_ENABLE_TIMELINE
+	_memcheck_g_tl_head = _memcheck_g_tl_count = 0;
+#endif
+	memcheck_trace_stop(); /* Tag names and thread records are about to go */
+	_memcheck_filter_free_patterns();
+	_memcheck_filter_refresh(); /* The options stay, the filters go */
+	_memcheck_quarantine_drain();
+	{
+		size_t h;
+		for (h = 0; h < MEMCHECK_FILTER_BUCKETS; h++) {
+			while (_memcheck_g_filter_buckets[h] != NULL) {
+				_memcheck_filter_site_t* next = _memcheck_g_filter_buckets[h]->next;
+				free(_memcheck_g_filter_buckets[h]);
+				_memcheck_g_filter_buckets[h] = next;
+			}
+		}
+	}
+	while (_memcheck_g_n_site_rules > 0)
+		free(_memcheck_g_site_rules[--_memcheck_g_n_site_rules].file);
+	free(_memcheck_g_site_rules);
+	free(_memcheck_g_tag_budgets);
+	_memcheck_g_site_rules = NULL;
+	_memcheck_g_tag_budgets = NULL;
+	_memcheck_g_n_tag_budgets = 0;
+	_memcheck_g_budgets_set = 0;
+#ifdef _MEMCHECK_SHM_SUPPORTED
+	_memcheck_shm_close();
+#endif
+
+	while (_memcheck_g_threads != NULL) {
+		_memcheck_thread_t* next = _memcheck_g_threads->next;
+		free(_memcheck_g_threads);
+		_memcheck_g_threads = next;
+	}
+	_memcheck_g_n_threads = 0;
+	_memcheck_g_n_thread_records = 0;
+	_memcheck_g_exited_threads = NULL;
+	_memcheck_g_threads_epoch += 1; /* Records cached in thread-locals are gone now */
+
+	if (_memcheck_g_sites != NULL) {
+		size_t i;
+		for (i = 0; i < _memcheck_g_n_sites; i++)
+			free(_memcheck_g_sites[i]);
+		free(_memcheck_g_sites);
+		_memcheck_g_sites = NULL;
+		_memcheck_g_n_sites = _memcheck_g_sites_cap = 0;
+		_memcheck_g_site_last = NULL;
+		_memcheck_g_sites_dropped = 0;
+		memset(_memcheck_g_site_buckets, 0, sizeof(_memcheck_g_site_buckets));
+	}
+
+	if (_memcheck_g_tags != NULL) {
+		size_t i;
+		for (i = 1; i < _memcheck_g_n_tags; i++)
+			free((char*)_memcheck_g_tags[i].name);
+		free(_memcheck_g_tags);
+		_memcheck_g_tags = NULL;
+		_memcheck_g_n_tags = _memcheck_g_tags_cap = 0;
+		_MEMCHECK_FLAG_STORE(_memcheck_g_tags_epoch, _memcheck_g_tags_epoch + 1);
+	}
+}
+
+
+void memcheck_cleanup(void)
+{
+#ifdef MEMCHECK_FIRE_AND_FORGET
+	// Guard against double-cleanup (when FIRE_AND_FORGET is defined but
+	//  memcheck_cleanup() was also called manually before quitting)
+	if (_memcheck_g_fnf_cleanup_done)
+		return;
+	_memcheck_g_fnf_cleanup_done = 1;
+#endif
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	if (_memcheck_g_owns_status_fp) {
+		fclose(_memcheck_g_status_fp);
+		_memcheck_g_status_fp = NULL;
+		_memcheck_g_owns_status_fp = 0;
+	}
+	
+	if (!_memcheck_g_memblocks) {
+		_memcheck_cleanup_tables();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return;
+	}
+
+#ifdef MEMCHECK_PURGE_ON_CLEANUP
+	memcheck_purge_remaining();
+#endif
+	_memcheck_tou_llist_destroy(_memcheck_g_memblocks);
+	_memcheck_g_memblocks = NULL;
+	{
+		_memcheck_block_cursor_t* c;
+		for (c = _memcheck_g_block_cursors; c != NULL; c = c->next) {
+			c->elem = NULL;
+			c->list = 2;
+		}
+	}
+	/* Last, since the purge above reads the blocks' thread records */
+	_memcheck_cleanup_tables();
+
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_g_mutex_init_successful) {
+		_memcheck_g_mutex_init_successful = 0; /* Tells the atfork handlers that the mutex is gone */
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+		_memcheck_tou_thread_mutex_destroy(&_memcheck_g_mutex);
+	}
+#endif
+}
+
+
+void memcheck_purge_remaining(void)
+{
+	_memcheck_tou_llist_t* elem;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	if (!_memcheck_g_memblocks) {
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return;
+	}
+
+	elem = _memcheck_tou_llist_get_newest(_memcheck_g_memblocks);
+#ifndef MEMCHECK_FIRE_AND_FORGET
+	_memcheck_g_dispatch.log("\n-=[! Purging remaining elements... !]=-\n");
+#endif
+
+	while (elem) {
+		_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
+		_memcheck_tou_llist_t* older;
+	
+#ifndef MEMCHECK_FIRE_AND_FORGET
+		const int nbytes_default = 20;
+		int nbytes = ((int)meta->size > nbytes_default) ? nbytes_default : (int)meta->size;
+		nbytes = (nbytes < 0) ? nbytes_default : nbytes;
+		_memcheck_g_dispatch.log("  %% Freeing %p... {n=%" _MEMCHECK_TOU_PRIuZ "} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "  (first %d bytes...  |%.*s|)\n",
+			elem->dat1, meta->size, meta->file, meta->line, nbytes, nbytes, (char*)elem->dat1);
+#endif
+		free(elem->dat1);
+		_memcheck_account_free(meta, NULL);
+		
+		_memcheck_g_stats.n_frees += 1;
+		_memcheck_g_stats.total_free_size += meta->size;
+
+		/* Don't forget to destroy storage otherwise we might get double free's */
+		older = _memcheck_tou_llist_get_older(elem);
+		_memcheck_block_cursors_skip(elem, elem->next);
+		if (_memcheck_tou_llist_is_head(elem)) {
+			_memcheck_g_memblocks = older;
+		}
+		_memcheck_tou_llist_remove(elem);
+		elem = older;
+	}
+
+#ifndef MEMCHECK_FIRE_AND_FORGET
+	_memcheck_g_dispatch.log("-=[! Purge done. !]=-\n");
+#endif
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+
+/* Resolves the filter's tag name to an id without interning it. Returns 0 if no block can carry the tag. Call with the mutex held. */
+static int _memcheck_purge_tag_id(const char* name, size_t* id)
+{
+	size_t i;
+	if (name[0] == '\0') {
+		*id = 0;
+		return 1;
+	}
+	for (i = 1; i < _memcheck_g_n_tags; i++) {
+		if (strcmp(_memcheck_g_tags[i].name, name) == 0) {
+			*id = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+size_t memcheck_purge_where(const _memcheck_purge_filter_t* filter, int output)
+{
+	typedef struct {
+		const char* file;
+		size_t line;
+		size_t n_blocks;
+		size_t size;
+	} purged_site_t;
+	_memcheck_purge_filter_t all;
+	_memcheck_tou_llist_t* elem;
+	_memcheck_tou_llist_t* kept = NULL; /* Newest survivor so far; the survivors are relinked behind it */
+	_memcheck_tou_llist_t* purged = NULL; /* Unlinked nodes, newest first, chained through `next`; freed after unlocking */
+	_memcheck_tou_llist_t* purged_tail = NULL;
+	purged_site_t* sites = NULL;
+	size_t n_sites = 0, n_purged = 0, purged_size = 0;
+	size_t tag = 0;
+	const char* last_file = NULL; /* File name comparisons are cached per __FILE__ pointer */
+	int last_file_matches = 0;
+	FILE* fp;
+	size_t i;
+
+	if (filter == NULL) {
+		memset(&all, 0, sizeof(all));
+		filter = &all;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	fp = memcheck_get_status_fp();
+	if (_memcheck_g_memblocks == NULL || (filter->tag != NULL && !_memcheck_purge_tag_id(filter->tag, &tag))) {
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return 0;
+	}
+
+	/* Purged nodes are not unlinked one at a time: only the survivors get new links, once each */
+	elem = _memcheck_tou_llist_get_newest(_memcheck_g_memblocks);
+	while (elem) {
+		_memcheck_tou_llist_t* older = elem->prev;
+		_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
+		int match = (filter->line == 0 || meta->line == filter->line)
+			&& (filter->tag == NULL || meta->tag == tag)
+			&& meta->generation > filter->since_generation
+			&& (filter->until_generation == 0 || meta->generation <= filter->until_generation);
+		if (match && filter->file != NULL) {
+			if (meta->file != last_file) {
+				last_file = meta->file;
+				last_file_matches = (strcmp(meta->file, filter->file) == 0);
+			}
+			match = last_file_matches;
+		}
+
+		if (!match) {
+			elem->next = kept;
+			if (kept != NULL)
+				kept->prev = elem;
+			else
+				_memcheck_g_memblocks = elem;
+			kept = elem;
+			elem = older;
+			continue;
+		}
+
+		if (output == MEMCHECK_PURGE_SUMMARY && meta->site != NULL) {
+			if (meta->site->n_leaked++ == 0)
+				n_sites += 1;
+			meta->site->leaked_size += meta->size;
+		}
+		/* Accounted as freed now; the block is not released before unlocking, so its address cannot be handed out again meanwhile */
+		_memcheck_account_free(meta, NULL);
+		_memcheck_g_stats.n_frees += 1;
+		_memcheck_g_stats.total_free_size += meta->size;
+		n_purged += 1;
+		purged_size += meta->size;
+		_memcheck_block_cursors_skip(elem, kept); /* The nearest newer block that stays */
+		elem->next = NULL;
+		if (purged_tail != NULL)
+			purged_tail->next = elem;
+		else
+			purged = elem;
+		purged_tail = elem;
+		elem = older;
+	}
+	if (kept != NULL)
+		kept->prev = NULL;
+	else
+		_memcheck_g_memblocks = NULL;
+
+	/* Collect (and clear) the per-site scratch counters; printing waits until the lock is released */
+	if (n_sites > 0) {
+		sites = (purged_site_t*) malloc(n_sites * sizeof(*sites));
+		n_sites = 0;
+		for (i = 0; i < _memcheck_g_n_sites; i++) {
+			_memcheck_site_t* site = _memcheck_g_sites[i];
+			if (site->n_leaked == 0)
+				continue;
+			if (sites != NULL) {
+				sites[n_sites].file = site->stats.file;
+				sites[n_sites].line = site->stats.line;
+				sites[n_sites].n_blocks = site->n_leaked;
+				sites[n_sites].size = site->leaked_size;
+				n_sites++;
+			}
+			site->n_leaked = 0;
+			site->leaked_size = 0;
+		}
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+
+	/* The unlinked nodes belong to nobody else now; their metadata is still valid until freed with them */
+	while (purged != NULL) {
+		_memcheck_tou_llist_t* next = purged->next;
+		if (output == MEMCHECK_PURGE_BLOCKS) {
+			const _memcheck_meta_t* meta = (const _memcheck_meta_t*) purged->dat2;
+			fprintf(fp, "  %% Freeing %p... {n=%" _MEMCHECK_TOU_PRIuZ "} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "\n",
+				purged->dat1, meta->size, meta->file, meta->line);
+		}
+		free(purged->dat1);
+		_memcheck_tou_llist_free_element(purged);
+		purged = next;
+	}
+
+	if (output == MEMCHECK_PURGE_SUMMARY) {
+		fprintf(fp, "\n-=[ Purged blocks by site: ]=-\n");
+		for (i = 0; i < n_sites; i++) {
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " bytes\n",
+				sites[i].file, sites[i].line, sites[i].n_blocks, sites[i].size);
+		}
+	}
+	if (output == MEMCHECK_PURGE_SUMMARY || output == MEMCHECK_PURGE_BLOCKS) {
+		fprintf(fp, "-=[ Purged %" _MEMCHECK_TOU_PRIuZ " blocks (%" _MEMCHECK_TOU_PRIuZ " bytes). ]=-\n", n_purged, purged_size);
+		fflush(fp);
+	}
+	free(sites);
+	return n_purged;
+}
+
+
+size_t memcheck_get_generation(void)
+{
+	size_t generation;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	generation = _memcheck_g_generation;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return generation;
+}
+
+
+/* Copies what the public block info shows of a tracked block. Call with the mutex held. */
+static void _memcheck_block_info(_memcheck_block_info_t* out, const _memcheck_tou_llist_t* elem)
+{
+	const _memcheck_meta_t* meta = (const _memcheck_meta_t*) elem->dat2;
+	out->ptr        = elem->dat1;
+	out->size       = meta->size;
+	out->usable     = meta->usable;
+	out->file       = meta->file;
+	out->line       = meta->line;
+	out->tag        = meta->tag;
+	out->thread     = (meta->thread != NULL) ? meta->thread->stats.id : 0;
+	out->permanent  = (meta->flags & _MEMCHECK_META_PERMANENT) ? 1 : 0;
+	out->inherited  = (meta->flags & _MEMCHECK_META_INHERITED) ? 1 : 0;
+	out->generation = meta->generation;
+}
+
+
+size_t memcheck_foreach_block_since(size_t generation, _memcheck_block_fn_t fn, void* ctx)
+{
+	_memcheck_block_info_t* blocks;
+	size_t n = 0;
+	size_t snapshot;
+	size_t i;
+	int l;
+
+	if (fn == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	/* Allocation traffic only waits for this copy; the live counter sizes it without a walk */
+	blocks = (_memcheck_block_info_t*) malloc((_memcheck_g_stats.n_live > 0 ? _memcheck_g_stats.n_live : 1) * sizeof(*blocks));
+	snapshot = _memcheck_g_generation;
+	for (l = 0; blocks != NULL && l < 2; l++) {
+		_memcheck_tou_llist_t* elem = _memcheck_tou_llist_get_oldest((l == 0) ? _memcheck_g_memblocks : _memcheck_g_permanent);
+		for (; elem != NULL && n < _memcheck_g_stats.n_live; elem = _memcheck_tou_llist_get_newer(elem)) {
+			if (((const _memcheck_meta_t*) elem->dat2)->generation <= generation)
+				continue;
+			_memcheck_block_info(&blocks[n++], elem);
+		}
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	if (blocks == NULL)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (fn(&blocks[i], ctx) != 0)
+			break;
+	}
+	free(blocks);
+	return snapshot;
+}
+
+
+size_t memcheck_foreach_block(_memcheck_block_fn_t fn, void* ctx)
+{
+	return memcheck_foreach_block_since(0, fn, ctx);
+}
+
+
+_memcheck_tou_llist_t** memcheck_get_memblocks(void)
+{
+	_memcheck_tou_llist_t** mblk;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return NULL;
+	}
+#endif
+	mblk = &_memcheck_g_memblocks;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return mblk;
+}
+
+
+int memcheck_mark_permanent(void* ptr)
+{
+	_memcheck_tou_llist_t* elem;
+	_memcheck_meta_t* meta;
+	if (ptr == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	elem = _memcheck_tou_llist_find_exact_one(_memcheck_g_memblocks, ptr);
+	if (elem == NULL) {
+		/* Already permanent counts as success */
+		int found = _memcheck_tou_llist_find_exact_one(_memcheck_g_permanent, ptr) != NULL;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+		return found;
+	}
+
+	/* Hand the meta over to a node in the permanent list; the old node must not destroy it */
+	meta = (_memcheck_meta_t*) elem->dat2;
+	meta->flags |= _MEMCHECK_META_PERMANENT;
+	meta->generation = ++_memcheck_g_generation;
+	_memcheck_tou_llist_append(&_memcheck_g_permanent, ptr, meta, 0,1);
+	elem->destroy_dat2 = 0;
+	_memcheck_unlink_block(&_memcheck_g_memblocks, elem);
+
+	_memcheck_g_stats.n_permanent += 1;
+	_memcheck_g_stats.permanent_size += meta->size;
+	_MEMCHECK_SHM_PUBLISH();
+
+	_memcheck_g_dispatch.log("[PERMANT] %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n",
+		ptr, meta->size, meta->file, meta->line);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+}
+
+
+void* memcheck_malloc_permanent(size_t size, const char* file, size_t line)
+{
+	void* ptr = memcheck_malloc(size, file, line);
+	memcheck_mark_permanent(ptr);
+	return ptr;
+}
+
+
+void* memcheck_calloc_permanent(size_t num, size_t size, const char* file, size_t line)
+{
+	void* ptr = memcheck_calloc(num, size, file, line);
+	memcheck_mark_permanent(ptr);
+	return ptr;
+}
+
+
+size_t memcheck_get_thread_id(void)
+{
+	_memcheck_thread_t* self;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	self = _memcheck_thread_self();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return (self != NULL) ? self->stats.id : 0;
+}
+
+
+size_t memcheck_get_thread_count(void)
+{
+	size_t n;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_g_n_threads;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+}
+
+
+/* Thread records are only summed up here, on demand; id 0 asks for the aggregate */
+int memcheck_get_thread_stats(size_t id, _memcheck_thread_stats_t* out)
+{
+	_memcheck_thread_t* th;
+	time_t oldest;
+	int found = 0;
+
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	memset(out, 0, sizeof(*out));
+	oldest = time(NULL);
+	for (th = _memcheck_g_threads; th != NULL; th = th->next) {
+		if (id != 0 && th->stats.id != id)
+			continue;
+		out->n_allocs       += th->stats.n_allocs;
+		out->n_reallocs     += th->stats.n_reallocs;
+		out->n_frees        += th->stats.n_frees;
+		out->n_live         += th->stats.n_live;
+		out->live_size      += th->stats.live_size;
+		out->n_cross_frees  += th->stats.n_cross_frees;
+		out->n_remote_frees += th->stats.n_remote_frees;
+		if (difftime(th->started, oldest) < 0)
+			oldest = th->started;
+		found = 1;
+	}
+	out->id = id;
+	if (found)
+		_memcheck_thread_fill_rates(out, oldest);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return found;
+}
+
+
+/* Interning is the only place where tag names are compared; allocations just carry the id. Call with the mutex held. */
+static size_t _memcheck_tag_intern(const char* name)
+{
+	size_t i;
+	size_t len;
+	char* copy;
+
+	if (_memcheck_tag_entry(0) == NULL)
+		return 0;
+
+	for (i = 1; i < _memcheck_g_n_tags; i++) {
+		if (strcmp(_memcheck_g_tags[i].name, name) == 0)
+			return i;
+	}
+
+	if (_memcheck_g_n_tags == _memcheck_g_tags_cap) {
+		_memcheck_tag_stats_t* grown = (_memcheck_tag_stats_t*) realloc(_memcheck_g_tags, 2 * _memcheck_g_tags_cap * sizeof(*grown));
+		if (grown == NULL)
+			return 0;
+		_memcheck_g_tags = grown;
+		_memcheck_g_tags_cap *= 2;
+	}
+
+	len = strlen(name);
+	copy = (char*) malloc(len + 1);
+	if (copy == NULL)
+		return 0;
+	memcpy(copy, name, len + 1);
+
+	i = _memcheck_g_n_tags++;
+	memset(&_memcheck_g_tags[i], 0, sizeof(_memcheck_g_tags[i]));
+	_memcheck_g_tags[i].id = i;
+	_memcheck_g_tags[i].name = copy;
+	return i;
+}
+
+
+size_t memcheck_intern_tag(const char* name)
+{
+	size_t id;
+
+	if (name == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	id = _memcheck_tag_intern(name);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return id;
+}
+
+
+/* The tag stack is purely thread-local, so pushing and popping by id never takes the mutex */
+void memcheck_push_tag_id(size_t id)
+{
+	if (_memcheck_t_tag_depth < MEMCHECK_TAG_STACK_DEPTH) {
+		_memcheck_t_tag_stack[_memcheck_t_tag_depth] = _memcheck_t_tag;
+		_memcheck_t_tag = id;
+	}
+	_memcheck_t_tag_depth += 1;
+}
+
+
+void memcheck_push_tag(const char* name)
+{
+	memcheck_push_tag_id(memcheck_intern_tag(name));
+}
+
+
+void memcheck_pop_tag(void)
+{
+	if (_memcheck_t_tag_depth == 0)
+		return;
+	_memcheck_t_tag_depth -= 1;
+	if (_memcheck_t_tag_depth < MEMCHECK_TAG_STACK_DEPTH)
+		_memcheck_t_tag = _memcheck_t_tag_stack[_memcheck_t_tag_depth];
+}
+
+
+/* Read on every allocation of memcheck.hpp's allocator, so it doesn't take the mutex */
+size_t memcheck_get_tag_epoch(void)
+{
+	return _MEMCHECK_FLAG_LOAD(_memcheck_g_tags_epoch);
+}
+
+
+size_t memcheck_get_tag_count(void)
+{
+	size_t n;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_g_n_tags;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+}
+
+
+int memcheck_get_tag_stats(size_t id, _memcheck_tag_stats_t* out)
+{
+	int found = 0;
+
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (id < _memcheck_g_n_tags) {
+		*out = _memcheck_g_tags[id];
+		found = 1;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return found;
+}
+
+void memcheck_get_stats(_memcheck_stats_t* out)
+{
+	if (out == NULL)
+		return;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	*out = _memcheck_g_stats;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+
+size_t memcheck_get_site_count(void)
+{
+	size_t n;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	n = _memcheck_g_n_sites;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return n;
+}
+
+
+int memcheck_get_site_stats(size_t idx, _memcheck_site_stats_t* out)
+{
+	int found = 0;
+
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (idx < _memcheck_g_n_sites) {
+		*out = _memcheck_g_sites[idx]->stats;
+		found = 1;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return found;
+}
+
+
+/* Call with the mutex held */
+static void _memcheck_realloc_stats_get(const _memcheck_site_t* site, _memcheck_realloc_stats_t* out)
+{
+	*out = site->resizes;
+	out->file = site->stats.file;
+	out->line = site->stats.line;
+	out->mean_growth = (out->n_growths > 0) ? site->growth_sum / (double)out->n_growths : 0.0;
+}
+
+
+int memcheck_get_realloc_stats(size_t idx, _memcheck_realloc_stats_t* out)
+{
+	int found = 0;
+
+	if (out == NULL)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (idx < _memcheck_g_n_sites) {
+		_memcheck_realloc_stats_get(_memcheck_g_sites[idx], out);
+		found = 1;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return found;
+}
+
+
+static int _memcheck_realloc_by_copied(const void* a, const void* b)
+{
+	size_t ca = ((const _memcheck_realloc_stats_t*)a)->bytes_copied;
+	size_t cb = ((const _memcheck_realloc_stats_t*)b)->bytes_copied;
+	return (ca < cb) - (ca > cb);
+}
+
+
+size_t memcheck_report_realloc(FILE* fp)
+{
+	_memcheck_realloc_stats_t* found = NULL;
+	size_t n_found = 0;
+	size_t i;
+
+	/* The flagged sites are copied under the lock, sorted and printed after releasing it */
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	for (i = 0; i < _memcheck_g_n_sites; i++) {
+		const _memcheck_realloc_stats_t* rs = &_memcheck_g_sites[i]->resizes;
+		if (rs->n_small_steps >= MEMCHECK_REALLOC_MIN_STEPS && 2 * rs->n_small_steps >= rs->n_resizes) {
+			if (found == NULL) {
+				found = (_memcheck_realloc_stats_t*) malloc((_memcheck_g_n_sites - i) * sizeof(*found));
+				if (found == NULL)
+					break;
+			}
+			_memcheck_realloc_stats_get(_memcheck_g_sites[i], &found[n_found++]);
+		}
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	if (n_found == 0)
+		return 0;
+
+	qsort(found, n_found, sizeof(*found), _memcheck_realloc_by_copied);
+	fprintf(fp, "\n-=[ Sites growing in small realloc() steps: ]=-\n");
+	for (i = 0; i < n_found; i++) {
+		const _memcheck_realloc_stats_t* rs = &found[i];
+		fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: %" _MEMCHECK_TOU_PRIuZ " resizes of %" _MEMCHECK_TOU_PRIuZ " blocks (longest chain %" _MEMCHECK_TOU_PRIuZ "), "
+			"%" _MEMCHECK_TOU_PRIuZ " small steps, x%.2f mean growth, %" _MEMCHECK_TOU_PRIuZ " moved / %" _MEMCHECK_TOU_PRIuZ " in place, ~%" _MEMCHECK_TOU_PRIuZ " bytes copied\n",
+			rs->file, rs->line, rs->n_resizes, rs->n_chains, rs->max_chain,
+			rs->n_small_steps, rs->mean_growth, rs->n_moved, rs->n_in_place, rs->bytes_copied);
+	}
+	fprintf(fp, "-=[ Realloc report over. ]=-\n\n");
+	fflush(fp);
+	free(found);
+	return n_found;
+}
+
+
+void memcheck_get_overhead(_memcheck_overhead_t* out)
+{
+	if (out == NULL)
+		return;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return;
+	}
+#endif
+	out->n_live      = _memcheck_g_stats.n_live;
+	out->live_size   = _memcheck_g_stats.live_size;
+	out->live_usable = _memcheck_g_stats.live_usable;
+	out->slack       = _memcheck_g_stats.live_usable - _memcheck_g_stats.live_size;
+	{
+		/* Metadata and nodes are fixed-size allocations, so any tracked block tells the rounding */
+		_memcheck_tou_llist_t* elem = (_memcheck_g_memblocks != NULL) ? _memcheck_g_memblocks : _memcheck_g_permanent;
+		if (elem != NULL)
+			out->meta_per_block = _MEMCHECK_USABLE_SIZE(elem, sizeof(*elem)) + _MEMCHECK_USABLE_SIZE(elem->dat2, sizeof(_memcheck_meta_t));
+		else
+			out->meta_per_block = sizeof(_memcheck_tou_llist_t) + sizeof(_memcheck_meta_t);
+	}
+	out->meta_size  = out->n_live * out->meta_per_block;
+	out->table_size = sizeof(_memcheck_g_site_buckets)
+	                + _memcheck_g_n_sites * sizeof(_memcheck_site_t) + _memcheck_g_sites_cap * sizeof(*_memcheck_g_sites)
+	                + _memcheck_g_tags_cap * sizeof(*_memcheck_g_tags)
+	                + _memcheck_g_n_thread_records * sizeof(_memcheck_thread_t);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+}
+
+
+int memcheck_get_size_class(size_t idx, _memcheck_size_class_t* out)
+{
+	if (out == NULL || idx >= MEMCHECK_SIZE_CLASSES)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	*out = _memcheck_g_size_classes[idx];
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	out->max_size = (idx < MEMCHECK_SIZE_CLASSES - 1) ? (size_t)1 << idx : 0;
+	return 1;
+}
+
+
+static double _memcheck_percent(size_t part, size_t whole)
+{
+	return (whole > 0) ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+
+size_t memcheck_report_slack(FILE* fp, size_t max_sites)
+{
+	_memcheck_overhead_t ov;
+	_memcheck_size_class_t cls;
+	_memcheck_site_stats_t* top = NULL;
+	size_t n_top = 0;
+	size_t n_sites = 0;
+	size_t i, j;
+
+	memcheck_get_overhead(&ov);
+
+	/* Top sites by slack, selected under the lock and printed after releasing it */
+	if (max_sites > 0)
+		top = (_memcheck_site_stats_t*) malloc(max_sites * sizeof(*top));
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		free(top);
+		return 0;
+	}
+#endif
+	if (fp == NULL)
+		fp = memcheck_get_status_fp();
+	for (i = 0; top != NULL && i < _memcheck_g_n_sites; i++) {
+		const _memcheck_site_stats_t* site = &_memcheck_g_sites[i]->stats;
+		size_t slack = site->live_usable - site->live_size;
+		if (slack == 0)
+			continue;
+		n_sites++;
+		j = n_top;
+		if (j == max_sites) {
+			if (slack <= top[j - 1].live_usable - top[j - 1].live_size)
+				continue;
+			j--;
+		} else {
+			n_top++;
+		}
+		for (; j > 0 && top[j - 1].live_usable - top[j - 1].live_size < slack; j--)
+			top[j] = top[j - 1];
+		top[j] = *site;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+
+	fprintf(fp, "\n-=[ Allocator slack of live blocks: ]=-\n");
+	fprintf(fp, "  - Blocks:                 %" _MEMCHECK_TOU_PRIuZ "\n", ov.n_live);
+	fprintf(fp, "  - Requested bytes:        %" _MEMCHECK_TOU_PRIuZ "\n", ov.live_size);
+	fprintf(fp, "  - Usable bytes:           %" _MEMCHECK_TOU_PRIuZ "\n", ov.live_usable);
+	fprintf(fp, "  - Slack:                  %" _MEMCHECK_TOU_PRIuZ " (%.1f%%)\n", ov.slack, _memcheck_percent(ov.slack, ov.live_usable));
+	fprintf(fp, "  - Memcheck metadata:      %" _MEMCHECK_TOU_PRIuZ " (%" _MEMCHECK_TOU_PRIuZ " per block) + %" _MEMCHECK_TOU_PRIuZ " in tables\n",
+		ov.meta_size, ov.meta_per_block, ov.table_size);
+	fprintf(fp, "-=[ By size class: ]=-\n");
+	for (i = 0; i < MEMCHECK_SIZE_CLASSES; i++) {
+		if (!memcheck_get_size_class(i, &cls) || cls.n_live == 0)
+			continue;
+		if (cls.max_size != 0)
+			fprintf(fp, "  > <= %-10" _MEMCHECK_TOU_PRIuZ, cls.max_size);
+		else
+			fprintf(fp, "  >  > %-10" _MEMCHECK_TOU_PRIuZ, (size_t)1 << (MEMCHECK_SIZE_CLASSES - 2));
+		fprintf(fp, " :: %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " / %" _MEMCHECK_TOU_PRIuZ " bytes requested / usable, %.1f%% slack\n",
+			cls.n_live, cls.live_size, cls.live_usable, _memcheck_percent(cls.live_usable - cls.live_size, cls.live_usable));
+	}
+	if (n_top > 0) {
+		fprintf(fp, "-=[ Sites with the most slack (%" _MEMCHECK_TOU_PRIuZ " of %" _MEMCHECK_TOU_PRIuZ "): ]=-\n", n_top, n_sites);
+		for (i = 0; i < n_top; i++) {
+			fprintf(fp, "  > %s ; L%" _MEMCHECK_TOU_PRIuZ " :: %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " slack bytes (%.1f%%)\n",
+				top[i].file, top[i].line, top[i].n_live, top[i].live_usable - top[i].live_size,
+				_memcheck_percent(top[i].live_usable - top[i].live_size, top[i].live_usable));
+		}
+	}
+	fprintf(fp, "-=[ Slack report over. ]=-\n\n");
+	fflush(fp);
+	free(top);
+	return n_top;
+}
+
+
+/********** REPORT WRITERS **********/
+
+/* Output sink for the report writers: either a FILE* or a caller buffer (snprintf()-like truncation) */
+typedef struct {
+	FILE*  fp;
+	char*  buf;
+	size_t cap;
+	size_t len;  /* Bytes produced so far, including the ones that did not fit into buf */
+} _memcheck_out_t;
+
+/* Copy of the tables a report needs: taken under the lock, formatted after releasing it */
+typedef struct {
+	_memcheck_stats_t         stats;
+	_memcheck_thread_stats_t* threads;
+	size_t                    n_threads;
+	_memcheck_tag_stats_t*    tags;
+	size_t                    n_tags;
+	_memcheck_site_stats_t*   sites;
+	size_t                    n_sites;
+	_memcheck_block_cursor_t* blocks;   /* The blocks are copied in batches while the section is written */
+} _memcheck_snap_t;
+
+/* One record (JSON object or CSV row) being written */
+typedef struct {
+	_memcheck_out_t* out;
+	int              csv;
+	int              header;   /* CSV only: write field names instead of values */
+	int              n_fields;
+} _memcheck_rec_t;
+
+
+static void _memcheck_out_write(_memcheck_out_t* out, const char* s, size_t n)
+{
+	if (out->fp != NULL) {
+		fwrite(s, 1, n, out->fp);
+	} else if (out->buf != NULL && out->len + 1 < out->cap) {
+		size_t room = out->cap - 1 - out->len;
+		memcpy(out->buf + out->len, s, (n < room) ? n : room);
+	}
+	out->len += n;
+}
+
+
+static void _memcheck_out_str(_memcheck_out_t* out, const char* s)
+{
+	_memcheck_out_write(out, s, strlen(s));
+}
+
+
+static void _memcheck_out_uz(_memcheck_out_t* out, size_t v)
+{
+	char tmp[3 * sizeof(size_t) + 1];
+	char* at = tmp + sizeof(tmp);
+	do {
+		*--at = (char)('0' + (v % 10));
+		v /= 10;
+	} while (v != 0);
+	_memcheck_out_write(out, at, (size_t)(tmp + sizeof(tmp) - at));
+}
+
+
+static void _memcheck_out_json_str(_memcheck_out_t* out, const char* s)
+{
+	_memcheck_out_write(out, "\"", 1);
+	for (; s != NULL && *s != '\0'; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			char esc[2];
+			esc[0] = '\\';
+			esc[1] = (char)c;
+			_memcheck_out_write(out, esc, 2);
+		} else if (c < 0x20) {
+			char esc[7];
+			sprintf(esc, "\\u%04x", (unsigned)c);
+			_memcheck_out_write(out, esc, 6);
+		} else {
+			_memcheck_out_write(out, s, 1);
+		}
+	}
+	_memcheck_out_write(out, "\"", 1);
+}
+
+
+static void _memcheck_out_csv_str(_memcheck_out_t* out, const char* s)
+{
+	_memcheck_out_write(out, "\"", 1);
+	for (; s != NULL && *s != '\0'; s++) {
+		_memcheck_out_write(out, s, 1);
+		if (*s == '"')
+			_memcheck_out_write(out, s, 1);
+	}
+	_memcheck_out_write(out, "\"", 1);
+}
+
+
+static int _memcheck_rec_field(_memcheck_rec_t* r, const char* name)
+{
+	if (r->n_fields++ > 0)
+		_memcheck_out_write(r->out, ",", 1);
+	if (r->csv && r->header) {
+		_memcheck_out_str(r->out, name);
+		return 0;
+	}
+	if (!r->csv) {
+		_memcheck_out_json_str(r->out, name);
+		_memcheck_out_write(r->out, ":", 1);
+	}
+	return 1;
+}
+
+
+static void _memcheck_rec_uz(_memcheck_rec_t* r, const char* name, size_t v)
+{
+	if (_memcheck_rec_field(r, name))
+		_memcheck_out_uz(r->out, v);
+}
+
+
+static void _memcheck_rec_double(_memcheck_rec_t* r, const char* name, double v)
+{
+	if (_memcheck_rec_field(r, name)) {
+		char tmp[64];
+		sprintf(tmp, "%.3f", v);
+		_memcheck_out_str(r->out, tmp);
+	}
+}
+
+
+static void _memcheck_rec_str(_memcheck_rec_t* r, const char* name, const char* v)
+{
+	if (_memcheck_rec_field(r, name)) {
+		if (r->csv)
+			_memcheck_out_csv_str(r->out, v);
+		else
+			_memcheck_out_json_str(r->out, v);
+	}
+}
+
+
+static void _memcheck_rec_ptr(_memcheck_rec_t* r, const char* name, const void* v)
+{
+	char tmp[64];
+	sprintf(tmp, "%p", v);
+	_memcheck_rec_str(r, name, tmp);
+}
+
+
+/* Starts a record; in JSON every element but the first of an array is preceded by a comma */
+static void _memcheck_rec_begin(_memcheck_rec_t* r, size_t idx)
+{
+	r->n_fields = 0;
+	if (!r->csv)
+		_memcheck_out_str(r->out, (idx > 0) ? ",\n{" : "\n{");
+}
+
+
+static void _memcheck_rec_end(_memcheck_rec_t* r)
+{
+	_memcheck_out_str(r->out, r->csv ? "\n" : "}");
+}
+
+
+/* A single record: one object in JSON, one counter per row in CSV */
+static void _memcheck_report_stats(_memcheck_rec_t* r, const _memcheck_stats_t* st)
+{
+	const char* names[13];
+	size_t values[13];
+	size_t k;
+	names[0] = "n_mallocs";        values[0] = st->n_mallocs;
+	names[1] = "n_callocs";        values[1] = st->n_callocs;
+	names[2] = "n_reallocs";       values[2] = st->n_reallocs;
+	names[3] = "n_total_allocs";   values[3] = st->n_total_allocs;
+	names[4] = "n_frees";          values[4] = st->n_frees;
+	names[5] = "total_alloc_size"; values[5] = st->total_alloc_size;
+	names[6] = "total_free_size";  values[6] = st->total_free_size;
+	names[7] = "n_permanent";      values[7] = st->n_permanent;
+	names[8] = "permanent_size";   values[8] = st->permanent_size;
+	names[9] = "n_live";           values[9] = st->n_live;
+	names[10] = "live_size";       values[10] = st->live_size;
+	names[11] = "peak_size";       values[11] = st->peak_size;
+	names[12] = "live_usable";     values[12] = st->live_usable;
+	if (r->csv) {
+		_memcheck_out_str(r->out, "counter,value\n");
+		for (k = 0; k < 13; k++) {
+			_memcheck_out_str(r->out, names[k]);
+			_memcheck_out_write(r->out, ",", 1);
+			_memcheck_out_uz(r->out, values[k]);
+			_memcheck_out_write(r->out, "\n", 1);
+		}
+	} else {
+		_memcheck_out_write(r->out, "{", 1);
+		for (k = 0; k < 13; k++)
+			_memcheck_rec_uz(r, names[k], values[k]);
+		_memcheck_out_write(r->out, "}", 1);
+	}
+}
+
+
+static void _memcheck_report_thread(_memcheck_rec_t* r, const _memcheck_thread_stats_t* st)
+{
+	_memcheck_rec_uz(r, "id", st->id);
+	_memcheck_rec_uz(r, "n_allocs", st->n_allocs);
+	_memcheck_rec_uz(r, "n_reallocs", st->n_reallocs);
+	_memcheck_rec_uz(r, "n_frees", st->n_frees);
+	_memcheck_rec_uz(r, "n_live", st->n_live);
+	_memcheck_rec_uz(r, "live_size", st->live_size);
+	_memcheck_rec_uz(r, "n_cross_frees", st->n_cross_frees);
+	_memcheck_rec_uz(r, "n_remote_frees", st->n_remote_frees);
+	_memcheck_rec_double(r, "alloc_rate", st->alloc_rate);
+	_memcheck_rec_double(r, "free_rate", st->free_rate);
+}
+
+
+static void _memcheck_report_tag(_memcheck_rec_t* r, const _memcheck_tag_stats_t* tag)
+{
+	_memcheck_rec_uz(r, "id", tag->id);
+	_memcheck_rec_str(r, "name", tag->name);
+	_memcheck_rec_uz(r, "n_allocs", tag->n_allocs);
+	_memcheck_rec_uz(r, "n_reallocs", tag->n_reallocs);
+	_memcheck_rec_uz(r, "n_frees", tag->n_frees);
+	_memcheck_rec_uz(r, "n_live", tag->n_live);
+	_memcheck_rec_uz(r, "live_size", tag->live_size);
+	_memcheck_rec_uz(r, "peak_size", tag->peak_size);
+}
+
+
+static void _memcheck_report_site(_memcheck_rec_t* r, const _memcheck_site_stats_t* site)
+{
+	_memcheck_rec_str(r, "file", site->file);
+	_memcheck_rec_uz(r, "line", site->line);
+	_memcheck_rec_uz(r, "n_allocs", site->n_allocs);
+	_memcheck_rec_uz(r, "n_reallocs", site->n_reallocs);
+	_memcheck_rec_uz(r, "n_frees", site->n_frees);
+	_memcheck_rec_uz(r, "alloc_size", site->alloc_size);
+	_memcheck_rec_uz(r, "free_size", site->free_size);
+	_memcheck_rec_uz(r, "n_live", site->n_live);
+	_memcheck_rec_uz(r, "live_size", site->live_size);
+	_memcheck_rec_uz(r, "peak_size", site->peak_size);
+	_memcheck_rec_uz(r, "live_usable", site->live_usable);
+}
+
+
+static void _memcheck_report_block(_memcheck_rec_t* r, const _memcheck_block_info_t* block)
+{
+	_memcheck_rec_ptr(r, "ptr", block->ptr);
+	_memcheck_rec_uz(r, "size", block->size);
+	_memcheck_rec_uz(r, "usable", block->usable);
+	_memcheck_rec_str(r, "file", block->file);
+	_memcheck_rec_uz(r, "line", block->line);
+	_memcheck_rec_uz(r, "tag", block->tag);
+	_memcheck_rec_uz(r, "thread", block->thread);
+	_memcheck_rec_uz(r, "permanent", (size_t) block->permanent);
+}
+
+
+/* Copies the MEMCHECK_REPORT_* `sections` into `snap`; a table that doesn't fit into memory is left empty.
+   Call with the mutex held. */
+static void _memcheck_snap_take(_memcheck_snap_t* snap, int sections)
+{
+	size_t i;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->stats = _memcheck_g_stats;
+	if ((sections & MEMCHECK_REPORT_THREADS) && _memcheck_g_n_thread_records > 0) {
+		snap->threads = (_memcheck_thread_stats_t*) malloc(_memcheck_g_n_thread_records * sizeof(*snap->threads));
+		if (snap->threads != NULL) {
+			_memcheck_thread_t* th;
+			for (th = _memcheck_g_threads; th != NULL && snap->n_threads < _memcheck_g_n_thread_records; th = th->next) {
+				snap->threads[snap->n_threads] = th->stats;
+				_memcheck_thread_fill_rates(&snap->threads[snap->n_threads++], th->started);
+			}
+		}
+	}
+	if ((sections & MEMCHECK_REPORT_TAGS) && _memcheck_g_n_tags > 0) {
+		snap->tags = (_memcheck_tag_stats_t*) malloc(_memcheck_g_n_tags * sizeof(*snap->tags));
+		if (snap->tags != NULL) {
+			snap->n_tags = _memcheck_g_n_tags;
+			memcpy(snap->tags, _memcheck_g_tags, snap->n_tags * sizeof(*snap->tags));
+		}
+	}
+	if ((sections & MEMCHECK_REPORT_SITES) && _memcheck_g_n_sites > 0) {
+		snap->sites = (_memcheck_site_stats_t*) malloc(_memcheck_g_n_sites * sizeof(*snap->sites));
+		if (snap->sites != NULL) {
+			snap->n_sites = _memcheck_g_n_sites;
+			for (i = 0; i < snap->n_sites; i++)
+				snap->sites[i] = _memcheck_g_sites[i]->stats;
+		}
+	}
+	if ((sections & MEMCHECK_REPORT_BLOCKS) && _memcheck_g_stats.n_live > 0) {
+		/* Only the starting point is taken here, so the extra memory doesn't grow with the number of blocks */
+		snap->blocks = (_memcheck_block_cursor_t*) malloc(sizeof(*snap->blocks));
+		if (snap->blocks != NULL) {
+			snap->blocks->elem = _memcheck_tou_llist_get_oldest(_memcheck_g_memblocks);
+			snap->blocks->list = 0;
+			snap->blocks->generation = _memcheck_g_generation;
+			snap->blocks->n_batch = 0;
+			snap->blocks->linked = 1;
+			snap->blocks->next = _memcheck_g_block_cursors;
+			_memcheck_g_block_cursors = snap->blocks;
+		}
+	}
+}
+
+
+/* Copies the next MEMCHECK_REPORT_BATCH blocks (oldest first, live ones before permanent ones) and
+   lets go of the cursor once both lists are done. Returns the number copied; 0 at the end. */
+static size_t _memcheck_block_cursor_next(_memcheck_block_cursor_t* c)
+{
+	c->n_batch = 0;
+	if (!c->linked)
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	while (c->list < 2 && c->n_batch < MEMCHECK_REPORT_BATCH) {
+		if (c->elem == NULL) {
+			c->list += 1;
+			if (c->list == 1)
+				c->elem = _memcheck_tou_llist_get_oldest(_memcheck_g_permanent);
+			continue;
+		}
+		if (((const _memcheck_meta_t*) c->elem->dat2)->generation <= c->generation)
+			_memcheck_block_info(&c->batch[c->n_batch++], c->elem);
+		c->elem = _memcheck_tou_llist_get_newer(c->elem);
+	}
+	if (c->list == 2) {
+		_memcheck_block_cursor_t** link;
+		for (link = &_memcheck_g_block_cursors; *link != NULL; link = &(*link)->next) {
+			if (*link == c) {
+				*link = c->next;
+				break;
+			}
+		}
+		c->linked = 0;
+	}
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return c->n_batch;
+}
+
+
+/* Call once the sections have been written: a blocks cursor lets go of itself at the end of the lists */
+static void _memcheck_snap_free(_memcheck_snap_t* snap)
+{
+	free(snap->threads);
+	free(snap->tags);
+	free(snap->sites);
+	if (snap->blocks != NULL && !snap->blocks->linked)
+		free(snap->blocks);
+}
+
+
+/* Writes one section as a JSON array body or as CSV rows (with a header row) */
+static void _memcheck_report_section(_memcheck_out_t* out, const _memcheck_snap_t* snap, int csv, int section)
+{
+	_memcheck_rec_t r;
+	size_t i;
+
+	r.out = out;
+	r.csv = csv;
+	r.header = csv;
+	r.n_fields = 0;
+
+	if (section == MEMCHECK_REPORT_STATS) {
+		_memcheck_report_stats(&r, &snap->stats);
+		return;
+	}
+
+	if (section == MEMCHECK_REPORT_THREADS) {
+		if (csv) {
+			_memcheck_thread_stats_t dummy;
+			memset(&dummy, 0, sizeof(dummy));
+			_memcheck_report_thread(&r, &dummy);
+			_memcheck_rec_end(&r);
+			r.header = 0;
+		}
+		for (i = 0; i < snap->n_threads; i++) {
+			_memcheck_rec_begin(&r, i);
+			_memcheck_report_thread(&r, &snap->threads[i]);
+			_memcheck_rec_end(&r);
+		}
+	} else if (section == MEMCHECK_REPORT_TAGS) {
+		if (csv) {
+			_memcheck_tag_stats_t dummy;
+			memset(&dummy, 0, sizeof(dummy));
+			_memcheck_report_tag(&r, &dummy);
+			_memcheck_rec_end(&r);
+			r.header = 0;
+		}
+		for (i = 0; i < snap->n_tags; i++) {
+			_memcheck_rec_begin(&r, i);
+			_memcheck_report_tag(&r, &snap->tags[i]);
+			_memcheck_rec_end(&r);
+		}
+	} else if (section == MEMCHECK_REPORT_SITES) {
+		if (csv) {
+			_memcheck_site_stats_t dummy;
+			memset(&dummy, 0, sizeof(dummy));
+			_memcheck_report_site(&r, &dummy);
+			_memcheck_rec_end(&r);
+			r.header = 0;
+		}
+		for (i = 0; i < snap->n_sites; i++) {
+			_memcheck_rec_begin(&r, i);
+			_memcheck_report_site(&r, &snap->sites[i]);
+			_memcheck_rec_end(&r);
+		}
+	} else if (section == MEMCHECK_REPORT_BLOCKS) {
+		if (csv) {
+			_memcheck_block_info_t dummy;
+			memset(&dummy, 0, sizeof(dummy));
+			_memcheck_report_block(&r, &dummy);
+			_memcheck_rec_end(&r);
+			r.header = 0;
+		}
+		size_t n_written = 0;
+		while (snap->blocks != NULL && _memcheck_block_cursor_next(snap->blocks) > 0) {
+			for (i = 0; i < snap->blocks->n_batch; i++) {
+				_memcheck_rec_begin(&r, n_written++);
+				_memcheck_report_block(&r, &snap->blocks->batch[i]);
+				_memcheck_rec_end(&r);
+			}
+		}
+	}
+}
+
+
+/* Frames of a site are the components of its path followed by "file:line", e.g. "src;net;conn.c:42" */
+static void _memcheck_folded_frames(_memcheck_out_t* out, const char* file, size_t line)
+{
+	const char* start = (file != NULL) ? file : "";
+	const char* s;
+	int n_frames = 0;
+
+	for (s = start; ; s++) {
+		if (*s == '/' || *s == '\\' || *s == '\0') {
+			const char* c;
+			/* Skip empty and "." components */
+			if (s > start && !(s - start == 1 && *start == '.')) {
+				if (n_frames++ > 0)
+					_memcheck_out_write(out, ";", 1);
+				for (c = start; c < s; c++)
+					_memcheck_out_write(out, (*c == ';') ? "_" : c, 1);
+			}
+			if (*s == '\0')
+				break;
+			start = s + 1;
+		}
+	}
+	_memcheck_out_write(out, ":", 1);
+	_memcheck_out_uz(out, line);
+}
+
+
+/* The site table already aggregates per call site, so the output has one line per site, not per allocation */
+static void _memcheck_report_folded(_memcheck_out_t* out, const _memcheck_snap_t* snap, int weight)
+{
+	size_t i;
+	for (i = 0; i < snap->n_sites; i++) {
+		const _memcheck_site_stats_t* site = &snap->sites[i];
+		size_t value;
+		if (weight == MEMCHECK_FOLDED_ALLOC_BYTES)
+			value = site->alloc_size;
+		else if (weight == MEMCHECK_FOLDED_ALLOC_COUNT)
+			value = site->n_allocs;
+		else
+			value = site->live_size;
+		if (value == 0)
+			continue;
+		_memcheck_folded_frames(out, site->file, site->line);
+		_memcheck_out_write(out, " ", 1);
+		_memcheck_out_uz(out, value);
+		_memcheck_out_write(out, "\n", 1);
+	}
+}
+
+
+#define _MEMCHECK_FORMAT_JSON   0
+#define _MEMCHECK_FORMAT_CSV    1
+#define _MEMCHECK_FORMAT_FOLDED 2
+
+/* The tables are copied under the lock and formatted after releasing it, so a slow sink (a pipe, a
+   network file system) doesn't hold up allocating threads. `sections` is the MEMCHECK_REPORT_* mask
+   for JSON/CSV and the MEMCHECK_FOLDED_* weight for folded stacks */
+static size_t _memcheck_report(FILE* fp, char* buf, size_t cap, int format, int sections)
+{
+	static const char* const names[5] = { "stats", "threads", "tags", "sites", "blocks" };
+	_memcheck_snap_t snap;
+	_memcheck_out_t out;
+	int snap_sections;
+	int n_written = 0;
+	int k;
+
+	if (format == _MEMCHECK_FORMAT_FOLDED) {
+		snap_sections = MEMCHECK_REPORT_SITES;
+	} else if (format == _MEMCHECK_FORMAT_CSV) {
+		/* Exactly one section per CSV document */
+		for (k = 0; k < 5 && !(sections & (1 << k)); k++)
+			;
+		snap_sections = (k < 5) ? 1 << k : 0;
+	} else {
+		snap_sections = sections;
+	}
+
+	out.fp = fp;
+	out.buf = buf;
+	out.cap = cap;
+	out.len = 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
+	}
+#endif
+	if (fp == NULL && buf == NULL)
+		out.fp = fp = memcheck_get_status_fp();
+	_memcheck_snap_take(&snap, snap_sections);
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+
+	if (format == _MEMCHECK_FORMAT_FOLDED) {
+		_memcheck_report_folded(&out, &snap, sections);
+	} else if (format == _MEMCHECK_FORMAT_CSV) {
+		if (snap_sections != 0)
+			_memcheck_report_section(&out, &snap, 1, snap_sections);
+	} else {
+		_memcheck_out_str(&out, "{");
+		for (k = 0; k < 5; k++) {
+			if (!(sections & (1 << k)))
+				continue;
+			_memcheck_out_str(&out, (n_written++ > 0) ? ",\n\"" : "\n\"");
+			_memcheck_out_str(&out, names[k]);
+			_memcheck_out_str(&out, ((1 << k) == MEMCHECK_REPORT_STATS) ? "\": " : "\": [");
+			_memcheck_report_section(&out, &snap, 0, 1 << k);
+			if ((1 << k) != MEMCHECK_REPORT_STATS)
+				_memcheck_out_str(&out, "\n]");
+		}
+		_memcheck_out_str(&out, "\n}\n");
+	}
+
+	if (fp != NULL)
+		fflush(fp);
+	else if (buf != NULL && cap > 0)
+		buf[(out.len < cap) ? out.len : cap - 1] = '\0';
+	_memcheck_snap_free(&snap);
+	return out.len;
+}
+
+
+size_t memcheck_report_json(FILE* fp, int sections)
+{
+	return _memcheck_report(fp, NULL, 0, _MEMCHECK_FORMAT_JSON, sections);
+}
+
+
+size_t memcheck_report_json_buf(char* buf, size_t cap, int sections)
+{
+	return _memcheck_report(NULL, buf, cap, _MEMCHECK_FORMAT_JSON, sections);
+}
+
+
+size_t memcheck_report_csv(FILE* fp, int section)
+{
+	return _memcheck_report(fp, NULL, 0, _MEMCHECK_FORMAT_CSV, section);
+}
+
+
+size_t memcheck_report_csv_buf(char* buf, size_t cap, int section)
+{
+	return _memcheck_report(NULL, buf, cap, _MEMCHECK_FORMAT_CSV, section);
+}
+
+
+size_t memcheck_report_folded(FILE* fp, int weight)
+{
+	return _memcheck_report(fp, NULL, 0, _MEMCHECK_FORMAT_FOLDED, weight);
+}
+
+
+size_t memcheck_report_folded_buf(char* buf, size_t cap, int weight)
+{
+	return _memcheck_report(NULL, buf, cap, _MEMCHECK_FORMAT_FOLDED, weight);
+}
+
+
+/*
+	pprof heap profile (profile.proto, see github.com/google/pprof/blob/main/proto/profile.proto).
+	Written uncompressed, which pprof accepts as well as the usual gzip'd form. There are no captured
+	call stacks, so every call site becomes a sample with a single frame named "file:line".
+	The string table is laid out as _MEMCHECK_PPROF_STR_* followed by a (file, "file:line") pair per site.
+*/
+#define _MEMCHECK_PPROF_STR_ALLOC_OBJECTS 1
+#define _MEMCHECK_PPROF_STR_COUNT         2
+#define _MEMCHECK_PPROF_STR_ALLOC_SPACE   3
+#define _MEMCHECK_PPROF_STR_BYTES         4
+#define _MEMCHECK_PPROF_STR_INUSE_OBJECTS 5
+#define _MEMCHECK_PPROF_STR_INUSE_SPACE   6
+#define _MEMCHECK_PPROF_STR_SPACE         7
+#define _MEMCHECK_PPROF_STR_SITES         8
+
+static size_t _memcheck_pb_varint_size(size_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+
+static void _memcheck_pb_varint(_memcheck_out_t* out, size_t v)
+{
+	unsigned char tmp[3 * sizeof(size_t)];
+	size_t n = 0;
+	while (v >= 0x80) {
+		tmp[n++] = (unsigned char)((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	tmp[n++] = (unsigned char)v;
+	_memcheck_out_write(out, (const char*)tmp, n);
+}
+
+
+/* Size of a varint field (all field numbers used here fit into a one byte key) */
+static size_t _memcheck_pb_uz_size(size_t v)
+{
+	return 1 + _memcheck_pb_varint_size(v);
+}
+
+
+static void _memcheck_pb_uz(_memcheck_out_t* out, int field, size_t v)
+{
+	_memcheck_pb_varint(out, (size_t)(field << 3));
+	_memcheck_pb_varint(out, v);
+}
+
+
+/* Starts a length-delimited field; its `len` bytes of payload have to follow */
+static void _memcheck_pb_len(_memcheck_out_t* out, int field, size_t len)
+{
+	_memcheck_pb_varint(out, (size_t)((field << 3) | 2));
+	_memcheck_pb_varint(out, len);
+}
+
+
+static size_t _memcheck_pb_len_size(size_t len)
+{
+	return 1 + _memcheck_pb_varint_size(len) + len;
+}
+
+
+static void _memcheck_pprof_str(_memcheck_out_t* out, const char* s)
+{
+	size_t n = strlen(s);
+	_memcheck_pb_len(out, 6, n);
+	_memcheck_out_write(out, s, n);
+}
+
+
+static void _memcheck_pprof_value_type(_memcheck_out_t* out, int field, size_t type, size_t unit)
+{
+	_memcheck_pb_len(out, field, _memcheck_pb_uz_size(type) + _memcheck_pb_uz_size(unit));
+	_memcheck_pb_uz(out, 1, type);
+	_memcheck_pb_uz(out, 2, unit);
+}
+
+
+static void _memcheck_pprof_site(_memcheck_out_t* out, size_t idx, const _memcheck_site_stats_t* site)
+{
+	size_t id = idx + 1; /* Location and function ids must be non-zero */
+	size_t name = _MEMCHECK_PPROF_STR_SITES + 2 * idx;
+	size_t values[4];
+	size_t values_len = 0;
+	size_t line_len, k;
+
+	/* Sample: location_id (packed), value (packed), in sample_type order */
+	values[0] = site->n_allocs;
+	values[1] = site->alloc_size;
+	values[2] = site->n_live;
+	values[3] = site->live_size;
+	for (k = 0; k < 4; k++)
+		values_len += _memcheck_pb_varint_size(values[k]);
+	_memcheck_pb_len(out, 2, _memcheck_pb_len_size(_memcheck_pb_varint_size(id)) + _memcheck_pb_len_size(values_len));
+	_memcheck_pb_len(out, 1, _memcheck_pb_varint_size(id));
+	_memcheck_pb_varint(out, id);
+	_memcheck_pb_len(out, 2, values_len);
+	for (k = 0; k < 4; k++)
+		_memcheck_pb_varint(out, values[k]);
+
+	/* Location: id, line { function_id, line } */
+	line_len = _memcheck_pb_uz_size(id) + _memcheck_pb_uz_size(site->line);
+	_memcheck_pb_len(out, 4, _memcheck_pb_uz_size(id) + _memcheck_pb_len_size(line_len));
+	_memcheck_pb_uz(out, 1, id);
+	_memcheck_pb_len(out, 4, line_len);
+	_memcheck_pb_uz(out, 1, id);
+	_memcheck_pb_uz(out, 2, site->line);
+
+	/* Function: id, name, system_name, filename, start_line */
+	_memcheck_pb_len(out, 5, _memcheck_pb_uz_size(id) + 2 * _memcheck_pb_uz_size(name + 1)
+	                         + _memcheck_pb_uz_size(name) + _memcheck_pb_uz_size(site->line));
+	_memcheck_pb_uz(out, 1, id);
+	_memcheck_pb_uz(out, 2, name + 1);
+	_memcheck_pb_uz(out, 3, name + 1);
+	_memcheck_pb_uz(out, 4, name);
+	_memcheck_pb_uz(out, 5, site->line);
+}
+
+
+size_t memcheck_report_pprof(FILE* fp)
+{
+	static const char* const strs[_MEMCHECK_PPROF_STR_SITES] = {
+		"", "alloc_objects", "count", "alloc_space", "bytes", "inuse_objects", "inuse_space", "space"
+	};
+	_memcheck_snap_t snap;
+	_memcheck_out_t out;
+	size_t i;
+
+	out.buf = NULL;
+	out.cap = 0;
+	out.len = 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
 	}
+#endif
+	out.fp = (fp != NULL) ? fp : memcheck_get_status_fp();
+	_memcheck_snap_take(&snap, MEMCHECK_REPORT_SITES);
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
 #endif
-	return new_ptr;
+
+	_memcheck_pprof_value_type(&out, 1, _MEMCHECK_PPROF_STR_ALLOC_OBJECTS, _MEMCHECK_PPROF_STR_COUNT);
+	_memcheck_pprof_value_type(&out, 1, _MEMCHECK_PPROF_STR_ALLOC_SPACE, _MEMCHECK_PPROF_STR_BYTES);
+	_memcheck_pprof_value_type(&out, 1, _MEMCHECK_PPROF_STR_INUSE_OBJECTS, _MEMCHECK_PPROF_STR_COUNT);
+	_memcheck_pprof_value_type(&out, 1, _MEMCHECK_PPROF_STR_INUSE_SPACE, _MEMCHECK_PPROF_STR_BYTES);
+	for (i = 0; i < snap.n_sites; i++)
+		_memcheck_pprof_site(&out, i, &snap.sites[i]);
+
+	for (i = 0; i < _MEMCHECK_PPROF_STR_SITES; i++)
+		_memcheck_pprof_str(&out, strs[i]);
+	for (i = 0; i < snap.n_sites; i++) {
+		const _memcheck_site_stats_t* site = &snap.sites[i];
+		const char* file = (site->file != NULL) ? site->file : "";
+		size_t file_len = strlen(file);
+		size_t line_len = 1;
+		size_t v;
+		for (v = site->line; v >= 10; v /= 10)
+			line_len++;
+		_memcheck_pprof_str(&out, file);
+		_memcheck_pb_len(&out, 6, file_len + 1 + line_len);
+		_memcheck_out_write(&out, file, file_len);
+		_memcheck_out_write(&out, ":", 1);
+		_memcheck_out_uz(&out, site->line);
+	}
+
+	_memcheck_pprof_value_type(&out, 11, _MEMCHECK_PPROF_STR_SPACE, _MEMCHECK_PPROF_STR_BYTES);
+	_memcheck_pb_uz(&out, 12, 1);  /* period: every allocation is recorded */
+	_memcheck_pb_uz(&out, 14, _MEMCHECK_PPROF_STR_INUSE_SPACE);
+
+	fflush(out.fp);
+	_memcheck_snap_free(&snap);
+	return out.len;
 }
 
 
-void memcheck_free(void* ptr, const char* file, size_t line)
+/*
+	Dumps of running processes. The lock is only held while the counters are copied;
+	formatting and writing the copy happens after it has been released.
+*/
+size_t memcheck_dump(FILE* fp)
+{
+	return _memcheck_report(fp, NULL, 0, _MEMCHECK_FORMAT_JSON, MEMCHECK_REPORT_STATS | MEMCHECK_REPORT_SITES);
+}
+
+
+/* Only touches a sig_atomic_t, everything else is left to memcheck_dump_poll() */
+static void _memcheck_dump_signal_handler(int signo)
+{
+	_MEMCHECK_FLAG_STORE(_memcheck_g_dump_requested, 1);
+	signal(signo, _memcheck_dump_signal_handler); /* Re-arm where signal() resets the handler */
+}
+
+
+int memcheck_set_dump_signal(int signo, FILE* fp)
 {
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
 		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return;
+		return 0;
 	}
 #endif
-	if (!memcheck_is_tracking()) {
-		free(ptr);
-	} else {
-		_memcheck_meta_t* meta;
-		_memcheck_tou_llist_t* elem;
-		memcheck_set_tracking(0);
-
-		elem = _memcheck_tou_llist_find_exact_one(_memcheck_g_memblocks, ptr);
-		if (!elem) {
-			if (ptr == NULL) {
-				/* Do not bark at null pointers */
-				memcheck_set_tracking(1);
+	_memcheck_g_dump_fp = fp;
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
-				_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
-#endif
-				return;
-			}
-
-#ifndef MEMCHECK_NO_CRITICAL_OUTPUT
-			fprintf(stderr/*memcheck_get_status_fp()*/, "[FREE   ] [!!] TRYING TO USE FREE ON NONEXISTENT ELEMENT (%p); RAW MALLOC/REALLOC/CALLOC USED SOMEWHERE?\n"
-			                                            "          [!!] MIGHT CAUSE SEGFAULT (CONTINUING ANYWAY...)\n", ptr);
-			fflush(stderr/*memcheck_get_status_fp()*/);
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
 #endif
-			/* But patch it and try to continue anyways (just pretend we had a malloc() with size 0) */
-			meta = memcheck_new_meta(file, line, 0);
-			elem = _memcheck_tou_llist_append(&_memcheck_g_memblocks, ptr, meta, 0,1); 
-			_memcheck_g_stats.n_mallocs += 1;
-			_memcheck_g_stats.n_total_allocs += 1;
-		} else {
-			meta = (_memcheck_meta_t*) elem->dat2;
-		}
+	return signal(signo, _memcheck_dump_signal_handler) != SIG_ERR;
+}
 
-#ifndef MEMCHECK_NO_OUTPUT
-		fprintf(memcheck_get_status_fp(), "[FREE   ] %p {n=%" _MEMCHECK_TOU_PRIuZ "} @ %s L%" _MEMCHECK_TOU_PRIuZ "\n", ptr, meta->size, file, line);
-		fflush(memcheck_get_status_fp());
-#endif
-		free(ptr);
 
-		_memcheck_g_stats.n_frees += 1;
-		_memcheck_g_stats.total_free_size += meta->size;
-		
-		/*
-			NEED TO CHECK WHETHER ELEM WAS HEAD OR NOT (TO UPDATE _memcheck_g_memblocks)
-		*/
-		if (_memcheck_tou_llist_is_head(elem)) {
-			_memcheck_g_memblocks = _memcheck_tou_llist_remove(elem);
-		} else {
-			_memcheck_tou_llist_remove(elem);
-		}
+int memcheck_dump_poll(void)
+{
+	int requested;
+	FILE* fp;
 
-		memcheck_set_tracking(1);
+	if (!_MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested))
+		return 0;
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
+		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		return 0;
 	}
+#endif
+	/* Re-checked under the lock so that only one thread writes each requested dump */
+	requested = _MEMCHECK_FLAG_LOAD(_memcheck_g_dump_requested);
+	_MEMCHECK_FLAG_STORE(_memcheck_g_dump_requested, 0);
+	fp = _memcheck_g_dump_fp;
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
 #endif
+	if (requested)
+		memcheck_dump(fp);
+	return requested;
 }
 
 
-int memcheck_stats(FILE* fp)
+size_t memcheck_compare_baseline(FILE* baseline, FILE* fp, const _memcheck_compare_opts_t* opts)
 {
+	_memcheck_site_stats_t* base;
+	_memcheck_snap_t snap;
+	size_t n_base, n_regressions;
+
+	n_base = memcheck_load_sites(baseline, &base);
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
 		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
+		memcheck_free_sites(base, n_base);
 		return 0;
 	}
 #endif
-	if (!fp)
+	/* Copied like the reports do, so the comparison runs without the lock */
+	_memcheck_snap_take(&snap, MEMCHECK_REPORT_SITES);
+	if (fp == NULL)
 		fp = memcheck_get_status_fp();
+#ifdef MEMCHECK_ENABLE_THREADSAFETY
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
 
-	fprintf(fp, "\n------------------------------------------\n");
-	fprintf(fp, " >      Displaying memcheck stats:      <\n");
-	fprintf(fp, "------------------------------------------\n");
-	fprintf(fp, "  - malloc()'s:             %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.n_mallocs);
-	fprintf(fp, "  - calloc()'s:             %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.n_callocs);
-	fprintf(fp, "  - realloc()'s:            %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.n_reallocs);
-	fprintf(fp, "     Total acquiring calls: %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.n_total_allocs);
-	fprintf(fp, "     Total freeing calls:   %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.n_frees);
-	fprintf(fp, "------------------------------------------\n");
-	if (_memcheck_g_stats.n_frees < _memcheck_g_stats.n_total_allocs) {
-		fprintf(fp, " ===> MISSING: %" _MEMCHECK_TOU_PRIdZ " free()'s \n", _memcheck_g_stats.n_total_allocs - _memcheck_g_stats.n_frees);
-	} else if (_memcheck_g_stats.n_frees > _memcheck_g_stats.n_total_allocs) {
-		fprintf(fp, " ===> SURPLUS: %" _MEMCHECK_TOU_PRIdZ " allocation(s) \n", _memcheck_g_stats.n_frees - _memcheck_g_stats.n_total_allocs);
-		fprintf(fp, " ===> THIS SHOULDN'T HAPPEN, CHECK LOGS \n");
-	} else {
-		fprintf(fp, "                   OK.                  \n");
-	}
-	fprintf(fp, "------------------------------------------\n");
-	fprintf(fp, "  - Total alloc'd size:     %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.total_alloc_size);
-	fprintf(fp, "  - Total free'd size:      %" _MEMCHECK_TOU_PRIuZ "\n", _memcheck_g_stats.total_free_size);
-	fprintf(fp, "------------------------------------------\n");
-	if (_memcheck_g_stats.total_free_size < _memcheck_g_stats.total_alloc_size) {
-		fprintf(fp, " ===> DIFF: %" _MEMCHECK_TOU_PRIdZ " bytes (0x%" _MEMCHECK_TOU_PRIxZ ") \n",
-			_memcheck_g_stats.total_alloc_size - _memcheck_g_stats.total_free_size,
-			_memcheck_g_stats.total_alloc_size - _memcheck_g_stats.total_free_size);
-	} else if (_memcheck_g_stats.total_free_size > _memcheck_g_stats.total_alloc_size) {
-		fprintf(fp, " ===> FREE() SURPLUS: %" _MEMCHECK_TOU_PRIdZ " bytes (0x%" _MEMCHECK_TOU_PRIxZ ") \n",
-			_memcheck_g_stats.total_free_size - _memcheck_g_stats.total_alloc_size,
-			_memcheck_g_stats.total_free_size - _memcheck_g_stats.total_alloc_size);
-		fprintf(fp, " ===> THIS SHOULDN'T HAPPEN, CHECK LOGS \n");
-	} else {
-		fprintf(fp, "                   OK.                  \n");
+	n_regressions = memcheck_compare_sites(base, n_base, snap.sites, snap.n_sites, opts, fp);
+	_memcheck_snap_free(&snap);
+	memcheck_free_sites(base, n_base);
+	return n_regressions;
+}
+
+
+static unsigned long _memcheck_getpid(void)
+{
+#ifdef _WIN32
+	return (unsigned long) _getpid();
+#else
+	return (unsigned long) getpid();
+#endif
+}
+
+
+int memcheck_dump_process(const char* dir)
+{
+	char* path;
+	FILE* fp;
+
+	if (dir == NULL)
+		dir = ".";
+	path = (char*) malloc(strlen(dir) + 40);
+	if (path == NULL)
+		return 0;
+	sprintf(path, "%s/memcheck.%lu.json", dir, _memcheck_getpid());
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "[%s] Cannot open %s\n", __func__, path);
+		free(path);
+		return 0;
 	}
-	fprintf(fp, "------------------------------------------\n");
-	fprintf(fp, "\n");
-	fflush(fp);
+	free(path);
+	memcheck_dump(fp);
+	return fclose(fp) == 0;
+}
 
-	/* All is good, no unfreed elements */
-	if (!_memcheck_g_memblocks || _memcheck_tou_llist_len(_memcheck_g_memblocks) < 1) {
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+/********** END REPORT WRITERS **********/
+
+
+/********** CHROME TRACE EXPORT **********/
+
+#ifdef MEMCHECK_ENABLE_TRACE
+static FILE*         _memcheck_g_trace_fp        = NULL; /* Trace being written, NULL if none */
+static size_t        _memcheck_g_trace_n_written = 0;    /* Events written so far (for the separators) */
+static unsigned long _memcheck_g_trace_pid       = 0;
+static double        _memcheck_g_trace_window    = 0.0;  /* Start of the current one-second rate window (us) */
+static size_t        _memcheck_g_trace_in_window = 0;    /* Instant events written in it */
+static size_t        _memcheck_g_trace_dropped   = 0;    /* Instant events dropped over the rate limit */
+static double        _memcheck_g_trace_counted   = 0.0;  /* Time of the last counter events (us) */
+static size_t        _memcheck_g_trace_named     = 0;    /* Thread ids up to this one got a thread_name event */
+
+/* Microseconds on the monotonic clock, which is what Chrome and Perfetto use for their own traces */
+static double _memcheck_trace_now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart * 1e6 / (double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1e6 + (double)ts.tv_nsec / 1e3;
 #endif
-		return 1;
+}
+
+/* Writes everything of an event up to its "args" */
+static void _memcheck_trace_begin(_memcheck_out_t* out, const char* name, const char* ph, double ts, size_t tid)
+{
+	char fields[96];
+	_memcheck_out_str(out, (_memcheck_g_trace_n_written++ > 0) ? ",\n{\"name\":" : "\n{\"name\":");
+	_memcheck_out_json_str(out, name);
+	sprintf(fields, ",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%lu,\"tid\":", ph, ts, _memcheck_g_trace_pid);
+	_memcheck_out_str(out, fields);
+	_memcheck_out_uz(out, tid);
+}
+
+static void _memcheck_trace_arg(_memcheck_out_t* out, int first, const char* name, size_t v)
+{
+	_memcheck_out_str(out, first ? "{" : ",");
+	_memcheck_out_json_str(out, name);
+	_memcheck_out_write(out, ":", 1);
+	_memcheck_out_uz(out, v);
+}
+
+static void _memcheck_trace_counters(_memcheck_out_t* out, double ts)
+{
+	_memcheck_trace_begin(out, "live bytes", "C", ts, 0);
+	_memcheck_out_str(out, ",\"args\":");
+	_memcheck_trace_arg(out, 1, "requested", _memcheck_g_stats.live_size);
+	_memcheck_trace_arg(out, 0, "usable", _memcheck_g_stats.live_usable);
+	_memcheck_out_str(out, "}}");
+
+	if (_memcheck_g_n_tags > 1) {
+		size_t i;
+		_memcheck_trace_begin(out, "live bytes by tag", "C", ts, 0);
+		_memcheck_out_str(out, ",\"args\":");
+		for (i = 0; i < _memcheck_g_n_tags; i++)
+			_memcheck_trace_arg(out, i == 0, _memcheck_g_tags[i].name, _memcheck_g_tags[i].live_size);
+		_memcheck_out_str(out, "}}");
+	}
+	if (_memcheck_g_n_threads > 1) {
+		_memcheck_thread_t* th;
+		char name[32];
+		_memcheck_trace_begin(out, "live bytes by thread", "C", ts, 0);
+		_memcheck_out_str(out, ",\"args\":");
+		for (th = _memcheck_g_threads; th != NULL; th = th->next) {
+			if (th == _memcheck_g_exited_threads)
+				strcpy(name, "exited threads");
+			else
+				sprintf(name, "thread %lu", (unsigned long)th->stats.id);
+			_memcheck_trace_arg(out, th == _memcheck_g_threads, name, th->stats.live_size);
+		}
+		_memcheck_out_str(out, "}}");
+	}
+	if (_memcheck_g_trace_dropped > 0) {
+		_memcheck_trace_begin(out, "dropped events", "C", ts, 0);
+		_memcheck_out_str(out, ",\"args\":");
+		_memcheck_trace_arg(out, 1, "dropped", _memcheck_g_trace_dropped);
+		_memcheck_out_str(out, "}}");
 	}
+}
 
-	/* If unfreed allocation detected, display them. */
-	{
-		_memcheck_tou_llist_t* elem = _memcheck_tou_llist_get_oldest(_memcheck_g_memblocks);
-		fprintf(fp, "\n-=[ UNFREED ALLOCATIONS DETECTED. ]=-\n");
-		fprintf(fp, "\n-=[ Displaying stored remaining elements: ]=-\n");
-		fflush(fp);
-		while (elem) {
-			_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
-			const int nbytes_default = 20;
-			int nbytes = ((int)meta->size > nbytes_default) ? nbytes_default : (int)meta->size;
-			nbytes = (nbytes < 0) ? nbytes_default : nbytes;
-			fprintf(fp, "  > %p {n=%" _MEMCHECK_TOU_PRIuZ " (0x%" _MEMCHECK_TOU_PRIxZ ")} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "  (first %d bytes...  |%.*s|)\n",
-				elem->dat1, meta->size, meta->size, meta->file, meta->line, nbytes, nbytes, (char*)elem->dat1);
-			elem = _memcheck_tou_llist_get_newer(elem);
+/* Called with the mutex held by every tracked call; writes straight to the FILE*, nothing is buffered by memcheck */
+static void _memcheck_trace_event(const char* name, const void* ptr, size_t size, const char* file, size_t line)
+{
+	_memcheck_out_t out;
+	double now;
+
+	if (_memcheck_g_trace_fp == NULL)
+		return;
+	out.fp = _memcheck_g_trace_fp;
+	out.buf = NULL;
+	out.cap = out.len = 0;
+	now = _memcheck_trace_now();
+
+	if (size >= MEMCHECK_TRACE_LARGE) {
+		if (now - _memcheck_g_trace_window >= 1e6) {
+			_memcheck_g_trace_window = now;
+			_memcheck_g_trace_in_window = 0;
+		}
+		if (_memcheck_g_trace_in_window < MEMCHECK_TRACE_RATE) {
+			_memcheck_thread_t* self = _memcheck_thread_self();
+			size_t tid = (self != NULL) ? self->stats.id : 0;
+			char addr[32];
+			_memcheck_g_trace_in_window += 1;
+			for (; _memcheck_g_trace_named < tid; _memcheck_g_trace_named++) {
+				char thread_name[48];
+				sprintf(thread_name, "memcheck thread %lu", (unsigned long)(_memcheck_g_trace_named + 1));
+				_memcheck_trace_begin(&out, "thread_name", "M", now, _memcheck_g_trace_named + 1);
+				_memcheck_out_str(&out, ",\"args\":{\"name\":");
+				_memcheck_out_json_str(&out, thread_name);
+				_memcheck_out_str(&out, "}}");
+			}
+			_memcheck_trace_begin(&out, name, "i", now, tid);
+			_memcheck_out_str(&out, ",\"s\":\"t\",\"args\":");
+			_memcheck_trace_arg(&out, 1, "size", size);
+			sprintf(addr, "%p", ptr);
+			_memcheck_out_str(&out, ",\"ptr\":");
+			_memcheck_out_json_str(&out, addr);
+			_memcheck_out_str(&out, ",\"file\":");
+			_memcheck_out_json_str(&out, file);
+			_memcheck_trace_arg(&out, 0, "line", line);
+			_memcheck_out_str(&out, "}}");
+		} else {
+			_memcheck_g_trace_dropped += 1;
 		}
-		fprintf(fp, "-=[ Memcheck elements over. ]=-\n\n");
 	}
-	
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
-#endif
-	return 0;
+
+	if (now - _memcheck_g_trace_counted >= MEMCHECK_TRACE_COUNTER_INTERVAL) {
+		_memcheck_g_trace_counted = now;
+		_memcheck_trace_counters(&out, now);
+	}
 }
+#endif /* MEMCHECK_ENABLE_TRACE */
 
 
-void memcheck_stats_reset(void)
+int memcheck_trace_start(FILE* fp)
 {
+#ifdef MEMCHECK_ENABLE_TRACE
+	if (fp == NULL)
+		return 0;
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
 		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return;
+		return 0;
 	}
 #endif
-	memset(&_memcheck_g_stats, 0, sizeof(_memcheck_g_stats));
+	memcheck_trace_stop();
+	_memcheck_g_trace_pid = _memcheck_getpid();
+	_memcheck_g_trace_fp = fp;
+	_memcheck_g_trace_n_written = 0;
+	_memcheck_g_trace_window = 0.0;
+	_memcheck_g_trace_in_window = 0;
+	_memcheck_g_trace_dropped = 0;
+	_memcheck_g_trace_counted = _memcheck_trace_now();
+	_memcheck_g_trace_named = 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	{
+		_memcheck_out_t out;
+		out.fp = fp;
+		out.buf = NULL;
+		out.cap = out.len = 0;
+		_memcheck_trace_counters(&out, _memcheck_g_trace_counted);
+	}
+	fflush(fp);
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+#endif
+	return 1;
+#else
+	(void)fp;
+	return 0;
 #endif
 }
 
 
-void memcheck_cleanup(void)
+void memcheck_trace_stop(void)
 {
-#ifdef MEMCHECK_FIRE_AND_FORGET
-	// Guard against double-cleanup (when FIRE_AND_FORGET is defined but
-	//  memcheck_cleanup() was also called manually before quitting)
-	if (_memcheck_g_fnf_cleanup_done)
-		return;
-	_memcheck_g_fnf_cleanup_done = 1;
-#endif
-
+#ifdef MEMCHECK_ENABLE_TRACE
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
 		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
 		return;
 	}
 #endif
-	if (_memcheck_g_manages_devnull) {
-		fclose(_memcheck_g_status_fp);
-		_memcheck_g_status_fp = NULL;
-		_memcheck_g_manages_devnull = 0;
+	if (_memcheck_g_trace_fp != NULL) {
+		_memcheck_out_t out;
+		out.fp = _memcheck_g_trace_fp;
+		out.buf = NULL;
+		out.cap = out.len = 0;
+		_memcheck_trace_counters(&out, _memcheck_trace_now());
+		fprintf(_memcheck_g_trace_fp, "\n]}\n");
+		fflush(_memcheck_g_trace_fp);
+		_memcheck_g_trace_fp = NULL;
 	}
-	
-	if (!_memcheck_g_memblocks) {
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
-		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
 #endif
-		return;
-	}
-
-#ifdef MEMCHECK_PURGE_ON_CLEANUP
-	memcheck_purge_remaining();
 #endif
-	_memcheck_tou_llist_destroy(_memcheck_g_memblocks);
-	_memcheck_g_memblocks = NULL;
+}
 
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_g_mutex_init_successful) {
-		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
-		_memcheck_tou_thread_mutex_destroy(&_memcheck_g_mutex);
-	}
+/********** END CHROME TRACE EXPORT **********/
+
+
+/********** FORK SUPPORT **********/
+
+static unsigned long _memcheck_g_forked_pid = 0; /* Process that last took over its parent's blocks */
+
+#if defined(MEMCHECK_ENABLE_THREADSAFETY) && !defined(_WIN32)
+/* Flushes the streams memcheck writes to, so that a child doesn't inherit their buffers. Call with the mutex held. */
+static void _memcheck_fork_flush(void)
+{
+	if (_memcheck_g_status_fp != NULL)
+		fflush(_memcheck_g_status_fp);
+#ifdef MEMCHECK_ENABLE_TRACE
+	if (_memcheck_g_trace_fp != NULL)
+		fflush(_memcheck_g_trace_fp);
 #endif
 }
+#endif
 
+/* The parent's memory stays out of the child's call-site counters, so that the dumps of all workers
+   add up to what the workers themselves hold (the parent's own dump has the rest) */
+static void _memcheck_fork_detach_site(_memcheck_meta_t* meta)
+{
+	_memcheck_site_t* site = meta->site;
+	if (site != NULL) {
+		site->stats.n_live      -= 1;
+		site->stats.live_size   -= meta->size;
+		site->stats.live_usable -= meta->usable;
+	}
+	meta->site = NULL;
+	meta->origin = NULL; /* Resizes in the child don't add to the parent's realloc chains either */
+}
 
-void memcheck_purge_remaining(void)
+/* Moves the parent's blocks into the permanent set and starts the counters over, without output.
+   Returns 0 if `pid` already did. Call with the mutex held, or from the atfork child handler. */
+static int _memcheck_fork_take_over(unsigned long pid, size_t* n_inherited)
 {
+#ifdef _WIN32
+	(void)pid;
+	*n_inherited = 0;
+	return 0;
+#else
 	_memcheck_tou_llist_t* elem;
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
-		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return;
-	}
-#endif
-	if (!_memcheck_g_memblocks) {
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-		_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+	_memcheck_tou_llist_t* oldest;
+	size_t n_moved = 0, moved_size = 0;
+
+	if (_memcheck_g_forked_pid == pid)
+		return 0;
+	_memcheck_g_forked_pid = pid;
+	_memcheck_g_block_cursors = NULL; /* Their writers are threads of the parent */
+
+	/* The parent's trace and segment are not the child's to write (the parent unlinks the segment) */
+#ifdef MEMCHECK_ENABLE_TRACE
+	_memcheck_g_trace_fp = NULL;
 #endif
-		return;
+#ifdef _MEMCHECK_SHM_SUPPORTED
+	if (_memcheck_g_shm != NULL) {
+		munmap((void*)_memcheck_g_shm, sizeof(*_memcheck_g_shm));
+		_memcheck_g_shm = NULL;
 	}
-
-	elem = _memcheck_tou_llist_get_newest(_memcheck_g_memblocks);
-#if !defined(MEMCHECK_NO_OUTPUT) && !defined(MEMCHECK_FIRE_AND_FORGET)
-	fprintf(memcheck_get_status_fp(), "\n-=[! Purging remaining elements... !]=-\n");
 #endif
 
-	while (elem) {
+	for (elem = _memcheck_g_permanent; elem != NULL; elem = _memcheck_tou_llist_get_older(elem)) {
 		_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
-		_memcheck_tou_llist_t* older;
-	
-#ifndef MEMCHECK_NO_OUTPUT
-		const int nbytes_default = 20;
-		int nbytes = ((int)meta->size > nbytes_default) ? nbytes_default : (int)meta->size;
-		nbytes = (nbytes < 0) ? nbytes_default : nbytes;
-	#if !defined(MEMCHECK_FIRE_AND_FORGET)
-		fprintf(memcheck_get_status_fp(), "  %% Freeing %p... {n=%" _MEMCHECK_TOU_PRIuZ "} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "  (first %d bytes...  |%.*s|)\n",
-			elem->dat1, meta->size, meta->file, meta->line, nbytes, nbytes, (char*)elem->dat1);
-		fflush(memcheck_get_status_fp());
-	#endif
-#endif
-		free(elem->dat1);
-		
-		_memcheck_g_stats.n_frees += 1;
-		_memcheck_g_stats.total_free_size += meta->size;
+		meta->flags |= _MEMCHECK_META_INHERITED;
+		_memcheck_fork_detach_site(meta);
+	}
 
-		/* Don't forget to destroy storage otherwise we might get double free's */
-		older = _memcheck_tou_llist_get_older(elem);
-		if (_memcheck_tou_llist_is_head(elem)) {
-			_memcheck_g_memblocks = older;
+	/* The live list is spliced onto the permanent one as a whole; no node is copied */
+	oldest = _memcheck_tou_llist_get_oldest(_memcheck_g_memblocks);
+	for (elem = oldest; elem != NULL; elem = _memcheck_tou_llist_get_newer(elem)) {
+		_memcheck_meta_t* meta = (_memcheck_meta_t*) elem->dat2;
+		meta->flags |= _MEMCHECK_META_PERMANENT | _MEMCHECK_META_INHERITED;
+		_memcheck_fork_detach_site(meta);
+		n_moved += 1;
+		moved_size += meta->size;
+	}
+	if (oldest != NULL) {
+		if (_memcheck_g_permanent != NULL) {
+			_memcheck_g_permanent->next = oldest;
+			oldest->prev = _memcheck_g_permanent;
 		}
-		_memcheck_tou_llist_remove(elem);
-		elem = older;
+		_memcheck_g_permanent = _memcheck_g_memblocks;
+		_memcheck_g_memblocks = NULL;
 	}
-
-#if !defined(MEMCHECK_NO_OUTPUT) && !defined(MEMCHECK_FIRE_AND_FORGET)
-	fprintf(memcheck_get_status_fp(), "-=[! Purge done. !]=-\n");
-#endif
-#ifdef MEMCHECK_ENABLE_THREADSAFETY
-	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
+	_memcheck_g_stats.n_permanent += n_moved;
+	_memcheck_g_stats.permanent_size += moved_size;
+	*n_inherited = _memcheck_g_stats.n_permanent;
+
+	/* From here on the child's reports describe its own activity. The inherited blocks count as
+	   acquired, so that the balance of memcheck_stats() holds when the child frees them */
+	_memcheck_stats_reset_locked();
+	_memcheck_g_stats.n_total_allocs = *n_inherited;
+	_memcheck_g_stats.total_alloc_size = _memcheck_g_stats.permanent_size;
+	return 1;
 #endif
 }
 
-
-_memcheck_tou_llist_t** memcheck_get_memblocks(void)
+size_t memcheck_after_fork(void)
 {
-	_memcheck_tou_llist_t** mblk;
+	size_t n_inherited = 0;
+	unsigned long pid = _memcheck_getpid();
+
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	if (_memcheck_tou_thread_mutex_lock(&_memcheck_g_mutex) != 0) {
 		fprintf(stderr, "[%s] Unexpected mutex lock failure\n", __func__);
-		return NULL;
+		return 0;
 	}
 #endif
-	mblk = &_memcheck_g_memblocks;
+	if (_memcheck_fork_take_over(pid, &n_inherited)) {
+		_memcheck_g_dispatch.log("[FORK   ] pid %lu inherited %" _MEMCHECK_TOU_PRIuZ " blocks {n=%" _MEMCHECK_TOU_PRIuZ "}\n",
+			pid, n_inherited, _memcheck_g_stats.permanent_size);
+	}
 #ifdef MEMCHECK_ENABLE_THREADSAFETY
 	_memcheck_tou_thread_mutex_unlock(&_memcheck_g_mutex);
 #endif
-	return mblk;
+	return n_inherited;
 }
 
+/********** END FORK SUPPORT **********/
+
+
 /**
 	This option acts as a "I don't want to care about cleaning up the library" or as
 	a (certified even c00l3r™) "I want you to pick up my garbage after im done running" option.
@@ -1238,7 +7785,7 @@ _memcheck_tou_llist_t** memcheck_get_memblocks(void)
 /**********************************************************************************************/
 /*  These will always get defined (unless memcheck is disabled, and they are not overridden)  */
 /**********************************************************************************************/
-#ifndef MEMCHECK_IGNORE
+#if !defined(MEMCHECK_IGNORE) && !defined(MEMCHECK_TU_DISABLE)
 #	ifndef malloc
 #		define malloc(size)           memcheck_malloc(size, __FILE__, __LINE__)
 #	endif
@@ -1252,3 +7799,18 @@ _memcheck_tou_llist_t** memcheck_get_memblocks(void)
 #		define free(ptr)              memcheck_free(ptr, __FILE__, __LINE__)
 #	endif
 #endif
+/* Allocations meant to live for the whole program (see memcheck_mark_permanent()) */
+#ifndef malloc_permanent
+#	ifdef MEMCHECK_TU_DISABLE
+#		define malloc_permanent(size)      malloc(size)
+#	else
+#		define malloc_permanent(size)      memcheck_malloc_permanent(size, __FILE__, __LINE__)
+#	endif
+#endif
+#ifndef calloc_permanent
+#	ifdef MEMCHECK_TU_DISABLE
+#		define calloc_permanent(num, size) calloc(num, size)
+#	else
+#		define calloc_permanent(num, size) memcheck_calloc_permanent(num, size, __FILE__, __LINE__)
+#	endif
+#endif
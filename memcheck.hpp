@@ -0,0 +1,327 @@
+/*
+	memcheck.hpp
+
+	Copyright (C) 2025 m30ws MIT license (see memcheck.h)
+
+	----------------------------------------
+
+	C++98 companion of memcheck.h: a tracking allocator for standard containers and RAII helpers.
+
+	Include it instead of memcheck.h in C++ files (MEMCHECK_IMPLEMENTATION and the other
+	  options work the same, define them before the include):
+	```
+	  #include "memcheck.hpp"
+
+	  std::vector<Item, memcheck::allocator<Item> > items;          // tracked, tagged "Item"
+	  std::vector<Item, memcheck::allocator<Item> > more(MEMCHECK_HERE); // + this line as the call site
+	  std::map<int, Item, std::less<int>, memcheck::allocator<std::pair<const int, Item> > >
+	      by_id(std::less<int>(), MEMCHECK_HERE);
+	```
+	  Every allocation made through memcheck::allocator<T> is tagged with the name of T (see
+	  memcheck_push_tag()), so growth of containers (vector doubling, rehashes, tree/list nodes)
+	  is attributed per element type. The name is taken from the compiler's signature of a
+	  template function, interned once per type; allocating is a push/pop of an integer tag.
+	  Rebinding (node types, bucket arrays) keeps the tag and site of the original allocator;
+	  note that some standard libraries default-construct the rebound allocators of default-
+	  constructed node containers, which then get tagged with the node type instead
+	  (pass MEMCHECK_HERE to the container to avoid that).
+
+	Tag ids are only valid until memcheck_cleanup(); the per-type tags are interned again on
+	  first use after it (see memcheck_get_tag_epoch()).
+*/
+
+#ifndef _MEMCHECK_HPP_
+#define _MEMCHECK_HPP_
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <limits>
+#if __cplusplus >= 201103L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201103L)
+#	include <utility>
+#	define _MEMCHECK_HPP_CXX11
+#endif
+
+#include "memcheck.h"
+
+
+/* Converts to any memcheck::allocator<T>, making the current line the call site of its allocations */
+#define MEMCHECK_HERE memcheck::site(__FILE__, __LINE__)
+
+
+namespace memcheck {
+
+namespace detail {
+
+/* The compiler's signature of this function names T, e.g. "... [with T = int]" */
+template <class T>
+const char* signature()
+{
+#if defined(_MSC_VER)
+	return __FUNCSIG__;
+#elif defined(__GNUC__) || defined(__clang__)
+	return __PRETTY_FUNCTION__;
+#else
+	return "(unknown type)";
+#endif
+}
+
+/* Cuts the type out of signature<T>() and interns it as a tag; runs once per type */
+inline size_t intern_type(const char* sig)
+{
+	char name[256];
+	const char* begin = sig;
+	const char* end = sig + std::strlen(sig);
+	const char* at;
+	size_t n;
+
+	if ((at = std::strstr(sig, "T = ")) != NULL) {                /* GCC, Clang */
+		begin = at + 4;
+		for (at = begin; at < end && *at != ';'; at++)
+			;
+		end = (at < end) ? at : end - 1;                          /* Up to "; ..." or the closing ']' */
+	} else if ((at = std::strstr(sig, "signature<")) != NULL) {   /* MSVC: "...signature<int>(void)" */
+		begin = at + 10;
+		end -= (end - begin >= 7) ? 7 : 0;                        /* ">(void)" */
+	}
+	n = (size_t)(end - begin);
+	if (n >= sizeof(name))
+		n = sizeof(name) - 1;
+	std::memcpy(name, begin, n);
+	name[n] = '\0';
+	return memcheck_intern_tag(name);
+}
+
+typedef size_t (*tag_fn_t)();
+
+/* Acquire/release access to the ids cached by type_tag<>, which every allocating thread reads */
+inline size_t load_acquire(const size_t& value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __atomic_load_n(&value, __ATOMIC_ACQUIRE);
+#else
+	return *static_cast<const volatile size_t*>(&value); /* MSVC gives volatile acquire semantics (/volatile:ms) */
+#endif
+}
+
+inline void store_release(size_t& target, size_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	__atomic_store_n(&target, value, __ATOMIC_RELEASE);
+#else
+	*static_cast<volatile size_t*>(&target) = value;
+#endif
+}
+
+} /* namespace detail */
+
+
+/* Tag id named after T (interned on first use, and again after memcheck_cleanup() dropped the tag table) */
+template <class T>
+size_t type_tag()
+{
+	static size_t id = 0;
+	static size_t epoch = 0;
+	size_t now = memcheck_get_tag_epoch();
+	if (detail::load_acquire(epoch) != now) {
+		size_t fresh = detail::intern_type(detail::signature<T>());
+		/* The id is published before the epoch, so whoever sees the current epoch also sees its id */
+		detail::store_release(id, fresh);
+		detail::store_release(epoch, now);
+		return fresh;
+	}
+	return detail::load_acquire(id);
+}
+
+
+/* Where a container was set up (see MEMCHECK_HERE) */
+struct site
+{
+	site(const char* file_, size_t line_) : file(file_), line(line_) {}
+	const char* file;
+	size_t      line;
+};
+
+
+/* Standard allocator that goes through memcheck, tagging every block with the element type */
+template <class T>
+class allocator
+{
+public:
+	typedef T              value_type;
+	typedef T*             pointer;
+	typedef const T*       const_pointer;
+	typedef T&             reference;
+	typedef const T&       const_reference;
+	typedef std::size_t    size_type;
+	typedef std::ptrdiff_t difference_type;
+
+	template <class U> struct rebind { typedef allocator<U> other; };
+
+	allocator() throw()
+		: file_("(memcheck::allocator)"), line_(0), tag_fn_(&type_tag<T>) {}
+	allocator(const site& where) throw()
+		: file_(where.file), line_(where.line), tag_fn_(&type_tag<T>) {}
+	allocator(const allocator& other) throw()
+		: file_(other.file_), line_(other.line_), tag_fn_(other.tag_fn_) {}
+	template <class U>
+	allocator(const allocator<U>& other) throw()
+		: file_(other.file()), line_(other.line()), tag_fn_(other.tag_fn()) {}
+
+	pointer       address(reference x) const       { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	size_type max_size() const throw() { return std::numeric_limits<size_type>::max() / sizeof(T); }
+
+	pointer allocate(size_type n, const void* hint = 0)
+	{
+		void* p;
+		(void)hint;
+		if (n > max_size())
+			throw std::bad_alloc();
+		memcheck_push_tag_id(tag_fn_());
+		p = memcheck_malloc(n * sizeof(T), file_, line_);
+		memcheck_pop_tag();
+		if (p == NULL && n != 0)
+			throw std::bad_alloc();
+		return static_cast<pointer>(p);
+	}
+
+	void deallocate(pointer p, size_type n)
+	{
+		(void)n;
+		memcheck_free(p, file_, line_);
+	}
+
+#ifdef _MEMCHECK_HPP_CXX11
+	template <class U, class... Args>
+	void construct(U* p, Args&&... args) { ::new((void*)p) U(std::forward<Args>(args)...); }
+	template <class U>
+	void destroy(U* p) { p->~U(); }
+#else
+	void construct(pointer p, const T& value) { ::new((void*)p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+#endif
+
+	const char*      file() const   { return file_; }
+	size_t           line() const   { return line_; }
+	size_t           tag() const    { return tag_fn_(); }
+	detail::tag_fn_t tag_fn() const { return tag_fn_; }
+
+private:
+	const char*      file_;
+	size_t           line_;
+	detail::tag_fn_t tag_fn_;  /* type_tag<> of the type the allocator was made for (kept through rebinding) */
+};
+
+/* All instances allocate from the same heap, so any of them can free what another allocated */
+template <class T, class U>
+bool operator==(const allocator<T>&, const allocator<U>&) throw() { return true; }
+template <class T, class U>
+bool operator!=(const allocator<T>&, const allocator<U>&) throw() { return false; }
+
+
+/* { memcheck::tag_guard guard("parser"); ... } */
+typedef ::memcheck_tag_guard tag_guard;
+
+
+/* Tags everything allocated in the scope with the name of T:  { memcheck::type_tag_guard<Parser> guard; ... } */
+template <class T>
+class type_tag_guard
+{
+public:
+	type_tag_guard()  { memcheck_push_tag_id(type_tag<T>()); }
+	~type_tag_guard() { memcheck_pop_tag(); }
+private:
+	type_tag_guard(const type_tag_guard&);
+	type_tag_guard& operator=(const type_tag_guard&);
+};
+
+
+/*
+	Notes the generation counter and, when it goes out of scope, lists the blocks allocated (or
+	  resized) in the scope that are still live, so a leak shows even if the scope also freed
+	  older blocks:
+	  { memcheck::scope_check check("request"); handle(req); }
+	Output goes to `fp` (NULL -> memcheck_get_status_fp()), nothing is printed if no such block is left.
+	At most MEMCHECK_STATS_TOP_LEAKS blocks are listed one by one.
+*/
+class scope_check
+{
+public:
+	explicit scope_check(const char* name, FILE* fp = NULL)
+		: name_(name), fp_(fp), generation_(memcheck_get_generation()) { memcheck_get_stats(&before_); }
+
+	~scope_check()
+	{
+		found f;
+		size_t i;
+		FILE* fp;
+
+		f.n_blocks = 0;
+		f.size = 0;
+		memcheck_foreach_block_since(generation_, &scope_check::collect, &f);
+		if (f.n_blocks == 0)
+			return;
+		fp = (fp_ != NULL) ? fp_ : memcheck_get_status_fp();
+		std::fprintf(fp, "[SCOPE  ] %s: %" _MEMCHECK_TOU_PRIuZ " blocks, %" _MEMCHECK_TOU_PRIuZ " bytes allocated in the scope still live\n",
+			name_, f.n_blocks, f.size);
+		for (i = 0; i < f.n_blocks && i < MEMCHECK_STATS_TOP_LEAKS; i++) {
+			std::fprintf(fp, "  > %p {n=%" _MEMCHECK_TOU_PRIuZ "} :: FROM: %s ; L%" _MEMCHECK_TOU_PRIuZ "\n", f.blocks[i].ptr,
+				f.blocks[i].size, f.blocks[i].file, f.blocks[i].line);
+		}
+		if (f.n_blocks > MEMCHECK_STATS_TOP_LEAKS)
+			std::fprintf(fp, "  ... and %" _MEMCHECK_TOU_PRIuZ " more\n", (size_t)(f.n_blocks - MEMCHECK_STATS_TOP_LEAKS));
+	}
+
+	/* Change of the live counters since construction (negative if the scope freed older blocks) */
+	long live_blocks() const
+	{
+		_memcheck_stats_t now;
+		memcheck_get_stats(&now);
+		return (long)(now.n_live - before_.n_live);
+	}
+	long live_bytes() const
+	{
+		_memcheck_stats_t now;
+		memcheck_get_stats(&now);
+		return (long)(now.live_size - before_.live_size);
+	}
+
+	const _memcheck_stats_t& before() const { return before_; }
+	size_t generation() const { return generation_; }
+
+private:
+	scope_check(const scope_check&);
+	scope_check& operator=(const scope_check&);
+
+	struct found
+	{
+		_memcheck_block_info_t blocks[MEMCHECK_STATS_TOP_LEAKS];
+		size_t                 n_blocks;
+		size_t                 size;
+	};
+
+	/* Runs on memcheck's snapshot, so printing waits until the iteration is over */
+	static int collect(const _memcheck_block_info_t* block, void* ctx)
+	{
+		found* f = static_cast<found*>(ctx);
+		if (block->permanent)
+			return 0;
+		if (f->n_blocks < MEMCHECK_STATS_TOP_LEAKS)
+			f->blocks[f->n_blocks] = *block;
+		f->n_blocks += 1;
+		f->size += block->size;
+		return 0;
+	}
+
+	const char*       name_;
+	FILE*             fp_;
+	size_t            generation_;
+	_memcheck_stats_t before_;
+};
+
+} /* namespace memcheck */
+
+#endif /* _MEMCHECK_HPP_ */
@@ -0,0 +1,86 @@
+/*
+	memcheck-diff: compares the per-site counters of a report with a baseline and fails on
+	  regressions, for CI gates. Reports are documents written by memcheck_dump(),
+	  memcheck_dump_process(), memcheck_report_json() with MEMCHECK_REPORT_SITES or memcheck-merge -j.
+
+	Usage: memcheck-diff [options] <baseline.json> <current.json>
+	  -a pct  max growth of allocations per site and in total (default 10, -1: not checked)
+	  -b pct  max growth of allocated bytes (default: not checked)
+	  -p pct  max growth of peak bytes (default: not checked)
+	  -l pct  max growth of live bytes (default: not checked)
+	  -L      do not fail on sites that leave live blocks behind and did not in the baseline
+	  -m n    do not check the growth of sites with fewer than n allocations in both reports
+	  -v      also list the changes within the limits
+
+	Exits with 1 if there are regressions, 2 on usage or file errors, 0 otherwise.
+*/
+
+#define MEMCHECK_IMPLEMENTATION
+#define MEMCHECK_IGNORE      /* Only memcheck_load_sites() and memcheck_compare_sites() are needed */
+#include "../memcheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-a pct] [-b pct] [-p pct] [-l pct] [-L] [-m n] [-v] <baseline.json> <current.json>\n", prog);
+}
+
+
+static size_t load(const char* prog, const char* path, _memcheck_site_stats_t** sites)
+{
+	size_t n;
+	FILE* fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: cannot open %s\n", prog, path);
+		exit(2);
+	}
+	n = memcheck_load_sites(fp, sites);
+	fclose(fp);
+	return n;
+}
+
+
+int main(int argc, char** argv)
+{
+	_memcheck_compare_opts_t opts;
+	_memcheck_site_stats_t* base;
+	_memcheck_site_stats_t* cur;
+	size_t n_base, n_cur, n_regressions;
+	int i;
+
+	memcheck_compare_defaults(&opts);
+	for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+		const char* opt = argv[i];
+		if (strcmp(opt, "-L") == 0) {
+			opts.new_leaks = 0;
+		} else if (strcmp(opt, "-v") == 0) {
+			opts.verbose = 1;
+		} else if (strcmp(opt, "-m") == 0 && i + 1 < argc) {
+			opts.min_allocs = (size_t) strtoul(argv[++i], NULL, 10);
+		} else if (strlen(opt) == 2 && strchr("abpl", opt[1]) != NULL && i + 1 < argc) {
+			double pct = atof(argv[++i]);
+			if (opt[1] == 'a')      opts.max_allocs_growth = pct;
+			else if (opt[1] == 'b') opts.max_bytes_growth = pct;
+			else if (opt[1] == 'p') opts.max_peak_growth = pct;
+			else                    opts.max_live_growth = pct;
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (argc - i != 2) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	n_base = load(argv[0], argv[i], &base);
+	n_cur = load(argv[0], argv[i + 1], &cur);
+	n_regressions = memcheck_compare_sites(base, n_base, cur, n_cur, &opts, stdout);
+	memcheck_free_sites(base, n_base);
+	memcheck_free_sites(cur, n_cur);
+	return (n_regressions > 0) ? 1 : 0;
+}
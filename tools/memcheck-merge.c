@@ -0,0 +1,207 @@
+/*
+	memcheck-merge: adds up the per-site counters of several reports, e.g. the dumps every worker
+	  of a prefork server writes with memcheck_dump_process(). Any document written by
+	  memcheck_dump() or memcheck_report_json() with MEMCHECK_REPORT_SITES works.
+
+	Usage: memcheck-merge [-j] [-n count] <report.json>...
+	  -j  write the merged sites as a JSON document (readable by memcheck_load_sites() again)
+	      instead of a table
+	  -n  list only this many sites, most live bytes first (default: all)
+
+	Counters are summed over the reports, so peak_size is the sum of the per-process peaks
+	  (an upper bound of the combined peak).
+*/
+
+#define MEMCHECK_IMPLEMENTATION
+#define MEMCHECK_IGNORE      /* Only memcheck_load_sites() is needed */
+#include "../memcheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct {
+	_memcheck_site_stats_t stats;
+	size_t                 n_procs; /* Reports the site appears in */
+} merged_site_t;
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-j] [-n count] <report.json>...\n", prog);
+}
+
+
+static int by_site(const void* a, const void* b)
+{
+	const merged_site_t* x = (const merged_site_t*) a;
+	const merged_site_t* y = (const merged_site_t*) b;
+	int c = strcmp(x->stats.file, y->stats.file);
+	if (c != 0)
+		return c;
+	return (x->stats.line > y->stats.line) - (x->stats.line < y->stats.line);
+}
+
+
+static int by_live_size(const void* a, const void* b)
+{
+	const merged_site_t* x = (const merged_site_t*) a;
+	const merged_site_t* y = (const merged_site_t*) b;
+	if (x->stats.live_size != y->stats.live_size)
+		return (x->stats.live_size < y->stats.live_size) ? 1 : -1;
+	return by_site(a, b);
+}
+
+
+static void add_site(_memcheck_site_stats_t* into, const _memcheck_site_stats_t* site)
+{
+	into->n_allocs    += site->n_allocs;
+	into->n_reallocs  += site->n_reallocs;
+	into->n_frees     += site->n_frees;
+	into->alloc_size  += site->alloc_size;
+	into->free_size   += site->free_size;
+	into->n_live      += site->n_live;
+	into->live_size   += site->live_size;
+	into->peak_size   += site->peak_size;
+	into->live_usable += site->live_usable;
+}
+
+
+static void print_json_str(const char* s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", (unsigned) c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+
+static void print_json(const merged_site_t* sites, size_t n, size_t n_reports)
+{
+	size_t i;
+	printf("{\n\"reports\": %lu,\n\"sites\": [", (unsigned long) n_reports);
+	for (i = 0; i < n; i++) {
+		const _memcheck_site_stats_t* s = &sites[i].stats;
+		printf((i > 0) ? ",\n{\"file\":" : "\n{\"file\":");
+		print_json_str(s->file);
+		printf(",\"line\":%lu,\"n_allocs\":%lu,\"n_reallocs\":%lu,\"n_frees\":%lu,\"alloc_size\":%lu,\"free_size\":%lu"
+		       ",\"n_live\":%lu,\"live_size\":%lu,\"peak_size\":%lu,\"live_usable\":%lu,\"n_procs\":%lu}",
+			(unsigned long) s->line, (unsigned long) s->n_allocs, (unsigned long) s->n_reallocs,
+			(unsigned long) s->n_frees, (unsigned long) s->alloc_size, (unsigned long) s->free_size,
+			(unsigned long) s->n_live, (unsigned long) s->live_size, (unsigned long) s->peak_size,
+			(unsigned long) s->live_usable, (unsigned long) sites[i].n_procs);
+	}
+	printf("\n]\n}\n");
+}
+
+
+static void print_table(const merged_site_t* sites, size_t n, size_t n_reports)
+{
+	size_t i, allocs = 0, live = 0;
+	printf("memcheck-merge :: %lu reports, %lu sites\n\n", (unsigned long) n_reports, (unsigned long) n);
+	printf("  %-48s %6s %10s %10s %14s %14s\n", "SITE", "PROCS", "ALLOCS", "BLOCKS", "LIVE BYTES", "PEAK BYTES");
+	for (i = 0; i < n; i++) {
+		const _memcheck_site_stats_t* s = &sites[i].stats;
+		char where[128];
+		sprintf(where, "%.96s:%lu", s->file, (unsigned long) s->line);
+		printf("  %-48s %6lu %10lu %10lu %14lu %14lu\n", where, (unsigned long) sites[i].n_procs,
+			(unsigned long) s->n_allocs, (unsigned long) s->n_live, (unsigned long) s->live_size,
+			(unsigned long) s->peak_size);
+		allocs += s->n_allocs;
+		live += s->live_size;
+	}
+	printf("\n  Total of the listed sites: %lu allocations, %lu live bytes\n", (unsigned long) allocs, (unsigned long) live);
+}
+
+
+int main(int argc, char** argv)
+{
+	merged_site_t* all = NULL;
+	size_t n_all = 0, n_reports = 0, n_merged = 0;
+	long max = -1;
+	int json = 0;
+	int i;
+	size_t k;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (strcmp(argv[i], "-j") == 0) {
+			json = 1;
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			max = atol(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (i >= argc) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	for (; i < argc; i++) {
+		_memcheck_site_stats_t* sites;
+		merged_site_t* grown;
+		size_t n;
+		FILE* fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+			return 1;
+		}
+		n = memcheck_load_sites(fp, &sites);
+		fclose(fp);
+		n_reports++;
+		if (n == 0)
+			continue;
+		grown = (merged_site_t*) realloc(all, (n_all + n) * sizeof(*all));
+		if (grown == NULL) {
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+		all = grown;
+		/* The file names are kept, so only the array itself is released */
+		for (k = 0; k < n; k++) {
+			all[n_all + k].stats = sites[k];
+			all[n_all + k].n_procs = 1;
+		}
+		n_all += n;
+		free(sites);
+	}
+
+	/* Sort by site and fold equal neighbours into the first of them */
+	if (n_all > 0)
+		qsort(all, n_all, sizeof(*all), by_site);
+	for (k = 0; k < n_all; k++) {
+		if (n_merged > 0 && by_site(&all[n_merged - 1], &all[k]) == 0) {
+			add_site(&all[n_merged - 1].stats, &all[k].stats);
+			all[n_merged - 1].n_procs += 1;
+			free((char*) all[k].stats.file);
+		} else {
+			all[n_merged++] = all[k];
+		}
+	}
+	if (n_merged > 0)
+		qsort(all, n_merged, sizeof(*all), by_live_size);
+	if (max >= 0 && (size_t) max < n_merged) {
+		for (k = (size_t) max; k < n_merged; k++)
+			free((char*) all[k].stats.file);
+		n_merged = (size_t) max;
+	}
+
+	if (json)
+		print_json(all, n_merged, n_reports);
+	else
+		print_table(all, n_merged, n_reports);
+
+	for (k = 0; k < n_merged; k++)
+		free((char*) all[k].stats.file);
+	free(all);
+	return 0;
+}
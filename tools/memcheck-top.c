@@ -0,0 +1,129 @@
+/*
+	memcheck-top: a live view of the statistics a process publishes with memcheck_shm_open()
+	  (built with MEMCHECK_ENABLE_SHM). Reading the segment needs no cooperation from the
+	  monitored process: it is mapped read-only and polled.
+
+	Usage: memcheck-top [-i seconds] [-n count] <pid | /segment-name>
+	  -i  refresh interval (default 1)
+	  -n  exit after this many refreshes (default: until the process exits)
+*/
+
+#define MEMCHECK_IMPLEMENTATION
+#define MEMCHECK_IGNORE      /* Only the segment layout and memcheck_shm_read() are needed */
+#define MEMCHECK_ENABLE_SHM
+#include "../memcheck.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static void usage(const char* prog)
+{
+	fprintf(stderr, "Usage: %s [-i seconds] [-n count] <pid | /segment-name>\n", prog);
+}
+
+
+static void print_snapshot(const _memcheck_shm_t* s, int clear)
+{
+	size_t i;
+
+	if (clear)
+		printf("\033[H\033[2J");
+	printf("memcheck-top :: pid %lu, %lu updates\n\n", (unsigned long) s->pid, (unsigned long) s->n_updates);
+	printf("  Live:      %lu blocks, %lu bytes (peak %lu bytes)\n",
+		(unsigned long) s->stats.n_live, (unsigned long) s->stats.live_size, (unsigned long) s->stats.peak_size);
+	printf("  Permanent: %lu blocks, %lu bytes\n",
+		(unsigned long) s->stats.n_permanent, (unsigned long) s->stats.permanent_size);
+	printf("  Calls:     %lu malloc, %lu calloc, %lu realloc, %lu free\n",
+		(unsigned long) s->stats.n_mallocs, (unsigned long) s->stats.n_callocs,
+		(unsigned long) s->stats.n_reallocs, (unsigned long) s->stats.n_frees);
+
+	printf("\n  %-32s %10s %14s %14s\n", "TAG", "BLOCKS", "LIVE BYTES", "PEAK BYTES");
+	for (i = 0; i < s->n_tags && i < MEMCHECK_SHM_TAGS; i++)
+		printf("  %-32s %10lu %14lu %14lu\n", s->tags[i].name, (unsigned long) s->tags[i].n_live,
+			(unsigned long) s->tags[i].live_size, (unsigned long) s->tags[i].peak_size);
+
+	printf("\n  %-48s %10s %10s %14s\n", "SITE", "ALLOCS", "BLOCKS", "LIVE BYTES");
+	for (i = 0; i < s->n_sites && i < MEMCHECK_SHM_SITES; i++) {
+		char where[128];
+		sprintf(where, "%.96s:%lu", s->sites[i].file, (unsigned long) s->sites[i].line);
+		printf("  %-48s %10lu %10lu %14lu\n", where, (unsigned long) s->sites[i].n_allocs,
+			(unsigned long) s->sites[i].n_live, (unsigned long) s->sites[i].live_size);
+	}
+	fflush(stdout);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* target = NULL;
+	unsigned interval = 1;
+	long count = -1;
+	char name[64];
+	struct stat st;
+	const _memcheck_shm_t* shm;
+	_memcheck_shm_t snap;
+	void* addr;
+	int fd, i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			interval = (unsigned) atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			count = atol(argv[++i]);
+		} else if (target == NULL && argv[i][0] != '-') {
+			target = argv[i];
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (target == NULL) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	/* A plain number is a pid, using the default segment name of memcheck_shm_open(NULL) */
+	if (strspn(target, "0123456789") == strlen(target))
+		sprintf(name, "/memcheck.%.40s", target);
+	else
+		sprintf(name, "%.63s", target);
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: cannot open shared memory segment %s\n", argv[0], name);
+		return 1;
+	}
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(_memcheck_shm_t)) {
+		fprintf(stderr, "%s: %s is not a memcheck segment (or was built with different MEMCHECK_SHM_* settings)\n", argv[0], name);
+		close(fd);
+		return 1;
+	}
+	addr = mmap(NULL, sizeof(_memcheck_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "%s: cannot map %s\n", argv[0], name);
+		return 1;
+	}
+	shm = (const _memcheck_shm_t*) addr;
+
+	for (;;) {
+		if (!memcheck_shm_read(shm, &snap)) {
+			fprintf(stderr, "%s: %s is not a compatible memcheck segment\n", argv[0], name);
+			return 1;
+		}
+		print_snapshot(&snap, count != 1);
+		if (count > 0 && --count == 0)
+			break;
+		/* The segment outlives a crashed writer, so check that it is still around */
+		if (kill((pid_t) snap.pid, 0) != 0) {
+			printf("\nProcess %lu exited.\n", (unsigned long) snap.pid);
+			break;
+		}
+		sleep(interval);
+	}
+
+	munmap(addr, sizeof(_memcheck_shm_t));
+	return 0;
+}